@@ -0,0 +1,477 @@
+#include "bench.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "events.h"
+#include "hotspots.h"
+#include "logger.h"
+#include "monitor.h"
+#include "mounts.h"
+#include "reactor.h"
+
+/* Backends run through the workloads, in report order */
+static const struct {
+	backend_t backend;
+	const char *name;
+} backends[] = {
+	{ BACKEND_WATCH, "watch" },
+	{ BACKEND_POLL, "poll" },
+	{ BACKEND_HYBRID, "hybrid" },
+};
+
+/* Static variables for the benchmark process */
+static char root[PATH_MAX_LEN];						/* Scratch library of this backend */
+static bench_expect_t expected[BENCH_MAX_EXPECTED];	/* Directories the current workload changed */
+static int num_expected = 0;						/* Number of expected directories */
+static double changed_at = 0;						/* When the current workload finished changing */
+static bench_step_t *current = NULL;				/* Results of the current workload */
+static bench_result_t result;						/* Results of this backend */
+static bool expired = false;						/* Whether the workload timer fired */
+static long timer_wakeups = 0;						/* Waits ended by the workload timer alone */
+
+/* Monotonic clock in milliseconds */
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Build the absolute path of an entry in the scratch library */
+static const char *bench_path(char *buf, size_t size, const char *rel) {
+	snprintf(buf, size, rel[0] ? "%s/%s" : "%s", root, rel);
+	return buf;
+}
+
+/* Create a directory in the scratch library */
+static bool bench_dir(const char *rel) {
+	char path[PATH_MAX_LEN];
+
+	if (mkdir(bench_path(path, sizeof(path), rel), 0755) != 0) {
+		log_message(LOG_ERR, "Failed to create directory %s: %s", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Write a file in the scratch library, the way a copy would */
+static bool bench_file(const char *rel) {
+	static char data[BENCH_FILE_SIZE];
+	char path[PATH_MAX_LEN];
+
+	int fd = open(bench_path(path, sizeof(path), rel), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_message(LOG_ERR, "Failed to create file %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	bool ok = write(fd, data, sizeof(data)) == (ssize_t) sizeof(data);
+	if (!ok) {
+		log_message(LOG_ERR, "Failed to write file %s: %s", path, strerror(errno));
+	}
+	close(fd);
+	return ok;
+}
+
+/* Rename an entry within the scratch library */
+static bool bench_move(const char *from, const char *to) {
+	char from_path[PATH_MAX_LEN];
+	char to_path[PATH_MAX_LEN];
+
+	if (rename(bench_path(from_path, sizeof(from_path), from),
+			   bench_path(to_path, sizeof(to_path), to)) != 0) {
+		log_message(LOG_ERR, "Failed to rename %s: %s", from_path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Remove one entry during a depth-first walk */
+static int bench_unlink(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	(void) st;
+	(void) type;
+	(void) ftw;
+
+	return remove(path) == 0 ? 0 : -1;
+}
+
+/* Delete a tree in the scratch library */
+static bool bench_remove(const char *rel) {
+	char path[PATH_MAX_LEN];
+
+	if (nftw(bench_path(path, sizeof(path), rel), bench_unlink, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+		log_message(LOG_ERR, "Failed to remove %s: %s", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Build the path of a level of the deep tree below a directory */
+static const char *bench_deep(char *buf, size_t size, const char *base, int depth) {
+	int len = snprintf(buf, size, "%s", base);
+	for (int i = 0; i < depth && len < (int) size; i++) {
+		len += snprintf(buf + len, size - len, "%sl%d", len > 0 ? "/" : "", i);
+	}
+	return buf;
+}
+
+/* Record a directory the current workload changed */
+static void bench_expect(const char *rel) {
+	if (num_expected < BENCH_MAX_EXPECTED) {
+		snprintf(expected[num_expected].path, sizeof(expected[num_expected].path), "%s", rel);
+		expected[num_expected].latency = -1;
+		num_expected++;
+	}
+}
+
+/* Create the library every workload starts from */
+static bool bench_seed(void) {
+	char rel[PATH_MAX_LEN];
+
+	for (int i = 0; i < 4; i++) {
+		char dir[16];
+		snprintf(dir, sizeof(dir), "d%d", i);
+		snprintf(rel, sizeof(rel), "%s/ep.mkv", dir);
+		if (!bench_dir(dir) || !bench_file(rel)) return false;
+	}
+
+	if (!bench_dir("deep") || !bench_dir("target")) return false;
+	for (int depth = 1; depth <= BENCH_DEPTH; depth++) {
+		if (!bench_dir(bench_deep(rel, sizeof(rel), "deep", depth))) return false;
+	}
+	strncat(rel, "/ep.mkv", sizeof(rel) - strlen(rel) - 1);
+	return bench_file(rel);
+}
+
+/* Workload: new files and a new season directory */
+static bool bench_create(void) {
+	bench_expect("d0");
+	bench_expect("d1");
+	return bench_file("d0/new.mkv") && bench_dir("d1/Season 2");
+}
+
+/* Workload: a renamed file and a renamed directory */
+static bool bench_rename(void) {
+	bench_expect("d2");
+	bench_expect("");
+	return bench_move("d2/ep.mkv", "d2/renamed.mkv") && bench_move("d3", "d3.old");
+}
+
+/* Workload: a deleted file and a deleted directory */
+static bool bench_delete(void) {
+	bench_expect("d0");
+	bench_expect("d1");
+	return bench_remove("d0/ep.mkv") && bench_remove("d1/Season 2");
+}
+
+/* Workload: a whole tree moved to another directory */
+static bool bench_deep_move(void) {
+	bench_expect("deep");
+	bench_expect("target");
+	return bench_move("deep/l0", "target/l0");
+}
+
+/* Workload: a file written at the bottom of the moved tree */
+static bool bench_deep_write(void) {
+	char rel[PATH_MAX_LEN];
+
+	bench_expect(bench_deep(rel, sizeof(rel), "target", BENCH_DEPTH));
+	strncat(rel, "/new.mkv", sizeof(rel) - strlen(rel) - 1);
+	return bench_file(rel);
+}
+
+/* Workload: a directory tree copied in at once */
+static bool bench_bulk(void) {
+	char dir[PATH_MAX_LEN];
+	char rel[PATH_MAX_LEN];
+
+	bench_expect("d0");
+	if (!bench_dir("d0/bulk")) return false;
+	for (int i = 0; i < BENCH_BULK_DIRS; i++) {
+		snprintf(dir, sizeof(dir), "d0/bulk/s%02d", i);
+		bench_expect(dir);
+		if (!bench_dir(dir)) return false;
+		for (int j = 0; j < BENCH_BULK_FILES; j++) {
+			snprintf(rel, sizeof(rel), "%s/e%02d.mkv", dir, j);
+			if (!bench_file(rel)) return false;
+		}
+	}
+	return true;
+}
+
+/* Workloads in the order they run, each starting from the state the previous left */
+static const struct {
+	const char *name;
+	bool (*run)(void);
+} steps[BENCH_STEPS] = {
+	{ "create", bench_create },
+	{ "rename", bench_rename },
+	{ "delete", bench_delete },
+	{ "deep-move", bench_deep_move },
+	{ "deep-write", bench_deep_write },
+	{ "bulk-copy", bench_bulk },
+};
+
+/* Match a change the backend reported against what the workload changed */
+static void bench_observe(const char *path, int server, int section_id, scan_class_t scan_class,
+						  void *arg) {
+	(void) server;
+	(void) section_id;
+	(void) scan_class;
+	(void) arg;
+
+	if (!current) return;
+	current->queued++;
+
+	/* Relative path, the library root itself is the empty path */
+	size_t root_len = strlen(root);
+	if (strncmp(path, root, root_len) != 0) {
+		current->extra++;
+		return;
+	}
+	const char *rel = path[root_len] == '/' ? path + root_len + 1 : path + root_len;
+	size_t rel_len = strlen(rel);
+
+	double now = bench_now();
+	bool related = false;
+	for (int i = 0; i < num_expected; i++) {
+		const char *want = expected[i].path;
+		size_t want_len = strlen(want);
+
+		/* A scan covers its own directory and everything below it */
+		bool covers = rel_len == 0 ||
+					  (strncmp(rel, want, rel_len) == 0 && (want[rel_len] == '\0' || want[rel_len] == '/'));
+		bool below = want_len == 0 || (strncmp(rel, want, want_len) == 0 && rel[want_len] == '/');
+
+		if (covers && expected[i].latency < 0) {
+			expected[i].latency = now - changed_at;
+		}
+		related = related || covers || below;
+	}
+
+	if (!related) {
+		log_message(LOG_DEBUG, "Unexpected change reported for %s", path);
+		current->extra++;
+	}
+}
+
+/* Check whether every expected directory was detected */
+static bool bench_complete(void) {
+	for (int i = 0; i < num_expected; i++) {
+		if (expected[i].latency < 0) return false;
+	}
+	return true;
+}
+
+/* End the current wait */
+static void bench_timer(uintptr_t ident, uint32_t data, void *arg) {
+	(void) ident;
+	(void) data;
+	(void) arg;
+
+	expired = true;
+	timer_wakeups++;
+}
+
+/* Run the event loop for a while, or until every expected change was seen */
+static void bench_wait(int seconds, bool until_complete) {
+	struct timespec start, end;
+
+	expired = false;
+	if (!reactor_timer(TIMER_BENCH, seconds * 1000L, false, bench_timer, NULL)) {
+		log_message(LOG_ERR, "Failed to register benchmark timer");
+		return;
+	}
+
+	while (!expired && !(until_complete && bench_complete())) {
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		monitor_process();
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+		result.cpu_ms += (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+		result.wakeups++;
+	}
+	reactor_cancel(TIMER_BENCH);
+}
+
+/* Run one workload and score what the backend reported */
+static bool bench_step(int index) {
+	bench_step_t *step = &result.steps[index];
+
+	num_expected = 0;
+	if (!steps[index].run()) {
+		return false;
+	}
+	changed_at = bench_now();
+
+	current = step;
+	bench_wait(BENCH_TIMEOUT, true);
+	bench_wait(BENCH_SETTLE, false);
+	current = NULL;
+
+	step->expected = num_expected;
+	for (int i = 0; i < num_expected; i++) {
+		if (expected[i].latency < 0) {
+			step->missed++;
+			continue;
+		}
+		step->latency_avg += expected[i].latency;
+		if (expected[i].latency > step->latency_max) {
+			step->latency_max = expected[i].latency;
+		}
+	}
+	if (step->expected > step->missed) {
+		step->latency_avg /= step->expected - step->missed;
+	}
+	return true;
+}
+
+/* Benchmark one backend in this process, then exit with the results written to `fd` */
+static void bench_backend(int index, const char *dir, int fd) {
+	struct rusage before, after;
+
+	g_config.defaults.backend = backends[index].backend;
+	g_config.defaults.poll_interval = BENCH_POLL_INTERVAL;
+	g_config.defaults.crawl_concurrency = 1;
+	g_config.mount_poll_interval = 0;
+	g_config.timer_slack = 1;
+	getrusage(RUSAGE_SELF, &before);
+
+	snprintf(root, sizeof(root), "%s/plexmon-bench.XXXXXX", dir);
+	if (!mkdtemp(root)) {
+		log_message(LOG_ERR, "Failed to create scratch directory in %s: %s", dir, strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	bool ok = bench_seed() && reactor_init() && events_init() && hotspots_init() &&
+			  dircache_init() && mounts_init() && monitor_init();
+	if (ok) {
+		config_bind(root, 0, BENCH_SECTION);
+		ok = monitor_tree(root, 0, BENCH_SECTION);
+		mounts_track(root, 0, BENCH_SECTION);
+		monitor_schedule(0, BENCH_SECTION);
+	}
+
+	/* Count only what the workloads cost, not the initial crawl */
+	long reads = dircache_reads();
+	events_observe(bench_observe, NULL);
+	for (int i = 0; ok && i < BENCH_STEPS; i++) {
+		log_message(LOG_INFO, "Running %s workload on the %s backend", steps[i].name, backends[index].name);
+		ok = bench_step(i);
+	}
+	events_observe(NULL, NULL);
+
+	result.ok = ok;
+	result.reads = dircache_reads() - reads;
+	result.wakeups -= timer_wakeups;
+	getrusage(RUSAGE_SELF, &after);
+	result.memory_kb = after.ru_maxrss - before.ru_maxrss;
+
+	/* Watches hold the scratch tree open, release them before removing it */
+	monitor_cleanup();
+	mounts_cleanup();
+	events_cleanup();
+	hotspots_cleanup();
+	dircache_cleanup();
+	reactor_cleanup();
+	bench_remove("");
+
+	bool sent = write(fd, &result, sizeof(result)) == (ssize_t) sizeof(result);
+	close(fd);
+	_exit(sent ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Benchmark one backend in a fresh process, so each starts from the same state */
+static bool bench_fork(int index, const char *dir, bench_result_t *out) {
+	int pipefd[2];
+
+	if (pipe(pipefd) == -1) {
+		log_message(LOG_ERR, "Failed to create benchmark pipe: %s", strerror(errno));
+		return false;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_message(LOG_ERR, "Failed to fork benchmark process: %s", strerror(errno));
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		close(pipefd[0]);
+		bench_backend(index, dir, pipefd[1]);
+	}
+
+	close(pipefd[1]);
+	size_t got = 0;
+	while (got < sizeof(*out)) {
+		ssize_t n = read(pipefd[0], (char *) out + got, sizeof(*out) - got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		got += n;
+	}
+	close(pipefd[0]);
+
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+	}
+
+	return got == sizeof(*out);
+}
+
+/* Run the workloads through every backend in a scratch directory and print the results */
+bool bench_run(const char *dir) {
+	bench_result_t results[sizeof(backends) / sizeof(backends[0])];
+	bool done[sizeof(backends) / sizeof(backends[0])];
+	int num_backends = sizeof(backends) / sizeof(backends[0]);
+	char base[PATH_MAX];
+
+	if (!realpath(dir, base)) {
+		fprintf(stderr, "Cannot use benchmark directory %s: %s\n", dir, strerror(errno));
+		return false;
+	}
+
+	bool success = true;
+	for (int b = 0; b < num_backends; b++) {
+		fprintf(stderr, "Benchmarking %s backend...\n", backends[b].name);
+		done[b] = bench_fork(b, base, &results[b]);
+		success = success && done[b] && results[b].ok;
+	}
+
+	printf("%-8s %-11s %8s %6s %5s %6s %10s %10s\n",
+		   "Backend", "Workload", "Expected", "Missed", "Extra", "Queued", "Avg ms", "Max ms");
+	for (int b = 0; b < num_backends; b++) {
+		if (!done[b]) {
+			printf("%-8s failed to run\n", backends[b].name);
+			continue;
+		}
+		for (int s = 0; s < BENCH_STEPS; s++) {
+			const bench_step_t *step = &results[b].steps[s];
+			printf("%-8s %-11s %8d %6d %5d %6d %10.1f %10.1f\n",
+				   backends[b].name, steps[s].name, step->expected, step->missed, step->extra,
+				   step->queued, step->latency_avg, step->latency_max);
+		}
+	}
+
+	printf("\n%-8s %8s %8s %10s %10s\n", "Backend", "Wakeups", "Reads", "CPU ms", "Memory KB");
+	for (int b = 0; b < num_backends; b++) {
+		if (done[b]) {
+			printf("%-8s %8ld %8ld %10.1f %10ld%s\n", backends[b].name, results[b].wakeups,
+				   results[b].reads, results[b].cpu_ms, results[b].memory_kb,
+				   results[b].ok ? "" : " (incomplete)");
+		}
+	}
+
+	return success;
+}
@@ -0,0 +1,50 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+
+#include "config.h"
+
+/* Benchmark configuration */
+#define BENCH_SECTION 1                /* Section ID the scratch library is bound to */
+#define BENCH_POLL_INTERVAL 2          /* Poll interval of the polling backends in seconds */
+#define BENCH_TIMEOUT 8                /* Seconds a workload waits for changes still missing */
+#define BENCH_SETTLE 1                 /* Seconds a workload keeps listening for extra changes */
+#define BENCH_DEPTH 8                  /* Depth of the tree moved by the deep move workload */
+#define BENCH_BULK_DIRS 10             /* Directories written by the bulk copy workload */
+#define BENCH_BULK_FILES 20            /* Files written into each of them */
+#define BENCH_FILE_SIZE 65536          /* Size of every file written */
+#define BENCH_MAX_EXPECTED 16          /* Changed directories a workload can expect */
+#define BENCH_STEPS 6                  /* Number of workloads */
+#define TIMER_BENCH 80                 /* Timer identifier for workload timeouts */
+
+/* Directory a workload changed, and when a backend noticed */
+typedef struct bench_expect {
+	char path[PATH_MAX_LEN];           /* Changed directory, relative to the scratch library */
+	double latency;                    /* Milliseconds until detected, negative while missed */
+} bench_expect_t;
+
+/* Outcome of one workload on one backend */
+typedef struct bench_step {
+	int expected;                      /* Directories the workload changed */
+	int missed;                        /* Changed directories no scan covered */
+	int extra;                         /* Changes reported outside the changed directories */
+	int queued;                        /* Changes handed to the event processor */
+	double latency_avg;                /* Mean milliseconds from change to detection */
+	double latency_max;                /* Slowest detection in milliseconds */
+} bench_step_t;
+
+/* Outcome of every workload on one backend, written back by its benchmark process */
+typedef struct bench_result {
+	bool ok;                           /* Whether every workload ran to the end */
+	bench_step_t steps[BENCH_STEPS];   /* Per workload results */
+	long wakeups;                      /* Reactor waits that returned events */
+	long reads;                        /* Directory listings read from disk */
+	double cpu_ms;                     /* CPU time spent in the event loop */
+	long memory_kb;                    /* Resident memory grown while monitoring */
+} bench_result_t;
+
+/* Run the workloads through every backend in a scratch directory and print the results */
+bool bench_run(const char *dir);
+
+#endif /* BENCH_H */
@@ -2,20 +2,379 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "../lib/khash.h"
 #include "logger.h"
+#include "utilities.h"
+
+KHASH_MAP_INIT_INT64(profile_map, int) /* Hash map from server and section ID to profile index */
+
+/* Structure to remember which library paths belong to which section */
+typedef struct binding {
+	char *path;                        /* Library root path */
+	int server;                        /* Index of the Plex server reporting the library */
+	int section_id;                    /* Plex library section ID on that server */
+} binding_t;
+
+static profile_t *profiles = NULL;                 /* Array of profiles from the config file */
+static int num_profiles = 0;                       /* Number of profiles */
+static int profiles_capacity = 0;                  /* Allocated capacity of profiles array */
+static khash_t(profile_map) *profile_hash = NULL;  /* Server and section ID to profile lookup */
+static binding_t *bindings = NULL;                 /* Library roots seen so far */
+static int num_bindings = 0;                       /* Number of bindings */
+static int bindings_capacity = 0;                  /* Allocated capacity of bindings array */
+static bool loaded = false;                        /* Whether a configuration file was read before */
+
+/* Reset a profile so every setting is inherited */
+static void profile_reset(profile_t *profile) {
+	profile->section_id = PROFILE_UNSET;
+	profile->server[0] = '\0';
+	profile->path[0] = '\0';
+	profile->debounce_min = PROFILE_UNSET;
+	profile->debounce_max = PROFILE_UNSET;
+	profile->max_scan_delay = PROFILE_UNSET;
+	profile->backend = PROFILE_UNSET;
+	profile->poll_interval = PROFILE_UNSET;
+	profile->priority = PROFILE_UNSET;
+	profile->crawl_concurrency = PROFILE_UNSET;
+	profile->window_open = PROFILE_UNSET;
+	profile->window_close = PROFILE_UNSET;
+	profile->window_rate = PROFILE_UNSET;
+	profile->window_urgent = PROFILE_UNSET;
+}
+
+/* Fill inherited settings from the defaults and validate the result */
+static void profile_resolve(profile_t *profile, const profile_t *defaults, const char *name) {
+	if (profile->debounce_min == PROFILE_UNSET) profile->debounce_min = defaults->debounce_min;
+	if (profile->debounce_max == PROFILE_UNSET) profile->debounce_max = defaults->debounce_max;
+	if (profile->max_scan_delay == PROFILE_UNSET) profile->max_scan_delay = defaults->max_scan_delay;
+	if (profile->backend == PROFILE_UNSET) profile->backend = defaults->backend;
+	if (profile->poll_interval == PROFILE_UNSET) profile->poll_interval = defaults->poll_interval;
+	if (profile->priority == PROFILE_UNSET) profile->priority = defaults->priority;
+	if (profile->crawl_concurrency == PROFILE_UNSET) profile->crawl_concurrency = defaults->crawl_concurrency;
+	if (profile->window_open == PROFILE_UNSET) {
+		profile->window_open = defaults->window_open;
+		profile->window_close = defaults->window_close;
+	}
+	if (profile->window_rate == PROFILE_UNSET) profile->window_rate = defaults->window_rate;
+	if (profile->window_urgent == PROFILE_UNSET) profile->window_urgent = defaults->window_urgent;
+
+	if (profile->debounce_min <= 0) {
+		log_message(LOG_WARNING, "Invalid scan interval (%d) for %s, using default of %ds",
+					profile->debounce_min, name, DEFAULT_SCAN_INTERVAL);
+		profile->debounce_min = DEFAULT_SCAN_INTERVAL;
+	}
+
+	if (profile->debounce_max < profile->debounce_min) {
+		log_message(LOG_WARNING, "Debounce maximum (%d) for %s is below scan interval, using %ds",
+					profile->debounce_max, name, profile->debounce_min);
+		profile->debounce_max = profile->debounce_min;
+	}
+
+	if (profile->max_scan_delay < profile->debounce_min) {
+		log_message(LOG_WARNING, "Maximum scan delay (%d) for %s is below scan interval, using %ds",
+					profile->max_scan_delay, name, profile->debounce_min);
+		profile->max_scan_delay = profile->debounce_min;
+	}
+
+	if (profile->poll_interval <= 0) {
+		log_message(LOG_WARNING, "Invalid poll interval (%d) for %s, using default of %ds",
+					profile->poll_interval, name, DEFAULT_POLL_INTERVAL);
+		profile->poll_interval = DEFAULT_POLL_INTERVAL;
+	}
+
+	if (profile->priority <= 0) {
+		log_message(LOG_WARNING, "Invalid priority (%d) for %s, using default of %d",
+					profile->priority, name, DEFAULT_PRIORITY);
+		profile->priority = DEFAULT_PRIORITY;
+	}
+
+	if (profile->crawl_concurrency <= 0) {
+		log_message(LOG_WARNING, "Invalid crawl concurrency (%d) for %s, using default of %d",
+					profile->crawl_concurrency, name, DEFAULT_CRAWL_CONCURRENCY);
+		profile->crawl_concurrency = DEFAULT_CRAWL_CONCURRENCY;
+	}
+
+	if (profile->window_rate < 0) {
+		log_message(LOG_WARNING, "Invalid scan window rate (%d) for %s, using default of %d",
+					profile->window_rate, name, DEFAULT_WINDOW_RATE);
+		profile->window_rate = DEFAULT_WINDOW_RATE;
+	}
+}
+
+/* Parse a "HH:MM-HH:MM" scan window, "always" keeps it open all day */
+static bool profile_window(profile_t *profile, const char *v) {
+	int open_h, open_m, close_h, close_m;
+
+	if (strcasecmp(v, "always") == 0) {
+		profile->window_open = 0;
+		profile->window_close = 0;
+		return true;
+	}
+
+	if (sscanf(v, "%d:%d-%d:%d", &open_h, &open_m, &close_h, &close_m) != 4 ||
+		open_h < 0 || open_h > 23 || open_m < 0 || open_m > 59 ||
+		close_h < 0 || close_h > 23 || close_m < 0 || close_m > 59) {
+		return false;
+	}
+
+	profile->window_open = open_h * 60 + open_m;
+	profile->window_close = close_h * 60 + close_m;
+	return true;
+}
+
+/* Parse the least urgent scan class that ignores the window, "none" holds every class */
+static bool profile_urgent(profile_t *profile, const char *v) {
+	static const char *names[SCAN_CLASSES] = { "new", "delete", "metadata", "verify" };
+
+	if (strcasecmp(v, "none") == 0) {
+		profile->window_urgent = 0;
+		return true;
+	}
+	for (int i = 0; i < SCAN_CLASSES; i++) {
+		if (strcasecmp(v, names[i]) == 0) {
+			profile->window_urgent = i + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Parse a profile setting, returns false if the key is not a profile setting */
+static bool profile_option(profile_t *profile, const char *k, const char *v) {
+	if (strcmp(k, "scan_interval") == 0 || strcmp(k, "debounce_min") == 0) {
+		profile->debounce_min = atoi(v);
+	} else if (strcmp(k, "debounce_max") == 0) {
+		profile->debounce_max = atoi(v);
+	} else if (strcmp(k, "max_scan_delay") == 0) {
+		profile->max_scan_delay = atoi(v);
+	} else if (strcmp(k, "backend") == 0) {
+		if (strcasecmp(v, "watch") == 0) {
+			profile->backend = BACKEND_WATCH;
+		} else if (strcasecmp(v, "poll") == 0) {
+			profile->backend = BACKEND_POLL;
+		} else if (strcasecmp(v, "hybrid") == 0) {
+			profile->backend = BACKEND_HYBRID;
+		} else {
+			log_message(LOG_WARNING, "Invalid backend (%s), using default", v);
+		}
+	} else if (strcmp(k, "poll_interval") == 0) {
+		profile->poll_interval = atoi(v);
+	} else if (strcmp(k, "priority") == 0) {
+		profile->priority = atoi(v);
+	} else if (strcmp(k, "crawl_concurrency") == 0) {
+		profile->crawl_concurrency = atoi(v);
+	} else if (strcmp(k, "scan_window") == 0) {
+		if (!profile_window(profile, v)) {
+			log_message(LOG_WARNING, "Invalid scan_window (%s), using default", v);
+		}
+	} else if (strcmp(k, "window_rate") == 0) {
+		profile->window_rate = atoi(v);
+	} else if (strcmp(k, "window_urgent") == 0) {
+		if (!profile_urgent(profile, v)) {
+			log_message(LOG_WARNING, "Invalid window_urgent (%s), using default", v);
+		}
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* Parse a Plex server setting, returns false if the key is not a server setting */
+static bool server_option(server_t *server, const char *k, const char *v) {
+	if (strcmp(k, "plex_url") == 0) {
+		strncpy(server->url, v, PATH_MAX_LEN - 1);
+		server->url[PATH_MAX_LEN - 1] = '\0';
+	} else if (strcmp(k, "plex_token") == 0) {
+		strncpy(server->token, v, TOKEN_MAX_LEN - 1);
+		server->token[TOKEN_MAX_LEN - 1] = '\0';
+	} else if (strcmp(k, "scan_rate") == 0) {
+		server->scan_rate = atoi(v);
+	} else if (strcmp(k, "scan_burst") == 0) {
+		server->scan_burst = atoi(v);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* Start a new server block from a "[server NAME]" header */
+static server_t *server_begin(const char *name) {
+	if (g_config.num_servers >= MAX_SERVERS) {
+		log_message(LOG_WARNING, "Too many Plex servers, ignoring [server %s]", name);
+		return NULL;
+	}
+
+	server_t *server = &g_config.servers[g_config.num_servers++];
+	memset(server, 0, sizeof(server_t));
+	snprintf(server->name, sizeof(server->name), "%s", name);
+	strcpy(server->url, DEFAULT_PLEX_URL);
+	server->scan_burst = DEFAULT_SCAN_BURST;
+
+	return server;
+}
+
+/* Check if the parsed servers are the same ones, in the same order, as before */
+static bool servers_same(const server_t *previous, int num_previous) {
+	if (g_config.num_servers != num_previous) {
+		return false;
+	}
+	for (int i = 0; i < num_previous; i++) {
+		if (strcmp(g_config.servers[i].name, previous[i].name) != 0 ||
+			strcmp(g_config.servers[i].url, previous[i].url) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Split a "[kind argument]" block header in place */
+static bool block_header(char *header, char **kind, char **arg) {
+	char *end = strchr(header, ']');
+	if (!end) {
+		log_message(LOG_WARNING, "Malformed block header: %s", header);
+		return false;
+	}
+	*end = '\0';
+
+	char *k = header + 1;
+	while (isspace((unsigned char) *k)) k++;
+	char *a = k;
+	while (*a && !isspace((unsigned char) *a)) a++;
+	if (*a) *a++ = '\0';
+	while (isspace((unsigned char) *a)) a++;
+	char *tail = a + strlen(a);
+	while (tail > a && isspace((unsigned char) tail[-1])) *--tail = '\0';
+
+	*kind = k;
+	*arg = a;
+	return true;
+}
+
+/* Start a new profile block from a "[section N]", "[section N SERVER]" or "[path /dir]" header */
+static profile_t *profile_begin(const char *kind, const char *arg) {
+	if (num_profiles >= profiles_capacity) {
+		int new_capacity = profiles_capacity > 0 ? profiles_capacity * 2 : 8;
+		profile_t *new_profiles = realloc(profiles, new_capacity * sizeof(profile_t));
+		if (!new_profiles) {
+			log_message(LOG_ERR, "Failed to allocate memory for profiles");
+			return NULL;
+		}
+		profiles = new_profiles;
+		profiles_capacity = new_capacity;
+	}
+
+	profile_t *profile = &profiles[num_profiles];
+	profile_reset(profile);
+
+	if (strcmp(kind, "section") == 0 && *arg) {
+		profile->section_id = atoi(arg);
+		const char *server = arg;
+		while (*server && !isspace((unsigned char) *server)) server++;
+		while (isspace((unsigned char) *server)) server++;
+		snprintf(profile->server, sizeof(profile->server), "%s", server);
+	} else if (strcmp(kind, "path") == 0 && *arg) {
+		strncpy(profile->path, arg, PATH_MAX_LEN - 1);
+		profile->path[PATH_MAX_LEN - 1] = '\0';
+		/* Normalize trailing slashes so prefix matching works */
+		size_t len = strlen(profile->path);
+		while (len > 1 && profile->path[len - 1] == '/') profile->path[--len] = '\0';
+	} else {
+		log_message(LOG_WARNING, "Unknown configuration block [%s %s]", kind, arg);
+		return NULL;
+	}
+
+	num_profiles++;
+	return profile;
+}
+
+/* Key of a section on a server in the profile table, PROFILE_UNSET as server for any */
+static khint64_t profile_key(int server, int section_id) {
+	return (khint64_t) (uint32_t) server << 32 | (uint32_t) section_id;
+}
+
+/* Find the index of a configured server by name, -1 if there is none */
+static int profile_server(const char *name) {
+	for (int i = 0; i < g_config.num_servers; i++) {
+		if (strcmp(g_config.servers[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Map a section to a profile, explicit section blocks win over path blocks */
+static void profile_map_section(int server, int section_id, int index) {
+	int ret;
+	khint64_t key = profile_key(server, section_id);
+	khint_t k = kh_get(profile_map, profile_hash, key);
+	if (k != kh_end(profile_hash)) {
+		int current = kh_value(profile_hash, k);
+		if (profiles[current].section_id == section_id || current == index) {
+			return;
+		}
+		log_message(LOG_WARNING, "Section %d matches several path profiles, using [path %s]",
+					section_id, profiles[current].path);
+		return;
+	}
+
+	k = kh_put(profile_map, profile_hash, key, &ret);
+	if (ret == -1) {
+		log_message(LOG_ERR, "Failed to add profile to hash table");
+		return;
+	}
+	kh_value(profile_hash, k) = index;
+}
+
+/* Bind path profiles that cover a library root to its section */
+static void profile_bind(const char *path, int server, int section_id) {
+	for (int i = 0; i < num_profiles; i++) {
+		if (profiles[i].path[0] == '\0') {
+			continue;
+		}
+		if (strcmp(profiles[i].path, path) == 0 || path_contains(profiles[i].path, path)) {
+			log_message(LOG_DEBUG, "Library %s (section %d) uses profile [path %s]",
+						path, section_id, profiles[i].path);
+			profile_map_section(server, section_id, i);
+		}
+	}
+}
+
+/* Drop all profiles before reloading */
+static void profiles_free(void) {
+	if (profile_hash) {
+		kh_destroy(profile_map, profile_hash);
+		profile_hash = NULL;
+	}
+	free(profiles);
+	profiles = NULL;
+	num_profiles = 0;
+	profiles_capacity = 0;
+}
 
 /* Load configuration from file */
 bool config_load(const char *config_path) {
 	FILE *fp;
 	char line[1024];
 	char key[256], value[768];
+	profile_t *profile = NULL; /* Profile block being parsed */
+	server_t *server = NULL;   /* Server block being parsed */
+	bool in_block = false;
 
 	log_message(LOG_INFO, "Loading configuration from %s", config_path);
 
+	profiles_free();
+	profile_hash = kh_init(profile_map);
+	if (!profile_hash) {
+		log_message(LOG_ERR, "Failed to create profile hash table");
+		return false;
+	}
+
 	fp = fopen(config_path, "r");
 	if (!fp) {
 		log_message(LOG_WARNING, "Could not open config file %s: %s", config_path,
@@ -24,6 +383,12 @@ bool config_load(const char *config_path) {
 		return true; /* Continue with defaults */
 	}
 
+	/* Server blocks are parsed again from scratch, the first server stays global */
+	server_t previous[MAX_SERVERS];
+	int num_previous = g_config.num_servers;
+	memcpy(previous, g_config.servers, sizeof(previous));
+	g_config.num_servers = 1;
+
 	/* Parse configuration file */
 	while (fgets(line, sizeof(line), fp)) {
 		/* Skip comments and empty lines */
@@ -33,6 +398,25 @@ bool config_load(const char *config_path) {
 		int len = strlen(line);
 		if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
 
+		/* Start of a per-library profile block */
+		char *start = line;
+		while (isspace((unsigned char) *start)) start++;
+		if (*start == '[') {
+			char *kind, *arg;
+			profile = NULL;
+			server = NULL;
+			in_block = true;
+			if (!block_header(start, &kind, &arg)) {
+				continue;
+			}
+			if (strcmp(kind, "server") == 0 && *arg) {
+				server = server_begin(arg);
+			} else {
+				profile = profile_begin(kind, arg);
+			}
+			continue;
+		}
+
 		/* Parse key=value format */
 		char *separator = strchr(line, '=');
 		if (separator) {
@@ -62,17 +446,78 @@ bool config_load(const char *config_path) {
 			end = v + strlen(v) - 1;
 			while (end > v && isspace((unsigned char) *end)) *end-- = '\0';
 
+			/* Settings inside a profile block only apply to that library */
+			if (in_block) {
+				if (profile && !profile_option(profile, k, v)) {
+					log_message(LOG_WARNING, "Option %s is not valid in a profile block", k);
+				} else if (server && !server_option(server, k, v)) {
+					log_message(LOG_WARNING, "Option %s is not valid in a server block", k);
+				}
+				continue;
+			}
+
 			/* Process configuration options */
-			if (strcmp(k, "plex_url") == 0) {
-				strncpy(g_config.plex_url, v, PATH_MAX_LEN - 1);
-				g_config.plex_url[PATH_MAX_LEN - 1] = '\0';
-			} else if (strcmp(k, "plex_token") == 0) {
-				strncpy(g_config.plex_token, v, TOKEN_MAX_LEN - 1);
-				g_config.plex_token[TOKEN_MAX_LEN - 1] = '\0';
-			} else if (strcmp(k, "scan_interval") == 0) {
-				g_config.scan_interval = atoi(v);
+			if (profile_option(&g_config.defaults, k, v)) {
+				continue;
+			} else if (server_option(&g_config.servers[0], k, v)) {
+				continue;
 			} else if (strcmp(k, "startup_timeout") == 0) {
 				g_config.startup_timeout = atoi(v);
+			} else if (strcmp(k, "mount_poll_interval") == 0) {
+				g_config.mount_poll_interval = atoi(v);
+			} else if (strcmp(k, "pending_memory") == 0) {
+				g_config.pending_memory = atoi(v);
+			} else if (strcmp(k, "timer_slack") == 0) {
+				g_config.timer_slack = atoi(v);
+			} else if (strcmp(k, "batch_window") == 0) {
+				g_config.batch_window = atoi(v);
+			} else if (strcmp(k, "batch_rate") == 0) {
+				g_config.batch_rate = atoi(v);
+			} else if (strcmp(k, "workers") == 0) {
+				g_config.workers = atoi(v);
+			} else if (strcmp(k, "disk_scans") == 0) {
+				g_config.disk_scans = atoi(v);
+			} else if (strcmp(k, "disk_busy") == 0) {
+				g_config.disk_busy = atoi(v);
+			} else if (strcmp(k, "state_interval") == 0) {
+				g_config.state_interval = atoi(v);
+			} else if (strcmp(k, "echo_window") == 0) {
+				g_config.echo_window = atoi(v);
+			} else if (strcmp(k, "echo_patterns") == 0) {
+				strncpy(g_config.echo_patterns, v, PATH_MAX_LEN - 1);
+				g_config.echo_patterns[PATH_MAX_LEN - 1] = '\0';
+			} else if (strcmp(k, "echo_user") == 0) {
+				const struct passwd *pw = getpwnam(v);
+				if (pw) {
+					g_config.echo_uid = (int) pw->pw_uid;
+				} else if (isdigit((unsigned char) v[0])) {
+					g_config.echo_uid = atoi(v);
+				} else if (v[0] != '\0') {
+					log_message(LOG_WARNING, "Unknown echo_user (%s), attributing changes by name only", v);
+					g_config.echo_uid = -1;
+				} else {
+					g_config.echo_uid = -1;
+				}
+			} else if (strcmp(k, "throttle_low") == 0) {
+				g_config.throttle_low = atoi(v);
+			} else if (strcmp(k, "throttle_high") == 0) {
+				g_config.throttle_high = atoi(v);
+			} else if (strcmp(k, "latency_new") == 0) {
+				g_config.latency[SCAN_NEW] = atoi(v);
+			} else if (strcmp(k, "latency_delete") == 0) {
+				g_config.latency[SCAN_DELETE] = atoi(v);
+			} else if (strcmp(k, "latency_metadata") == 0) {
+				g_config.latency[SCAN_METADATA] = atoi(v);
+			} else if (strcmp(k, "latency_verify") == 0) {
+				g_config.latency[SCAN_VERIFY] = atoi(v);
+			} else if (strcmp(k, "follow_symlinks") == 0) {
+				if (strcasecmp(v, "yes") == 0 || strcasecmp(v, "true") == 0) {
+					g_config.follow_symlinks = true;
+				} else if (strcasecmp(v, "no") == 0 || strcasecmp(v, "false") == 0) {
+					g_config.follow_symlinks = false;
+				} else {
+					log_message(LOG_WARNING, "Invalid follow_symlinks (%s), using default", v);
+				}
 			} else if (strcmp(k, "log_level") == 0) {
 				if (strcasecmp(v, "debug") == 0) {
 					g_config.log_level = LOG_DEBUG;
@@ -84,6 +529,9 @@ bool config_load(const char *config_path) {
 			} else if (strcmp(k, "log_file") == 0) {
 				strncpy(g_config.log_file, v, PATH_MAX_LEN - 1);
 				g_config.log_file[PATH_MAX_LEN - 1] = '\0';
+			} else if (strcmp(k, "state_file") == 0) {
+				strncpy(g_config.state_file, v, PATH_MAX_LEN - 1);
+				g_config.state_file[PATH_MAX_LEN - 1] = '\0';
 			} else {
 				log_message(LOG_WARNING, "Unknown configuration option: %s", k);
 			}
@@ -93,9 +541,35 @@ bool config_load(const char *config_path) {
 	fclose(fp);
 	log_message(LOG_INFO, "Configuration loaded successfully");
 
+	/* The Plex client builds its server table once, tokens and rates are the only
+	 * server settings it reads again */
+	if (loaded && !servers_same(previous, num_previous)) {
+		log_message(LOG_WARNING, "Plex servers cannot be added, removed, renamed or moved on reload, "
+					"keeping the current servers until restart");
+		memcpy(g_config.servers, previous, sizeof(previous));
+		g_config.num_servers = num_previous;
+	}
+	loaded = true;
+
 	/* Validate configuration */
-	if (strlen(g_config.plex_token) == 0) {
-		log_message(LOG_WARNING, "No Plex token provided in configuration");
+	for (int i = 0; i < g_config.num_servers; i++) {
+		server_t *srv = &g_config.servers[i];
+
+		if (strlen(srv->token) == 0) {
+			log_message(LOG_WARNING, "No Plex token provided for server %s", srv->name);
+		}
+
+		if (srv->scan_rate < 0) {
+			log_message(LOG_WARNING, "Invalid scan rate (%d) for server %s, using unlimited",
+						srv->scan_rate, srv->name);
+			srv->scan_rate = 0;
+		}
+
+		if (srv->scan_burst <= 0) {
+			log_message(LOG_WARNING, "Invalid scan burst (%d) for server %s, using default of %d",
+						srv->scan_burst, srv->name, DEFAULT_SCAN_BURST);
+			srv->scan_burst = DEFAULT_SCAN_BURST;
+		}
 	}
 
 	if (g_config.startup_timeout <= 0) {
@@ -104,11 +578,210 @@ bool config_load(const char *config_path) {
 		g_config.startup_timeout = 60;
 	}
 
-	if (g_config.scan_interval <= 0) {
-		log_message(LOG_WARNING, "Invalid scan interval (%d), using default of %ds",
-					g_config.scan_interval, DEFAULT_SCAN_INTERVAL);
-		g_config.scan_interval = DEFAULT_SCAN_INTERVAL;
+	if (g_config.mount_poll_interval < 0) {
+		log_message(LOG_WARNING, "Invalid mount poll interval (%d), using default of %ds",
+					g_config.mount_poll_interval, DEFAULT_MOUNT_POLL_INTERVAL);
+		g_config.mount_poll_interval = DEFAULT_MOUNT_POLL_INTERVAL;
+	}
+
+	if (g_config.timer_slack < 0) {
+		log_message(LOG_WARNING, "Invalid timer slack (%d), using default of %ds",
+					g_config.timer_slack, DEFAULT_TIMER_SLACK);
+		g_config.timer_slack = DEFAULT_TIMER_SLACK;
+	}
+
+	if (g_config.batch_window < 0 || g_config.batch_window > MAX_BATCH_WINDOW) {
+		log_message(LOG_WARNING, "Invalid event batch window (%d), using default of %dms",
+					g_config.batch_window, DEFAULT_BATCH_WINDOW);
+		g_config.batch_window = DEFAULT_BATCH_WINDOW;
+	}
+
+	if (g_config.batch_rate <= 0) {
+		log_message(LOG_WARNING, "Invalid event batch rate (%d), using default of %d per second",
+					g_config.batch_rate, DEFAULT_BATCH_RATE);
+		g_config.batch_rate = DEFAULT_BATCH_RATE;
+	}
+
+	if (g_config.pending_memory <= 0) {
+		log_message(LOG_WARNING, "Invalid pending scan memory cap (%d), using default of %dKB",
+					g_config.pending_memory, DEFAULT_PENDING_MEMORY);
+		g_config.pending_memory = DEFAULT_PENDING_MEMORY;
+	}
+
+	if (g_config.throttle_high < 0 || g_config.throttle_high > 100 || g_config.throttle_low < 0 ||
+		(g_config.throttle_high > 0 && g_config.throttle_low >= g_config.throttle_high)) {
+		log_message(LOG_WARNING, "Invalid crawl throttle (%d-%d%%), using default of %d-%d%%",
+					g_config.throttle_low, g_config.throttle_high,
+					DEFAULT_THROTTLE_LOW, DEFAULT_THROTTLE_HIGH);
+		g_config.throttle_low = DEFAULT_THROTTLE_LOW;
+		g_config.throttle_high = DEFAULT_THROTTLE_HIGH;
+	}
+
+	if (g_config.workers < 1 || g_config.workers > MAX_WORKERS) {
+		log_message(LOG_WARNING, "Invalid number of workers (%d), using a single process",
+					g_config.workers);
+		g_config.workers = 1;
+	}
+
+	if (g_config.disk_scans < 0 || g_config.disk_scans > MAX_DISK_SCANS) {
+		log_message(LOG_WARNING, "Invalid scans per disk (%d), not limiting scans per disk",
+					g_config.disk_scans);
+		g_config.disk_scans = 0;
+	}
+
+	if (g_config.disk_busy <= 0) {
+		log_message(LOG_WARNING, "Invalid disk busy time (%d), using default of %ds",
+					g_config.disk_busy, DEFAULT_DISK_BUSY);
+		g_config.disk_busy = DEFAULT_DISK_BUSY;
+	}
+
+	if (g_config.echo_window < 0) {
+		log_message(LOG_WARNING, "Invalid echo window (%d), using default of %ds",
+					g_config.echo_window, DEFAULT_ECHO_WINDOW);
+		g_config.echo_window = DEFAULT_ECHO_WINDOW;
+	}
+
+	if (g_config.state_interval < 0) {
+		log_message(LOG_WARNING, "Invalid state snapshot interval (%d), using default of %ds",
+					g_config.state_interval, DEFAULT_STATE_INTERVAL);
+		g_config.state_interval = DEFAULT_STATE_INTERVAL;
+	}
+
+	static const int latency_defaults[SCAN_CLASSES] = {
+		DEFAULT_LATENCY_NEW, DEFAULT_LATENCY_DELETE, DEFAULT_LATENCY_METADATA, DEFAULT_LATENCY_VERIFY
+	};
+	for (int i = 0; i < SCAN_CLASSES; i++) {
+		if (g_config.latency[i] <= 0) {
+			log_message(LOG_WARNING, "Invalid latency target (%d) for scan class %d, using %ds",
+						g_config.latency[i], i, latency_defaults[i]);
+			g_config.latency[i] = latency_defaults[i];
+		}
+	}
+
+	/* Resolve profiles against the global defaults */
+	profile_resolve(&g_config.defaults, &g_config.defaults, "defaults");
+
+	for (int i = 0; i < num_profiles; i++) {
+		char name[PATH_MAX_LEN + 16];
+		if (profiles[i].section_id != PROFILE_UNSET) {
+			snprintf(name, sizeof(name), "section %d%s%s", profiles[i].section_id,
+					 profiles[i].server[0] ? " " : "", profiles[i].server);
+		} else {
+			snprintf(name, sizeof(name), "path %s", profiles[i].path);
+		}
+		profile_resolve(&profiles[i], &g_config.defaults, name);
+
+		if (profiles[i].section_id == PROFILE_UNSET) {
+			continue;
+		}
+
+		/* A block without a server applies to the section on every server */
+		int server = PROFILE_UNSET;
+		if (profiles[i].server[0] && (server = profile_server(profiles[i].server)) < 0) {
+			log_message(LOG_WARNING, "Unknown Plex server in [%s], ignoring the profile", name);
+			continue;
+		}
+		profile_map_section(server, profiles[i].section_id, i);
+	}
+
+	/* Re-apply path profiles to libraries that are already known */
+	for (int i = 0; i < num_bindings; i++) {
+		profile_bind(bindings[i].path, bindings[i].server, bindings[i].section_id);
+	}
+
+	if (num_profiles > 0) {
+		log_message(LOG_INFO, "Loaded %d library profiles", num_profiles);
 	}
 
 	return true;
 }
+
+/* Associate a library root with its section so path profiles can be found by section */
+void config_bind(const char *path, int server, int section_id) {
+	if (num_bindings >= bindings_capacity) {
+		int new_capacity = bindings_capacity > 0 ? bindings_capacity * 2 : 8;
+		binding_t *new_bindings = realloc(bindings, new_capacity * sizeof(binding_t));
+		if (!new_bindings) {
+			log_message(LOG_ERR, "Failed to allocate memory for library bindings");
+			return;
+		}
+		bindings = new_bindings;
+		bindings_capacity = new_capacity;
+	}
+
+	char *copy = strdup(path);
+	if (!copy) {
+		log_message(LOG_ERR, "Failed to allocate memory for library binding");
+		return;
+	}
+
+	bindings[num_bindings].path = copy;
+	bindings[num_bindings].server = server;
+	bindings[num_bindings].section_id = section_id;
+	num_bindings++;
+
+	if (profile_hash) {
+		profile_bind(path, server, section_id);
+	}
+}
+
+/* Find the profile mapped to a key, -1 if there is none */
+static int profile_find(int server, int section_id) {
+	khint_t k = kh_get(profile_map, profile_hash, profile_key(server, section_id));
+	return k != kh_end(profile_hash) ? kh_value(profile_hash, k) : -1;
+}
+
+/* Get the profile for a library section on a server. Section blocks win over path blocks,
+ * and a block naming the server over one for the section on any server */
+const profile_t *config_profile(int server, int section_id) {
+	if (!profile_hash) {
+		return &g_config.defaults;
+	}
+
+	int exact = profile_find(server, section_id);
+	int any = profile_find(PROFILE_UNSET, section_id);
+	if (exact >= 0 && (profiles[exact].section_id != PROFILE_UNSET || any < 0)) {
+		return &profiles[exact];
+	}
+	if (any >= 0) {
+		return &profiles[any];
+	}
+	return &g_config.defaults;
+}
+
+/* Check a profile's scan window, returns `now` while open or the time it opens next */
+time_t config_window(const profile_t *profile, time_t now) {
+	struct tm local;
+
+	if (profile->window_open == profile->window_close || !localtime_r(&now, &local)) {
+		return now;
+	}
+
+	int minute = local.tm_hour * 60 + local.tm_min;
+	bool open;
+	if (profile->window_open < profile->window_close) {
+		open = minute >= profile->window_open && minute < profile->window_close;
+	} else {
+		/* Window spanning midnight */
+		open = minute >= profile->window_open || minute < profile->window_close;
+	}
+	if (open) {
+		return now;
+	}
+
+	int wait = (profile->window_open - minute + 24 * 60) % (24 * 60);
+	return now - local.tm_sec + wait * 60;
+}
+
+/* Release profiles and bindings */
+void config_cleanup(void) {
+	profiles_free();
+
+	for (int i = 0; i < num_bindings; i++) {
+		free(bindings[i].path);
+	}
+	free(bindings);
+	bindings = NULL;
+	num_bindings = 0;
+	bindings_capacity = 0;
+}
@@ -2,21 +2,110 @@
 #define CONFIG_H
 
 #include <stdbool.h>
+#include <time.h>
 
 /* Configuration constants */
 #define DEFAULT_CONFIG_FILE "/usr/local/etc/plexmon.conf" /* Default configuration file path */
 #define DEFAULT_PLEX_URL "http://localhost:32400"         /* Default Plex server URL */
 #define DEFAULT_SCAN_INTERVAL 1                           /* Default scan delay in seconds */
+#define DEFAULT_DEBOUNCE_MAX 30                           /* Default upper bound for the scan delay in seconds */
+#define DEFAULT_MAX_SCAN_DELAY 300                        /* Default maximum delay since the first event in seconds */
+#define DEFAULT_POLL_INTERVAL 300                         /* Default seconds between polls of polled libraries */
+#define DEFAULT_PRIORITY 1                                /* Default dispatch priority weight */
+#define DEFAULT_CRAWL_CONCURRENCY 1                       /* Default number of directories read in parallel */
+#define DEFAULT_MOUNT_POLL_INTERVAL 10                    /* Default seconds between mount table checks */
+#define DEFAULT_PENDING_MEMORY 4096                       /* Default memory cap for pending scans in KB */
+#define DEFAULT_TIMER_SLACK 0                             /* Default seconds scan wakeups may be delayed to batch them */
+#define DEFAULT_BATCH_WINDOW 20                           /* Default milliseconds a busy event batch is held open */
+#define DEFAULT_BATCH_RATE 200                            /* Default events per second from which batches are held open */
+#define MAX_BATCH_WINDOW 1000                             /* Maximum milliseconds an event batch is held open */
+#define DEFAULT_WINDOW_RATE 10                            /* Default scans per minute released in a scan window */
+#define DEFAULT_THROTTLE_LOW 10                           /* Default pressure in percent where crawls start slowing down */
+#define DEFAULT_THROTTLE_HIGH 40                          /* Default pressure in percent where crawls pause */
 #define PATH_MAX_LEN 1024                                 /* Maximum length for filesystem paths */
+#define MAX_SERVERS 8                                     /* Maximum number of Plex servers */
+#define DEFAULT_STATE_INTERVAL 900                        /* Default seconds between state snapshots */
+#define DEFAULT_ECHO_WINDOW 300                           /* Default seconds Plex writes after a scan are ignored */
+#define DEFAULT_ECHO_PATTERNS "*.srt,*.ass,*.ssa,*.vtt,*.sub,*.idx,*.smi,.plexmatch,poster.jpg,fanart.jpg,background.jpg,banner.jpg,theme.mp3" /* Default files Plex writes itself */
+#define DEFAULT_DISK_BUSY 20                              /* Default seconds a sent scan keeps its disk busy */
+#define MAX_DISK_SCANS 16                                 /* Maximum scans in flight per disk */
+#define MAX_WORKERS 64                                    /* Maximum number of worker processes */
+#define DEFAULT_SCAN_BURST 10                             /* Default scans sent back to back to one server */
 #define TOKEN_MAX_LEN 128                                 /* Maximum length for authentication token */
 
+#define DEFAULT_LATENCY_NEW 30                            /* Default scan deadline for new media in seconds */
+#define DEFAULT_LATENCY_DELETE 120                        /* Default scan deadline for deletions in seconds */
+#define DEFAULT_LATENCY_METADATA 900                      /* Default scan deadline for metadata changes in seconds */
+#define DEFAULT_LATENCY_VERIFY 3600                       /* Default scan deadline for verification findings in seconds */
+#define PROFILE_UNSET -1                                  /* Marks a profile setting inherited from defaults */
+
+/* Monitoring backends */
+typedef enum {
+	BACKEND_WATCH,                     /* Kernel notifications through kqueue */
+	BACKEND_POLL,                      /* Periodic mtime comparison against the cache */
+	BACKEND_HYBRID                     /* Kernel notifications with periodic verification */
+} backend_t;
+
+/* Kinds of change a scan is requested for, most urgent first */
+typedef enum {
+	SCAN_NEW,                          /* New directory or media file */
+	SCAN_DELETE,                       /* Removed directory or file */
+	SCAN_METADATA,                     /* Artwork, subtitles and other non-media files */
+	SCAN_VERIFY,                       /* Difference found by a poll or revalidation */
+	SCAN_CLASSES                       /* Number of scan classes */
+} scan_class_t;
+
+/* Per-library tuning profile */
+typedef struct profile {
+	int section_id;                    /* Library section the profile applies to, or PROFILE_UNSET */
+	char server[64];                   /* Plex server the section is on, empty for any server */
+	char path[PATH_MAX_LEN];           /* Library path the profile applies to, or empty */
+	int debounce_min;                  /* Quiet period before a scan in seconds */
+	int debounce_max;                  /* Upper bound for the quiet period as events keep coming */
+	int max_scan_delay;                /* Maximum delay from the first event to the scan */
+	int backend;                       /* Monitoring backend (backend_t) */
+	int poll_interval;                 /* Seconds between polls for poll and hybrid backends */
+	int priority;                      /* Relative dispatch weight, higher goes first */
+	int crawl_concurrency;             /* Number of directories read in parallel during crawls */
+	int window_open;                   /* Minute of the day scans may start, equal to close if always */
+	int window_close;                  /* Minute of the day scans are held again */
+	int window_rate;                   /* Scans per minute released while the window is open (0 = unlimited) */
+	int window_urgent;                 /* Number of most urgent scan classes that ignore the window */
+} profile_t;
+
+/* Plex server target */
+typedef struct server {
+	char name[64];                     /* Name used in log messages */
+	char url[PATH_MAX_LEN];            /* Base URL of the Plex Media Server */
+	char token[TOKEN_MAX_LEN];         /* Authentication token for Plex API access */
+	int scan_rate;                     /* Scans per minute sent to this server (0 = unlimited) */
+	int scan_burst;                    /* Scans that may be sent back to back */
+} server_t;
+
 /* Configuration structure */
 typedef struct config {
-	char plex_url[PATH_MAX_LEN];       /* Base URL of the Plex Media Server */
-	char plex_token[TOKEN_MAX_LEN];    /* Authentication token for Plex API access */
+	server_t servers[MAX_SERVERS];     /* Plex servers, the first one from the global settings */
+	int num_servers;                   /* Number of configured Plex servers */
 	char log_file[PATH_MAX_LEN];       /* Path to the log file for daemon mode */
-	int scan_interval;                 /* Delay in seconds before triggering a scan */
+	profile_t defaults;                /* Settings for libraries without their own profile */
 	int startup_timeout;               /* Maximum time to wait for Plex server in seconds */
+	int mount_poll_interval;           /* Seconds between mount table checks (0 disables) */
+	int timer_slack;                   /* Seconds scan wakeups are aligned to (0 disables) */
+	int batch_window;                  /* Milliseconds a busy event batch is held open (0 disables) */
+	int batch_rate;                    /* Events per second from which batches are held open */
+	int pending_memory;                /* Memory cap for pending scans in KB */
+	int throttle_low;                  /* Pressure in percent where crawls start slowing down */
+	int throttle_high;                 /* Pressure in percent where crawls pause (0 disables) */
+	int workers;                       /* Worker processes the libraries are split across (1 = none) */
+	int disk_scans;                    /* Scans in flight per disk (0 = unlimited) */
+	int disk_busy;                     /* Seconds a sent scan counts as in flight */
+	bool follow_symlinks;              /* Crawl and watch directories reached through symlinks */
+	char state_file[PATH_MAX_LEN];     /* File the cache and pending scans are saved to (empty disables) */
+	int state_interval;                /* Seconds between state snapshots (0 = only at exit) */
+	int echo_window;                   /* Seconds after a scan Plex's own writes are ignored (0 disables) */
+	char echo_patterns[PATH_MAX_LEN];  /* Comma-separated patterns of files Plex writes itself */
+	int echo_uid;                      /* User Plex runs as, its files count as its own (-1 if unset) */
+	int latency[SCAN_CLASSES];         /* Scan deadline per class in seconds after the event */
 	int log_level;                     /* Logging level threshold (syslog levels) */
 	bool verbose;                      /* Enable verbose output to console */
 	bool daemonize;                    /* Run process as background daemon */
@@ -27,5 +116,9 @@ extern config_t g_config;
 
 /* Configuration management */
 bool config_load(const char *config_path);
+void config_cleanup(void);
+void config_bind(const char *path, int server, int section_id);
+const profile_t *config_profile(int server, int section_id);
+time_t config_window(const profile_t *profile, time_t now);
 
 #endif /* CONFIG_H */
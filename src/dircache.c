@@ -2,61 +2,250 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include "config.h"
+#include "epoch.h"
 #include "logger.h"
+#include "probes.h"
 #include "utilities.h"
 
-KHASH_MAP_INIT_STR(dir_cache, cached_dir_t *) /* Main hash map from string to cached_dir_t* */
-static khash_t(dir_cache) * cache_hash;		  /* Hash table for directory cache */
+static cache_table_t *_Atomic cache_table;	  /* Table of cached directories, replaced when it grows */
+static long num_reads = 0;					  /* Directory listings read from disk */
+
+/* Allocate an empty cache table */
+static cache_table_t *table_create(uint32_t buckets) {
+	cache_table_t *table = calloc(1, sizeof(cache_table_t) + buckets * sizeof(cache_node_t *));
+	if (!table) {
+		return NULL;
+	}
+	table->mask = buckets - 1;
+	return table;
+}
+
+/* Free a table and its chain nodes, the cached directories are shared with its successor */
+static void table_release(void *ptr) {
+	cache_table_t *table = ptr;
+	for (uint32_t i = 0; i <= table->mask; i++) {
+		cache_node_t *node = atomic_load_explicit(&table->buckets[i], memory_order_relaxed);
+		while (node) {
+			cache_node_t *next = atomic_load_explicit(&node->next, memory_order_relaxed);
+			free(node);
+			node = next;
+		}
+	}
+	free(table);
+}
+
+/* Free a cached directory, its subdirectory keys must already be gone */
+static void dir_release(void *ptr) {
+	cached_dir_t *dir = ptr;
+	kh_destroy(file_set, dir->files);
+	free(dir->path);
+	free(dir);
+}
+
+static cached_dir_t *dircache_create(const char *path);
 
 /* Initialize the directory cache */
 bool dircache_init(void) {
 	log_message(LOG_INFO, "Initializing directory cache with hash table");
-	cache_hash = kh_init(dir_cache);
-	if (!cache_hash) {
+	cache_table_t *table = table_create(DIRCACHE_INITIAL_BUCKETS);
+	if (!table) {
 		log_message(LOG_ERR, "Failed to create directory cache hash table");
 		return false;
 	}
+	atomic_store(&cache_table, table);
 	return true;
 }
 
-/* Clean up the directory cache */
+/* Clean up the directory cache, no reader may be active */
 void dircache_cleanup(void) {
-	if (!cache_hash) {
+	cache_table_t *table = atomic_load(&cache_table);
+	if (!table) {
 		return;
 	}
 
 	log_message(LOG_INFO, "Cleaning up directory cache");
 
-	khint_t k;
-	for (k = kh_begin(cache_hash); k != kh_end(cache_hash); ++k) {
-		if (!kh_exist(cache_hash, k)) {
-			continue;
+	for (uint32_t i = 0; i <= table->mask; i++) {
+		for (cache_node_t *node = atomic_load(&table->buckets[i]); node; node = atomic_load(&node->next)) {
+			cached_dir_t *dir = node->dir;
+			if (dir->subdirs) {
+				khint_t sub_k;
+				for (sub_k = kh_begin(dir->subdirs); sub_k != kh_end(dir->subdirs); ++sub_k) {
+					if (kh_exist(dir->subdirs, sub_k)) {
+						free((void *) kh_key(dir->subdirs, sub_k));
+					}
+				}
+				kh_destroy(str_set, dir->subdirs);
+			}
+			dir_release(dir);
 		}
+	}
 
-		const char *path_key = kh_key(cache_hash, k);
-		cached_dir_t *dir = kh_value(cache_hash, k);
+	table_release(table);
+	atomic_store(&cache_table, NULL);
+	epoch_cleanup();
+}
 
-		if (dir && dir->subdirs) {
-			khint_t sub_k;
-			for (sub_k = kh_begin(dir->subdirs); sub_k != kh_end(dir->subdirs); ++sub_k) {
-				if (kh_exist(dir->subdirs, sub_k)) {
-					free((void *) kh_key(dir->subdirs, sub_k));
-				}
+/* Find a directory in the cache, safe for readers inside dircache_enter() */
+static cached_dir_t *dircache_find(const char *path) {
+	cache_table_t *table = atomic_load_explicit(&cache_table, memory_order_acquire);
+	if (!table) return NULL;
+
+	uint32_t hash = kh_str_hash_func(path);
+	cache_node_t *node = atomic_load_explicit(&table->buckets[hash & table->mask], memory_order_acquire);
+	while (node) {
+		if (node->hash == hash && strcmp(node->dir->path, path) == 0) {
+			return node->dir;
+		}
+		node = atomic_load_explicit(&node->next, memory_order_acquire);
+	}
+	return NULL;
+}
+
+/* Link a node at the head of its bucket, publishing it to readers */
+static void table_link(cache_table_t *table, cache_node_t *node) {
+	_Atomic(cache_node_t *) *head = &table->buckets[node->hash & table->mask];
+	atomic_store_explicit(&node->next, atomic_load_explicit(head, memory_order_relaxed),
+						  memory_order_relaxed);
+	atomic_store_explicit(head, node, memory_order_release);
+}
+
+/* Double the table by building a copy, readers keep using the old one until it is swapped */
+static bool table_grow(cache_table_t *table) {
+	cache_table_t *grown = table_create((table->mask + 1) * 2);
+	if (!grown) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i <= table->mask; i++) {
+		for (cache_node_t *node = atomic_load(&table->buckets[i]); node; node = atomic_load(&node->next)) {
+			cache_node_t *copy = malloc(sizeof(cache_node_t));
+			if (!copy) {
+				table_release(grown);
+				return false;
 			}
-			kh_destroy(str_set, dir->subdirs);
+			copy->hash = node->hash;
+			copy->dir = node->dir;
+			table_link(grown, copy);
 		}
-		free(dir);
-		free((void *) path_key);
+	}
+	grown->count = table->count;
+
+	atomic_store_explicit(&cache_table, grown, memory_order_release);
+	epoch_retire(table, table_release);
+	return true;
+}
+
+/* Insert a directory into the cache table */
+static bool dircache_insert(cached_dir_t *dir) {
+	cache_table_t *table = atomic_load(&cache_table);
+
+	/* Keep chains short, a failed grow only makes them longer */
+	if (table->count > table->mask && table_grow(table)) {
+		table = atomic_load(&cache_table);
+	}
+
+	cache_node_t *node = malloc(sizeof(cache_node_t));
+	if (!node) {
+		return false;
+	}
+	node->hash = kh_str_hash_func(dir->path);
+	node->dir = dir;
+	table_link(table, node);
+	table->count++;
+	return true;
+}
+
+/* Drop a directory and everything cached below it */
+static void dircache_evict(const char *path) {
+	cache_table_t *table = atomic_load(&cache_table);
+	uint32_t hash = kh_str_hash_func(path);
+	_Atomic(cache_node_t *) *link = &table->buckets[hash & table->mask];
+	cache_node_t *node;
+
+	while ((node = atomic_load(link))) {
+		if (node->hash == hash && strcmp(node->dir->path, path) == 0) {
+			break;
+		}
+		link = &node->next;
+	}
+	if (!node) {
+		return;
 	}
 
-	kh_destroy(dir_cache, cache_hash);
-	cache_hash = NULL;
+	/* Unlink first, readers already on the node still find their way down the chain */
+	atomic_store_explicit(link, atomic_load(&node->next), memory_order_release);
+	table->count--;
+
+	cached_dir_t *dir = node->dir;
+	if (dir->subdirs) {
+		for (khint_t k = kh_begin(dir->subdirs); k != kh_end(dir->subdirs); ++k) {
+			if (kh_exist(dir->subdirs, k)) {
+				const char *key = kh_key(dir->subdirs, k);
+				dircache_evict(key);
+				free((void *) key);
+			}
+		}
+		kh_destroy(str_set, dir->subdirs);
+		dir->subdirs = NULL;
+	}
+
+	epoch_retire(node, free);
+	epoch_retire(dir, dir_release);
+}
+
+/* Add a change in subtree size to every cached ancestor, up to the first one not cached */
+static void dircache_propagate(const char *path, int dirs, int files) {
+	char parent[PATH_MAX_LEN];
+	char *slash;
+
+	snprintf(parent, sizeof(parent), "%s", path);
+	while ((slash = strrchr(parent, '/')) && slash != parent) {
+		*slash = '\0';
+		cached_dir_t *dir = dircache_find(parent);
+		if (!dir) {
+			break;
+		}
+		dir->subtree_dirs += dirs;
+		dir->subtree_files += files;
+	}
+}
+
+/* Recount a subtree from the directory's own files and its cached children, passing the difference up */
+static void dircache_aggregate(cached_dir_t *dir) {
+	int dirs = 1;
+	int files = dir->media_files + dir->other_files;
+
+	if (dir->subdirs) {
+		for (khint_t k = kh_begin(dir->subdirs); k != kh_end(dir->subdirs); ++k) {
+			if (!kh_exist(dir->subdirs, k)) continue;
+
+			const cached_dir_t *child = dircache_find(kh_key(dir->subdirs, k));
+			if (child) {
+				dirs += child->subtree_dirs;
+				files += child->subtree_files;
+			}
+		}
+	}
+
+	int dirs_delta = dirs - dir->subtree_dirs;
+	int files_delta = files - dir->subtree_files;
+	dir->subtree_dirs = dirs;
+	dir->subtree_files = files;
+	if (dirs_delta != 0 || files_delta != 0) {
+		dircache_propagate(dir->path, dirs_delta, files_delta);
+	}
 }
 
 /* Get file modification time */
@@ -68,16 +257,6 @@ static time_t dircache_mtime(const char *path) {
 	return st.st_mtime;
 }
 
-/* Find a directory in the cache */
-static cached_dir_t *dircache_find(const char *path) {
-	if (!cache_hash) return NULL;
-	khint_t k = kh_get(dir_cache, cache_hash, path);
-	if (k == kh_end(cache_hash)) {
-		return NULL;
-	}
-	return kh_value(cache_hash, k);
-}
-
 /* Creates a temporary hash set of all subdirectory keys from a cached directory */
 static khash_t(str_set) * dircache_mark(cached_dir_t *dir) {
 	if (!dir->validated || !dir->subdirs) {
@@ -106,8 +285,80 @@ static khash_t(str_set) * dircache_mark(cached_dir_t *dir) {
 	return unseen;
 }
 
-/* Scans a directory on disk, identifies new subdirectories, and updates the cache */
-static bool dircache_sweep(const char *path, cached_dir_t *dir, khash_t(str_set) * unseen, dir_changes_t *changes) {
+/* Append a new subdirectory to the reported changes, the key stays owned by the cache */
+static bool changes_add(dir_changes_t *changes, const char *key) {
+	/* Grow added list using exponential growth */
+	if (changes->added_count >= changes->added_capacity) {
+		int new_cap = changes->added_capacity == 0 ? 16 : changes->added_capacity * 2;
+		const char **new_list = realloc((void *) changes->added, new_cap * sizeof(char *));
+		if (!new_list) {
+			log_message(LOG_WARNING, "Failed to realloc for added list");
+			return false;
+		}
+		changes->added = new_list;
+		changes->added_capacity = new_cap;
+	}
+	changes->added[changes->added_count++] = key;
+	return true;
+}
+
+/* Identify a file by name and inode, so a file replaced under the same name counts as new */
+static uint64_t file_identity(const char *name, ino_t ino) {
+	uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+	for (const unsigned char *c = (const unsigned char *) name; *c; c++) {
+		hash = (hash ^ *c) * 1099511628211ULL;
+	}
+	hash = (hash ^ (uint64_t) ino) * 1099511628211ULL;
+	return hash != 0 ? hash : 1; /* Zero marks entries that are not files */
+}
+
+/* Add a file to the identities of this listing, reporting it if the last listing lacked it */
+static bool files_track(khash_t(file_set) * files, const cached_dir_t *dir, uint64_t id, const char *name,
+						dir_changes_t *changes) {
+	int ret;
+	kh_put(file_set, files, id, &ret);
+	if (ret == -1) {
+		return false;
+	}
+
+	/* Without an earlier listing every file is new, which the counts already report */
+	if (!changes || !dir->files || kh_get(file_set, dir->files, id) != kh_end(dir->files)) {
+		return true;
+	}
+
+	if (changes->files_count >= changes->files_capacity) {
+		int new_cap = changes->files_capacity == 0 ? 16 : changes->files_capacity * 2;
+		const char **new_list = realloc((void *) changes->files, new_cap * sizeof(char *));
+		if (!new_list) {
+			log_message(LOG_WARNING, "Failed to realloc for file list");
+			return false;
+		}
+		changes->files = new_list;
+		changes->files_capacity = new_cap;
+	}
+	char *copy = strdup(name);
+	if (!copy) {
+		log_message(LOG_WARNING, "Failed to copy name for file list entry");
+		return false;
+	}
+	changes->files[changes->files_count++] = copy;
+	return true;
+}
+
+/* Replace the file identities of a directory once a listing saw all of them */
+static void files_replace(cached_dir_t *dir, khash_t(file_set) * files, bool complete) {
+	if (!complete) {
+		kh_destroy(file_set, files);
+		return;
+	}
+	kh_destroy(file_set, dir->files);
+	dir->files = files;
+}
+
+/* Scans a directory on disk, identifies new subdirectories, and updates the cache.
+ * `complete` is cleared when changes may have been missed */
+static bool dircache_sweep(const char *path, cached_dir_t *dir, khash_t(str_set) * unseen, dir_changes_t *changes,
+						   bool *complete) {
 	DIR *dirp;
 	struct dirent *entry;
 	bool changed = false; /* Tracks if cache structure was modified */
@@ -120,11 +371,22 @@ static bool dircache_sweep(const char *path, cached_dir_t *dir, khash_t(str_set)
 
 	int skipped_symlinks = 0;
 	int skipped_unknown = 0;
+	int media_files = 0;
+	int other_files = 0;
+
+	*complete = false;
+	khash_t(file_set) *files = kh_init(file_set);
+	if (!files) {
+		log_message(LOG_ERR, "Failed to create file hash set for sync");
+		return false;
+	}
 
 	if (!(dirp = opendir(path))) {
 		log_message(LOG_ERR, "Failed to open directory %s: %s", path, strerror(errno));
+		kh_destroy(file_set, files);
 		return false;
 	}
+	num_reads++;
 
 	/* Scan the directory on disk */
 	while ((entry = readdir(dirp))) {
@@ -132,8 +394,8 @@ static bool dircache_sweep(const char *path, cached_dir_t *dir, khash_t(str_set)
 			continue;
 		}
 
-		/* Skip symlinks to avoid stat() calls */
-		if (entry->d_type == DT_LNK) {
+		/* Skip symlinks to avoid stat() calls, unless they are to be followed */
+		if (entry->d_type == DT_LNK && !g_config.follow_symlinks) {
 			skipped_symlinks++;
 			continue;
 		}
@@ -159,6 +421,15 @@ static bool dircache_sweep(const char *path, cached_dir_t *dir, khash_t(str_set)
 		sprintf(full_path, "%s/%s", path, entry->d_name);
 
 		if (!is_directory(full_path, entry->d_type)) {
+			/* Count files so the caller can tell new media from metadata changes */
+			if (is_media_file(entry->d_name)) {
+				media_files++;
+			} else {
+				other_files++;
+			}
+			if (!files_track(files, dir, file_identity(entry->d_name, entry->d_ino), entry->d_name, changes)) {
+				success = false;
+			}
 			continue;
 		}
 
@@ -186,7 +457,7 @@ static bool dircache_sweep(const char *path, cached_dir_t *dir, khash_t(str_set)
 
 		/* Insert into hash table. Return values: -1=error, 0=exists, 1=inserted */
 		int ret;
-		kh_put(str_set, dir->subdirs, key, &ret);
+		khint_t key_k = kh_put(str_set, dir->subdirs, key, &ret);
 		if (ret == -1) {
 			log_message(LOG_WARNING, "Failed to insert key into hash set");
 			free(key);
@@ -194,31 +465,30 @@ static bool dircache_sweep(const char *path, cached_dir_t *dir, khash_t(str_set)
 			continue;
 		}
 
-		changed = true;
-
-		if (!changes) {
+		/* A key the caller never heard of would not be reported by the next diff either */
+		if (changes && !changes_add(changes, key)) {
+			kh_del(str_set, dir->subdirs, key_k);
+			free(key);
+			success = false;
 			continue;
 		}
 
-		/* Grow added list using exponential growth */
-		if (changes->added_count >= changes->added_capacity) {
-			int new_cap = changes->added_capacity == 0 ? 16 : changes->added_capacity * 2;
-			const char **new_list = realloc((void *) changes->added, new_cap * sizeof(char *));
-			if (!new_list) {
-				log_message(LOG_WARNING, "Failed to realloc for added list");
-				/* Key is in cache, but not in changes - non-fatal, continue */
-				success = false;
-				continue;
-			}
-			changes->added = new_list;
-			changes->added_capacity = new_cap;
-		}
-		/* Store pointer to key (owned by hash table, not copied) */
-		changes->added[changes->added_count++] = key;
+		changed = true;
 	}
 	closedir(dirp);
 	free(full_path);
 
+	/* Report file count changes, only a complete listing replaces the old counts */
+	if (success) {
+		if (changes) {
+			changes->media_delta = media_files - dir->media_files;
+			changes->other_delta = other_files - dir->other_files;
+		}
+		dir->media_files = media_files;
+		dir->other_files = other_files;
+	}
+	files_replace(dir, files, success);
+
 	if (skipped_symlinks > 0) {
 		log_message(LOG_DEBUG, "Skipped %d symlinks in %s (performance optimization)",
 					skipped_symlinks, path);
@@ -228,8 +498,8 @@ static bool dircache_sweep(const char *path, cached_dir_t *dir, khash_t(str_set)
 					skipped_unknown, path);
 	}
 
-	/* Return true only if structure changed and no errors occurred */
-	return changed && success;
+	*complete = success;
+	return changed;
 }
 
 /* Processes deleted directories and updates the cache */
@@ -277,11 +547,360 @@ static bool dircache_reap(cached_dir_t *dir, khash_t(str_set) * unseen, dir_chan
 
 		khint_t main_k = kh_get(str_set, dir->subdirs, key_to_del);
 		if (main_k != kh_end(dir->subdirs)) {
-			free((void *) kh_key(dir->subdirs, main_k));
+			const char *key = kh_key(dir->subdirs, main_k);
 			kh_del(str_set, dir->subdirs, main_k);
+
+			dircache_evict(key);
+			free((void *) key);
+		}
+	}
+
+	return true;
+}
+
+/* Append an entry to a directory listing */
+static bool sweep_append(sweep_list_t *list, const char *name, ino_t ino, unsigned char type) {
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return true;
+	}
+
+	if (list->count >= list->capacity) {
+		int new_capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+		sweep_entry_t *new_entries = realloc(list->entries, new_capacity * sizeof(sweep_entry_t));
+		if (!new_entries) {
+			return false;
+		}
+		list->entries = new_entries;
+		list->capacity = new_capacity;
+	}
+
+	size_t name_size = strlen(name) + 1;
+	if (list->names_len + name_size > list->names_cap) {
+		size_t new_cap = list->names_cap > 0 ? list->names_cap * 2 : DIRCACHE_CHUNK_SIZE;
+		while (new_cap < list->names_len + name_size) new_cap *= 2;
+		char *new_names = realloc(list->names, new_cap);
+		if (!new_names) {
+			return false;
+		}
+		list->names = new_names;
+		list->names_cap = new_cap;
+	}
+
+	memcpy(list->names + list->names_len, name, name_size);
+	list->entries[list->count].name = list->names_len;
+	list->entries[list->count].ino = ino;
+	list->entries[list->count].type = type;
+	list->names_len += name_size;
+	list->count++;
+	return true;
+}
+
+/* Read every entry of a directory, DIRCACHE_CHUNK_SIZE bytes of entries per system call */
+static bool sweep_read(const char *path, sweep_list_t *list) {
+	bool success = true;
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		log_message(LOG_ERR, "Failed to open directory %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	char *chunk = malloc(DIRCACHE_CHUNK_SIZE);
+	if (!chunk) {
+		log_message(LOG_ERR, "Failed to allocate directory read buffer for %s", path);
+		close(fd);
+		return false;
+	}
+
+	off_t base = 0;
+	ssize_t nbytes;
+	while (success && (nbytes = getdirentries(fd, chunk, DIRCACHE_CHUNK_SIZE, &base)) > 0) {
+		for (ssize_t offset = 0; success && offset < nbytes;) {
+			const struct dirent *entry = (const struct dirent *) (chunk + offset);
+			if (entry->d_reclen == 0) break;
+			offset += entry->d_reclen;
+
+			/* Slots of deleted entries carry no inode */
+			if (entry->d_ino != 0) {
+				success = sweep_append(list, entry->d_name, entry->d_ino, entry->d_type);
+			}
+		}
+	}
+	if (success && nbytes < 0) {
+		log_message(LOG_ERR, "Failed to read directory %s: %s", path, strerror(errno));
+		success = false;
+	} else if (!success) {
+		log_message(LOG_ERR, "Failed to allocate memory for the entries of %s", path);
+	}
+
+	free(chunk);
+	close(fd);
+
+	return success;
+}
+
+/* Diff one share of the listing against the cached subdirectories, runs on a worker thread */
+static void *sweep_worker(void *arg) {
+	sweep_part_t *part = arg;
+	const khash_t(str_set) *subdirs = part->dir->subdirs;
+	char *full_path = NULL;
+	size_t full_path_cap = 0;
+	size_t path_len = strlen(part->path);
+
+	for (int i = part->start; i < part->end; i++) {
+		const char *name = part->names + part->entries[i].name;
+		unsigned char type = part->entries[i].type;
+
+		if (type == DT_LNK && !g_config.follow_symlinks) {
+			part->skipped_symlinks++;
+			continue;
+		}
+		if (type == DT_UNKNOWN) {
+			part->skipped_unknown++;
+		}
+
+		size_t required_len = path_len + strlen(name) + 2;
+		if (required_len > full_path_cap) {
+			char *new_buf = realloc(full_path, required_len);
+			if (!new_buf) {
+				part->failed = true;
+				continue;
+			}
+			full_path = new_buf;
+			full_path_cap = required_len;
 		}
+		sprintf(full_path, "%s/%s", part->path, name);
+
+		if (!is_directory(full_path, type)) {
+			if (is_media_file(name)) {
+				part->media_files++;
+			} else {
+				part->other_files++;
+			}
+			part->identities[i] = file_identity(name, part->entries[i].ino);
+			continue;
+		}
+
+		/* Names are unique, so no other share writes the same flag */
+		khint_t k = kh_get(str_set, subdirs, full_path);
+		if (k != kh_end(subdirs)) {
+			part->seen[k] = 1;
+			continue;
+		}
+
+		if (part->added_count >= part->added_capacity) {
+			int new_cap = part->added_capacity > 0 ? part->added_capacity * 2 : 16;
+			char **new_list = realloc(part->added, new_cap * sizeof(char *));
+			if (!new_list) {
+				part->failed = true;
+				continue;
+			}
+			part->added = new_list;
+			part->added_capacity = new_cap;
+		}
+		char *key = strdup(full_path);
+		if (!key) {
+			part->failed = true;
+			continue;
+		}
+		part->added[part->added_count++] = key;
+	}
+
+	free(full_path);
+	return NULL;
+}
+
+/* Collect cached subdirectories in one range of buckets that the listing did not contain */
+static void *sweep_collect(void *arg) {
+	sweep_part_t *part = arg;
+	const khash_t(str_set) *subdirs = part->dir->subdirs;
+
+	for (khint_t k = part->bucket_start; k < part->bucket_end; k++) {
+		if (!kh_exist(subdirs, k) || part->seen[k]) {
+			continue;
+		}
+
+		if (part->removed_count >= part->removed_capacity) {
+			int new_cap = part->removed_capacity > 0 ? part->removed_capacity * 2 : 16;
+			const char **new_list = realloc((void *) part->removed, new_cap * sizeof(char *));
+			if (!new_list) {
+				part->failed = true;
+				return NULL; /* The sync leaves the directory to be diffed again */
+			}
+			part->removed = new_list;
+			part->removed_capacity = new_cap;
+		}
+		part->removed[part->removed_count++] = kh_key(subdirs, k);
+	}
+	return NULL;
+}
+
+/* Run a function over every share, the first one on this thread */
+static void sweep_run(sweep_part_t *parts, int num_parts, void *(*fn)(void *)) {
+	pthread_t threads[DIRCACHE_MAX_THREADS];
+	bool started[DIRCACHE_MAX_THREADS] = { false };
+
+	for (int i = 1; i < num_parts; i++) {
+		started[i] = pthread_create(&threads[i], NULL, fn, &parts[i]) == 0;
+	}
+	fn(&parts[0]);
+
+	/* Shares without a thread run here once the others are underway */
+	for (int i = 1; i < num_parts; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		} else {
+			fn(&parts[i]);
+		}
+	}
+}
+
+/* Check whether the last listing of a directory was large enough to diff in parallel */
+static bool dircache_large(const cached_dir_t *dir) {
+	return dir->validated && dir->subdirs &&
+		   (long) kh_size(dir->subdirs) + dir->media_files + dir->other_files >= DIRCACHE_LARGE_ENTRIES;
+}
+
+/* Sweep and reap a large directory, with the diff split across worker threads. Returns false
+ * if the directory could not be read, `complete` is cleared when changes may have been missed */
+static bool dircache_diff(const char *path, cached_dir_t *dir, dir_changes_t *changes, bool *added,
+						  bool *removed, bool *complete) {
+	sweep_list_t list = { 0 };
+	sweep_part_t parts[DIRCACHE_MAX_THREADS];
+	*added = false;
+	*removed = false;
+	*complete = true;
+
+	if (!sweep_read(path, &list)) {
+		free(list.entries);
+		free(list.names);
+		return false;
+	}
+	num_reads++;
+
+	/* One flag per bucket marks the cached subdirectories still on disk */
+	khint_t buckets = kh_end(dir->subdirs);
+	uint8_t *seen = calloc(buckets > 0 ? buckets : 1, 1);
+	uint64_t *identities = calloc(list.count > 0 ? list.count : 1, sizeof(uint64_t));
+	khash_t(file_set) *files = kh_init(file_set);
+	if (!seen || !identities || !files) {
+		log_message(LOG_ERR, "Failed to allocate memory to diff %s", path);
+		free(seen);
+		free(identities);
+		kh_destroy(file_set, files);
+		free(list.entries);
+		free(list.names);
+		return false;
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_parts = cpus < 1 ? 1 : cpus > DIRCACHE_MAX_THREADS ? DIRCACHE_MAX_THREADS : (int) cpus;
+	memset(parts, 0, sizeof(parts));
+	for (int i = 0; i < num_parts; i++) {
+		parts[i].path = path;
+		parts[i].dir = dir;
+		parts[i].entries = list.entries;
+		parts[i].names = list.names;
+		parts[i].identities = identities;
+		parts[i].start = (int) ((long) list.count * i / num_parts);
+		parts[i].end = (int) ((long) list.count * (i + 1) / num_parts);
+		parts[i].bucket_start = (khint_t) ((uint64_t) buckets * i / num_parts);
+		parts[i].bucket_end = (khint_t) ((uint64_t) buckets * (i + 1) / num_parts);
+		parts[i].seen = seen;
+	}
+
+	/* Listing first, then the cached subdirectories it did not contain, partitioned by hash bucket */
+	sweep_run(parts, num_parts, sweep_worker);
+	sweep_run(parts, num_parts, sweep_collect);
+	free(seen);
+
+	bool success = true;
+	int media_files = 0, other_files = 0, skipped_symlinks = 0, skipped_unknown = 0, num_removed = 0;
+	for (int i = 0; i < num_parts; i++) {
+		success = success && !parts[i].failed;
+		media_files += parts[i].media_files;
+		other_files += parts[i].other_files;
+		skipped_symlinks += parts[i].skipped_symlinks;
+		skipped_unknown += parts[i].skipped_unknown;
+		num_removed += parts[i].removed_count;
+	}
+
+	/* Deletions go through the usual reaping, before insertions can rehash the set. A share that
+	 * failed may not have marked every subdirectory it saw, so reaping waits for a complete listing */
+	khash_t(str_set) *unseen = success && num_removed > 0 ? kh_init(str_set) : NULL;
+	for (int i = 0; unseen && i < num_parts; i++) {
+		for (int j = 0; j < parts[i].removed_count; j++) {
+			int ret;
+			kh_put(str_set, unseen, parts[i].removed[j], &ret);
+			if (ret == -1) success = false;
+		}
+	}
+	if (success && num_removed > 0 && !unseen) {
+		log_message(LOG_ERR, "Failed to create temporary hash set for sync");
+		success = false;
+	}
+	*removed = dircache_reap(dir, unseen, changes);
+	kh_destroy(str_set, unseen);
+
+	for (int i = 0; i < num_parts; i++) {
+		for (int j = 0; j < parts[i].added_count; j++) {
+			char *key = parts[i].added[j];
+			int ret;
+			khint_t key_k = kh_put(str_set, dir->subdirs, key, &ret);
+			if (ret != 1) {
+				if (ret == -1) success = false;
+				free(key);
+				continue;
+			}
+
+			/* Left out of the cache until it can be reported, so the next diff finds it again */
+			if (changes && !changes_add(changes, key)) {
+				kh_del(str_set, dir->subdirs, key_k);
+				free(key);
+				success = false;
+				continue;
+			}
+			*added = true;
+		}
+		free(parts[i].added);
+		free((void *) parts[i].removed);
+	}
+
+	/* File identities are collected in listing order, the set itself is not shared with workers */
+	for (int i = 0; i < list.count; i++) {
+		if (identities[i] != 0 &&
+			!files_track(files, dir, identities[i], list.names + list.entries[i].name, changes)) {
+			success = false;
+		}
+	}
+	free(identities);
+
+	/* Only a complete listing replaces the old counts */
+	if (success) {
+		if (changes) {
+			changes->media_delta = media_files - dir->media_files;
+			changes->other_delta = other_files - dir->other_files;
+		}
+		dir->media_files = media_files;
+		dir->other_files = other_files;
+	} else {
+		log_message(LOG_WARNING, "Failed to allocate memory while diffing %s", path);
 	}
+	files_replace(dir, files, success);
 
+	if (skipped_symlinks > 0) {
+		log_message(LOG_DEBUG, "Skipped %d symlinks in %s (performance optimization)",
+					skipped_symlinks, path);
+	}
+	if (skipped_unknown > 0) {
+		log_message(LOG_WARNING, "Encountered %d entries with DT_UNKNOWN in %s",
+					skipped_unknown, path);
+	}
+	log_message(LOG_DEBUG, "Diffed %d entries of %s on %d threads", list.count, path, num_parts);
+
+	free(list.entries);
+	free(list.names);
+	*complete = success;
 	return true;
 }
 
@@ -298,6 +917,11 @@ static bool dircache_sync(const char *path, cached_dir_t *dir, bool *changed, di
 		changes->removed = NULL;
 		changes->removed_count = 0;
 		changes->removed_capacity = 0;
+		changes->files = NULL;
+		changes->files_count = 0;
+		changes->files_capacity = 0;
+		changes->media_delta = 0;
+		changes->other_delta = 0;
 	}
 
 	start_mtime = dircache_mtime(path);
@@ -306,28 +930,44 @@ static bool dircache_sync(const char *path, cached_dir_t *dir, bool *changed, di
 		return false;
 	}
 
-	/* Mark: Create a set of existing keys to find deletions later */
-	khash_t(str_set) *unseen = dircache_mark(dir);
+	PROBE2(sync__start, path, dir->subdirs ? (int) kh_size(dir->subdirs) : 0);
 
-	/* Ensure the primary subdirs hash set exists */
-	if (!dir->subdirs) {
-		dir->subdirs = kh_init(str_set);
-		if (!dir->subdirs) {
-			log_message(LOG_ERR, "Failed to create subdirectory hash set");
-			kh_destroy(str_set, unseen);
+	bool added, removed;
+	bool complete = true;
+	if (dircache_large(dir)) {
+		/* Huge flat directories are diffed on worker threads */
+		if (!dircache_diff(path, dir, changes, &added, &removed, &complete)) {
 			return false;
 		}
-	}
+	} else {
+		/* Mark: Create a set of existing keys to find deletions later */
+		khash_t(str_set) *unseen = dircache_mark(dir);
 
-	/* Sweep: Scan disk for new/existing dirs */
-	bool added = dircache_sweep(path, dir, unseen, changes);
+		/* Ensure the primary subdirs hash set exists */
+		if (!dir->subdirs) {
+			dir->subdirs = kh_init(str_set);
+			if (!dir->subdirs) {
+				log_message(LOG_ERR, "Failed to create subdirectory hash set");
+				kh_destroy(str_set, unseen);
+				return false;
+			}
+		}
 
-	/* Reap: Process dirs that were marked but not swept */
-	bool removed = dircache_reap(dir, unseen, changes);
+		/* Sweep: Scan disk for new/existing dirs */
+		added = dircache_sweep(path, dir, unseen, changes, &complete);
 
-	kh_destroy(str_set, unseen);
+		/* Reap: Process dirs that were marked but not swept, unless the sweep may have skipped some */
+		removed = complete && dircache_reap(dir, unseen, changes);
+
+		kh_destroy(str_set, unseen);
+	}
 
 	*changed = added || removed;
+	PROBE4(sync__end, path, (int) kh_size(dir->subdirs), changes ? changes->added_count : -1,
+		   changes ? changes->removed_count : -1);
+
+	/* Removed children are gone from the cache by now, new ones count once they are cached */
+	dircache_aggregate(dir);
 
 	if (*changed) {
 		log_message(LOG_DEBUG, "Directory structure in %s has changed, cache updated", path);
@@ -344,53 +984,133 @@ static bool dircache_sync(const char *path, cached_dir_t *dir, bool *changed, di
 	}
 
 	dir->validated = true;
-	/* Ensure next refresh catches any changes that occurred during this scan */
-	dir->mtime = start_mtime;
+	/* Ensure next refresh catches any changes that occurred during this scan,
+	 * or diffs again when this one could not record every change */
+	dir->mtime = complete ? start_mtime : 0;
 
 	return true;
 }
 
 /* Adds a new directory to the cache and performs an initial sync */
 static bool dircache_add(const char *path, bool *changed, dir_changes_t *changes) {
+	cached_dir_t *dir = dircache_create(path);
+	if (!dir) {
+		return false;
+	}
+
+	/* Check and update directory structure */
+	if (!dircache_sync(path, dir, changed, changes)) {
+		/* The entry will be cleaned up during dircache_cleanup */
+		return false;
+	}
+
+	log_message(LOG_DEBUG, "Directory %s added to cache", path);
+	return true;
+}
+
+/* Allocates an empty cache entry and links it into the table */
+static cached_dir_t *dircache_create(const char *path) {
 	cached_dir_t *dir = malloc(sizeof(cached_dir_t));
 	if (!dir) {
 		log_message(LOG_ERR, "Failed to allocate memory for directory cache");
-		return false;
+		return NULL;
 	}
 
 	/* Initialize new cache entry */
+	dir->path = strdup(path); /* Must allocate a copy for the key */
 	dir->mtime = 0;
 	dir->subdirs = NULL;
+	dir->files = NULL;
+	dir->media_files = 0;
+	dir->other_files = 0;
+	dir->subtree_dirs = 0;
+	dir->subtree_files = 0;
 	dir->validated = false;
-
-	/* Add to hash table */
-	char *key_copy = strdup(path); /* Must allocate a copy for the key */
-	if (!key_copy) {
+	if (!dir->path) {
 		log_message(LOG_ERR, "Failed to allocate memory for hash table key");
 		free(dir);
-		return false;
+		return NULL;
 	}
 
-	int ret;
-	khint_t k = kh_put(dir_cache, cache_hash, key_copy, &ret);
-	if (ret == -1) {
+	/* Add to hash table */
+	if (!dircache_insert(dir)) {
 		log_message(LOG_ERR, "Failed to add directory to hash table");
-		free(key_copy);
-		free(dir);
-		return false;
+		dir_release(dir);
+		return NULL;
 	}
-	kh_value(cache_hash, k) = dir;
 
-	/* Check and update directory structure */
-	if (!dircache_sync(path, dir, changed, changes)) {
-		/* The entry will be cleaned up during dircache_cleanup */
+	/* Count it in the cached ancestors */
+	dircache_aggregate(dir);
+	return dir;
+}
+
+/* Recreate a validated cache entry from saved state, takes ownership of the subdirectory paths */
+bool dircache_restore(const char *path, time_t mtime, int media_files, int other_files,
+					  char **subdirs, int count) {
+	bool success = false;
+	cached_dir_t *dir = NULL;
+
+	if (!dircache_find(path) && (dir = dircache_create(path))) {
+		dir->subdirs = kh_init(str_set);
+		success = dir->subdirs != NULL;
+	}
+
+	for (int i = 0; i < count; i++) {
+		int ret = -1;
+		if (success) {
+			kh_put(str_set, dir->subdirs, subdirs[i], &ret);
+		}
+		if (ret <= 0) {
+			free(subdirs[i]); /* Duplicate or not stored */
+		}
+	}
+	if (!success) {
 		return false;
 	}
 
-	log_message(LOG_DEBUG, "Directory %s added to cache", path);
+	dir->media_files = media_files;
+	dir->other_files = other_files;
+	dir->mtime = mtime;
+	dir->validated = true;
+	dircache_aggregate(dir); /* Children restored earlier are counted in now */
 	return true;
 }
 
+/* Get the cached directories and files at or below a path, false if it is not cached */
+bool dircache_size(const char *path, int *dirs, int *files) {
+	const cached_dir_t *dir = dircache_find(path);
+	if (!dir) {
+		return false;
+	}
+	*dirs = dir->subtree_dirs;
+	*files = dir->subtree_files;
+	return true;
+}
+
+/* Get the number of directory listings read from disk so far */
+long dircache_reads(void) {
+	return num_reads;
+}
+
+/* Check whether a directory has an entry in the cache */
+bool dircache_cached(const char *path) {
+	return dircache_find(path) != NULL;
+}
+
+/* Call a function for every validated cache entry, only from the owning thread */
+void dircache_each(void (*fn)(const cached_dir_t *dir, void *arg), void *arg) {
+	cache_table_t *table = atomic_load(&cache_table);
+	if (!table) return;
+
+	for (uint32_t i = 0; i <= table->mask; i++) {
+		for (cache_node_t *node = atomic_load(&table->buckets[i]); node; node = atomic_load(&node->next)) {
+			if (atomic_load(&node->dir->validated)) {
+				fn(node->dir, arg);
+			}
+		}
+	}
+}
+
 /* Check if directory has changed and update cache if needed */
 bool dircache_refresh(const char *path, bool *changed, dir_changes_t *changes) {
 	cached_dir_t *dir;
@@ -402,8 +1122,15 @@ bool dircache_refresh(const char *path, bool *changed, dir_changes_t *changes) {
 		changes->added_count = 0;
 		changes->removed = NULL;
 		changes->removed_count = 0;
+		changes->files = NULL;
+		changes->files_count = 0;
+		changes->media_delta = 0;
+		changes->other_delta = 0;
 	}
 
+	/* Free what readers can no longer see */
+	epoch_reclaim();
+
 	/* Get current mtime */
 	current_mtime = dircache_mtime(path);
 	if (current_mtime == 0) {
@@ -433,6 +1160,16 @@ bool dircache_refresh(const char *path, bool *changed, dir_changes_t *changes) {
 	return true;
 }
 
+/* Check if a directory is missing from the cache or its mtime has moved on */
+bool dircache_stale(const char *path) {
+	cached_dir_t *dir = dircache_find(path);
+	if (!dir || !dir->validated) {
+		return true;
+	}
+
+	return dir->mtime != dircache_mtime(path);
+}
+
 /* Get subdirectories from cache */
 const char **dircache_subdirs(const char *path, int *count) {
 	cached_dir_t *dir;
@@ -473,6 +1210,27 @@ const char **dircache_subdirs(const char *path, int *count) {
 	return subdirs_array;
 }
 
+/* Enter a read-side section for lookups from another thread */
+bool dircache_enter(void) {
+	return epoch_enter();
+}
+
+/* Leave a read-side section */
+void dircache_exit(void) {
+	epoch_exit();
+}
+
+/* Give up read access before the calling thread exits */
+void dircache_detach(void) {
+	epoch_release();
+}
+
+/* Check whether a directory is cached and still at the given mtime, lock-free for readers */
+bool dircache_current(const char *path, time_t mtime) {
+	cached_dir_t *dir = dircache_find(path);
+	return dir && atomic_load(&dir->validated) && atomic_load(&dir->mtime) == mtime;
+}
+
 /* Free subdirectory list */
 void dircache_free(const char **subdirs) {
 	if (!subdirs) return;
@@ -499,4 +1257,15 @@ void changes_free(dir_changes_t *changes) {
 	changes->removed = NULL;
 	changes->removed_count = 0;
 	changes->removed_capacity = 0;
+
+	/* The 'files' list contains heap-allocated copies of names */
+	if (changes->files) {
+		for (int i = 0; i < changes->files_count; i++) {
+			free((void *) changes->files[i]);
+		}
+		free((void *) changes->files);
+	}
+	changes->files = NULL;
+	changes->files_count = 0;
+	changes->files_capacity = 0;
 }
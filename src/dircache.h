@@ -2,19 +2,90 @@
 #define DIRCACHE_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include "../lib/khash.h"
 
 KHASH_SET_INIT_STR(str_set)            /* Define a hash set of strings */
+KHASH_SET_INIT_INT64(file_set)         /* Define a hash set of file identities */
+
+/* Directory cache configuration */
+#define DIRCACHE_INITIAL_BUCKETS 1024  /* Initial number of buckets in the cache table */
+#define DIRCACHE_LARGE_ENTRIES 20000   /* Entries from which a directory is diffed by worker threads */
+#define DIRCACHE_MAX_THREADS 8         /* Upper bound for diff worker threads */
+#define DIRCACHE_CHUNK_SIZE 262144     /* Bytes of directory entries read per system call, 256KB */
 
 /* Structure to represent a cached directory with metadata */
 typedef struct cached_dir {
-	time_t mtime;                      /* Last modification time from stat() */
-	khash_t(str_set) * subdirs;        /* Hash set of subdirectories for fast lookups */
-	bool validated;                    /* Whether the cache entry is up-to-date */
+	char *path;                        /* Directory path, owned by the entry */
+	_Atomic time_t mtime;              /* Last modification time from stat() */
+	khash_t(str_set) * subdirs;        /* Hash set of subdirectories, only used by the owner */
+	khash_t(file_set) * files;         /* Name and inode hashes of the files, NULL until a sync lists them */
+	int media_files;                   /* Number of media files seen by the last sync */
+	int other_files;                   /* Number of other files seen by the last sync */
+	int subtree_dirs;                  /* Cached directories at or below this one */
+	int subtree_files;                 /* Files counted at or below this one */
+	_Atomic bool validated;            /* Whether the cache entry is up-to-date */
 } cached_dir_t;
 
+/* Bucket chain node of the cache table */
+typedef struct cache_node {
+	struct cache_node *_Atomic next;   /* Next node in the same bucket */
+	uint32_t hash;                     /* Hash of the directory path */
+	cached_dir_t *dir;                 /* Cached directory */
+} cache_node_t;
+
+/* Cache table, replaced as a whole when it grows so readers never see it resize */
+typedef struct cache_table {
+	uint32_t mask;                     /* Number of buckets minus one */
+	uint32_t count;                    /* Number of cached directories */
+	cache_node_t *_Atomic buckets[];   /* Bucket chain heads */
+} cache_table_t;
+
+/* Entry read from a large directory, its name lives in a shared arena */
+typedef struct sweep_entry {
+	size_t name;                       /* Offset of the name in the arena */
+	ino_t ino;                         /* Inode number from the directory listing */
+	unsigned char type;                /* Entry type from the directory listing */
+} sweep_entry_t;
+
+/* Listing of a large directory, memory grows with the number of entries */
+typedef struct sweep_list {
+	sweep_entry_t *entries;            /* Entries in listing order */
+	int count;                         /* Number of entries */
+	int capacity;                      /* Allocated capacity of `entries` */
+	char *names;                       /* Arena of NUL-terminated entry names */
+	size_t names_len;                  /* Bytes used in the arena */
+	size_t names_cap;                  /* Allocated size of the arena */
+} sweep_list_t;
+
+/* Share of a large directory diffed by one worker thread */
+typedef struct sweep_part {
+	const char *path;                  /* Directory being diffed */
+	const cached_dir_t *dir;           /* Cache entry, read-only while workers run */
+	const sweep_entry_t *entries;      /* Entries read from disk */
+	const char *names;                 /* Name arena of the entries */
+	uint64_t *identities;              /* Per entry file identity, zero for subdirectories */
+	int start;                         /* First entry of this share */
+	int end;                           /* One past the last entry of this share */
+	khint_t bucket_start;              /* First subdirectory bucket checked for removals */
+	khint_t bucket_end;                /* One past the last bucket of this share */
+	uint8_t *seen;                     /* Per bucket flag for cached subdirectories found on disk */
+	char **added;                      /* New subdirectory paths, owned until merged */
+	int added_count;                   /* Number of new subdirectories */
+	int added_capacity;                /* Allocated capacity of `added` */
+	const char **removed;              /* Cached subdirectories missing on disk */
+	int removed_count;                 /* Number of missing subdirectories */
+	int removed_capacity;              /* Allocated capacity of `removed` */
+	int media_files;                   /* Media files in this share */
+	int other_files;                   /* Other files in this share */
+	int skipped_symlinks;              /* Symlinks not followed */
+	int skipped_unknown;               /* Entries without a type */
+	bool failed;                       /* Whether an allocation failed */
+} sweep_part_t;
+
 /* Structure to track directory changes for efficient monitoring */
 typedef struct dir_changes {
 	const char **added;                /* Array of added subdirectory paths */
@@ -23,6 +94,11 @@ typedef struct dir_changes {
 	const char **removed;              /* Array of removed subdirectory paths */
 	int removed_count;                 /* Number of removed subdirectories */
 	int removed_capacity;              /* Internal: allocated capacity of `removed` */
+	const char **files;                /* Names of files added or replaced since the last sync */
+	int files_count;                   /* Number of added or replaced files */
+	int files_capacity;                /* Internal: allocated capacity of `files` */
+	int media_delta;                   /* Change in the number of media files */
+	int other_delta;                   /* Change in the number of other files */
 } dir_changes_t;
 
 /* Directory cache lifecycle management */
@@ -31,8 +107,23 @@ void dircache_cleanup(void);
 
 /* Directory cache operations */
 bool dircache_refresh(const char *path, bool *changed, dir_changes_t *changes);
+bool dircache_stale(const char *path);
 const char **dircache_subdirs(const char *path, int *count);
 void dircache_free(const char **subdirs);
 void changes_free(dir_changes_t *changes);
+bool dircache_size(const char *path, int *dirs, int *files);
+long dircache_reads(void);
+
+/* Saved state */
+bool dircache_restore(const char *path, time_t mtime, int media_files, int other_files,
+					  char **subdirs, int count);
+bool dircache_cached(const char *path);
+void dircache_each(void (*fn)(const cached_dir_t *dir, void *arg), void *arg);
+
+/* Concurrent read access from other threads, lookups are only valid until dircache_exit() */
+bool dircache_enter(void);
+void dircache_exit(void);
+void dircache_detach(void);
+bool dircache_current(const char *path, time_t mtime);
 
 #endif /* DIRCACHE_H */
@@ -0,0 +1,121 @@
+#include "epoch.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "logger.h"
+
+/* Static variables for epoch implementation */
+static atomic_uint_fast64_t global_epoch = 1;					/* Advanced by every reclaim */
+static atomic_uint_fast64_t active[EPOCH_MAX_READERS];			/* Epoch each reader entered in, 0 if outside */
+static atomic_bool claimed[EPOCH_MAX_READERS];					/* Reader slots in use */
+static _Thread_local int slot = -1;								/* Reader slot of this thread */
+static retired_t *limbo = NULL;									/* Objects waiting to be released */
+static int limbo_count = 0;										/* Number of waiting objects */
+static int limbo_capacity = 0;									/* Allocated limbo entries */
+
+/* Enter a read-side section, returns false when no reader slot is free */
+bool epoch_enter(void) {
+	if (slot < 0) {
+		for (int i = 0; i < EPOCH_MAX_READERS; i++) {
+			bool expected = false;
+			if (atomic_compare_exchange_strong(&claimed[i], &expected, true)) {
+				slot = i;
+				break;
+			}
+		}
+		if (slot < 0) {
+			return false;
+		}
+	}
+
+	/* Sequentially consistent, so the writer either sees us or we see its unlinks */
+	atomic_store(&active[slot], atomic_load(&global_epoch));
+	return true;
+}
+
+/* Leave a read-side section, pointers read inside it must not be used afterwards */
+void epoch_exit(void) {
+	if (slot >= 0) {
+		atomic_store_explicit(&active[slot], 0, memory_order_release);
+	}
+}
+
+/* Give up the reader slot of this thread, called before the thread exits */
+void epoch_release(void) {
+	if (slot >= 0) {
+		atomic_store(&active[slot], 0);
+		atomic_store(&claimed[slot], false);
+		slot = -1;
+	}
+}
+
+/* Release an object once no reader can still hold it, it must already be unlinked */
+void epoch_retire(void *ptr, void (*release)(void *)) {
+	if (!ptr) {
+		return;
+	}
+
+	if (limbo_count >= limbo_capacity) {
+		int new_capacity = limbo_capacity > 0 ? limbo_capacity * 2 : 64;
+		retired_t *new_limbo = realloc(limbo, new_capacity * sizeof(retired_t));
+		if (!new_limbo) {
+			/* Leaking is the only safe option while a reader may hold it */
+			log_message(LOG_ERR, "Failed to allocate memory for retired objects");
+			return;
+		}
+		limbo = new_limbo;
+		limbo_capacity = new_capacity;
+	}
+
+	limbo[limbo_count].ptr = ptr;
+	limbo[limbo_count].release = release;
+	limbo[limbo_count].epoch = atomic_load(&global_epoch);
+	limbo_count++;
+}
+
+/* Advance the epoch and release every object no active reader can still see */
+void epoch_reclaim(void) {
+	if (limbo_count == 0) {
+		return;
+	}
+
+	atomic_fetch_add(&global_epoch, 1);
+
+	/* Readers that entered before an object was retired might still hold it */
+	uint64_t oldest = UINT64_MAX;
+	for (int i = 0; i < EPOCH_MAX_READERS; i++) {
+		uint64_t entered = atomic_load(&active[i]);
+		if (entered != 0 && entered < oldest) {
+			oldest = entered;
+		}
+	}
+
+	int kept = 0;
+	for (int i = 0; i < limbo_count; i++) {
+		if (limbo[i].epoch < oldest) {
+			limbo[i].release(limbo[i].ptr);
+		} else {
+			limbo[kept++] = limbo[i];
+		}
+	}
+	limbo_count = kept;
+
+	/* Give the memory back after a large burst of retirements */
+	if (limbo_count == 0 && limbo_capacity > 1024) {
+		free(limbo);
+		limbo = NULL;
+		limbo_capacity = 0;
+	}
+}
+
+/* Release everything still retired, no reader may be active */
+void epoch_cleanup(void) {
+	for (int i = 0; i < limbo_count; i++) {
+		limbo[i].release(limbo[i].ptr);
+	}
+	free(limbo);
+	limbo = NULL;
+	limbo_count = 0;
+	limbo_capacity = 0;
+}
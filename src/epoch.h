@@ -0,0 +1,27 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Epoch configuration */
+#define EPOCH_MAX_READERS 64           /* Reader threads registered at the same time */
+
+/* Object waiting for every reader that might still see it to move on */
+typedef struct retired {
+	void *ptr;                         /* Object to release */
+	void (*release)(void *);           /* Function releasing it */
+	uint64_t epoch;                    /* Epoch the object was unlinked in */
+} retired_t;
+
+/* Reader side, any thread */
+bool epoch_enter(void);
+void epoch_exit(void);
+void epoch_release(void);
+
+/* Writer side, the thread owning the data */
+void epoch_retire(void *ptr, void (*release)(void *));
+void epoch_reclaim(void);
+void epoch_cleanup(void);
+
+#endif /* EPOCH_H */
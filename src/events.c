@@ -7,27 +7,63 @@
 #include <time.h>
 
 #include "config.h"
+#include "dircache.h"
+#include "hotspots.h"
 #include "logger.h"
+#include "mounts.h"
 #include "plexapi.h"
+#include "probes.h"
+#include "shard.h"
+#include "utilities.h"
 
-static pending_t *pending = NULL;     /* Array of pending scans */
+static pending_t **pending = NULL;    /* Array of pending scans */
 static int num_pending = 0;           /* Current number of pending scans */
 static int pending_capacity = 0;      /* Allocated capacity of pending array */
+static size_t pending_bytes = 0;      /* Memory held by the array and its entries */
+static window_t *windows = NULL;      /* Sections with a scan window that held scans */
+static int num_windows = 0;           /* Number of tracked windows */
+static int windows_capacity = 0;      /* Allocated capacity of windows array */
+static void (*observer)(const char *path, int server, int section_id, scan_class_t scan_class,
+						 void *arg) = NULL;
+static void *observer_arg = NULL;     /* Argument passed to the observer */
+static echo_t *echoes = NULL;         /* Scans sent within the echo window */
+static int num_echoes = 0;            /* Number of recent scans */
+static int echoes_capacity = 0;       /* Allocated capacity of echoes array */
+
+/* Names of the scan classes for log messages */
+static const char *class_names[SCAN_CLASSES] = { "new", "delete", "metadata", "verify" };
+
+/* Memory accounted for one pending entry */
+static size_t pending_size(size_t path_len) {
+	return sizeof(pending_t) + path_len + 1;
+}
+
+/* Resize the array of pending scans, keeping the memory accounting in step */
+static bool pending_resize(int new_capacity) {
+	pending_t **new_pending = realloc(pending, new_capacity * sizeof(pending_t *));
+	if (!new_pending) {
+		return false;
+	}
+
+	pending_bytes -= pending_capacity * sizeof(pending_t *);
+	pending_bytes += new_capacity * sizeof(pending_t *);
+	pending = new_pending;
+	pending_capacity = new_capacity;
+	return true;
+}
 
 /* Initialize event processor */
 bool events_init(void) {
 	log_message(LOG_INFO, "Initializing event processor");
 
 	/* Allocate initial pending scans array */
-	pending_capacity = 128;
-	pending = malloc(pending_capacity * sizeof(pending_t));
-	if (!pending) {
+	pending_bytes = 0;
+	if (!pending_resize(PENDING_INITIAL_CAPACITY)) {
 		log_message(LOG_ERR, "Failed to allocate memory for pending scans");
 		return false;
 	}
 
 	/* Reset pending scans */
-	memset(pending, 0, pending_capacity * sizeof(pending_t));
 	num_pending = 0;
 
 	return true;
@@ -36,16 +72,31 @@ bool events_init(void) {
 /* Clean up event processor */
 void events_cleanup(void) {
 	log_message(LOG_INFO, "Cleaning up event processor");
+	for (int i = 0; i < num_pending; i++) {
+		free(pending[i]);
+	}
 	free(pending);
 	pending = NULL;
 	num_pending = 0;
 	pending_capacity = 0;
+	pending_bytes = 0;
+	free(windows);
+	windows = NULL;
+	num_windows = 0;
+	windows_capacity = 0;
+	for (int i = 0; i < num_echoes; i++) {
+		free(echoes[i].path);
+	}
+	free(echoes);
+	echoes = NULL;
+	num_echoes = 0;
+	echoes_capacity = 0;
 }
 
 /* Find a pending scan by path */
 static int pending_find(const char *path) {
 	for (int i = 0; i < num_pending; i++) {
-		if (pending[i].is_pending && strcmp(pending[i].path, path) == 0) {
+		if (pending[i]->is_pending && strcmp(pending[i]->path, path) == 0) {
 			return i;
 		}
 	}
@@ -54,78 +105,161 @@ static int pending_find(const char *path) {
 
 /* Find a pending scan for a parent directory */
 static int pending_parent(const char *path) {
-	size_t path_len = strlen(path);
-
 	for (int i = 0; i < num_pending; i++) {
-		if (!pending[i].is_pending) {
-			continue;
+		if (pending[i]->is_pending && path_contains(pending[i]->path, path)) {
+			return i;
 		}
+	}
+	return -1;
+}
 
-		size_t parent_len = strlen(pending[i].path);
+/* Remove completed scans from the array */
+static void pending_cleanup(void) {
+	int i, j;
 
-		/* Check if this is a parent directory of our path */
-		if (parent_len < path_len &&
-			strncmp(pending[i].path, path, parent_len) == 0 &&
-			(path[parent_len] == '/' || path[parent_len] == '\0')) {
-			return i;
+	/* Compact the array by removing completed scans */
+	for (i = 0, j = 0; i < num_pending; i++) {
+		if (pending[i]->is_pending) {
+			pending[j++] = pending[i];
+		} else {
+			pending_bytes -= pending_size(strlen(pending[i]->path));
+			free(pending[i]);
 		}
 	}
-	return -1;
+
+	/* Update count */
+	num_pending = j;
+
+	/* Give memory back after a burst has drained */
+	if (pending_capacity > PENDING_INITIAL_CAPACITY && num_pending < pending_capacity / 4) {
+		pending_resize(pending_capacity / 2);
+	}
 }
 
-/* Find pending scans for child directories of the given path */
-static void pending_child(const char *path, int *child_indices, int *num_children, int max_children) {
-	size_t path_len = strlen(path);
-	*num_children = 0;
+/* Push back a pending scan to coalesce with a new event, within the profile bounds */
+static void pending_extend(pending_t *scan, time_t now) {
+	const profile_t *profile = config_profile(scan->server, scan->section_id);
+	time_t deadline = scan->first_event_time + profile->max_scan_delay;
 
-	for (int i = 0; i < num_pending && *num_children < max_children; i++) {
-		if (!pending[i].is_pending) {
-			continue;
+	/* Back off further while events keep coming in */
+	scan->debounce *= 2;
+	if (scan->debounce > profile->debounce_max) scan->debounce = profile->debounce_max;
+
+	scan->scheduled_time = now + scan->debounce;
+	if (scan->scheduled_time > deadline) scan->scheduled_time = deadline;
+	if (scan->scheduled_time > scan->deadline) scan->scheduled_time = scan->deadline;
+}
+
+/* Tighten a pending scan's deadline when a more urgent change joins it */
+static void pending_escalate(pending_t *scan, scan_class_t scan_class, time_t deadline) {
+	if (deadline < scan->deadline) {
+		scan->deadline = deadline;
+		scan->scan_class = scan_class;
+	}
+	if (scan->scheduled_time > scan->deadline) {
+		scan->scheduled_time = scan->deadline;
+	}
+}
+
+/* Fold pending scans of child directories into a parent scan */
+static int pending_absorb(pending_t *parent) {
+	int absorbed = 0;
+
+	for (int i = 0; i < num_pending; i++) {
+		pending_t *child = pending[i];
+		if (child != parent && child->is_pending && path_contains(parent->path, child->path)) {
+			pending_escalate(parent, child->scan_class, child->deadline);
+			if (child->first_event_time < parent->first_event_time) {
+				parent->first_event_time = child->first_event_time;
+			}
+			child->is_pending = false;
+			log_message(LOG_DEBUG, "Removed child scan %s in favor of parent %s",
+						child->path, parent->path);
+			absorbed++;
 		}
+	}
 
-		size_t child_len = strlen(pending[i].path);
+	return absorbed;
+}
 
-		/* Check if this is a child directory of our path */
-		if (path_len < child_len &&
-			strncmp(path, pending[i].path, path_len) == 0 &&
-			(pending[i].path[path_len] == '/' || pending[i].path[path_len] == '\0')) {
-			child_indices[*num_children] = i;
-			(*num_children)++;
+/* Find the library root of a path, the longest configured root at or above it of any section */
+static const char *pending_library(const char *path) {
+	int num_roots = 0;
+	const mount_root_t *roots = mounts_roots(&num_roots);
+	const char *library = NULL;
+	size_t library_len = 0;
+
+	for (int i = 0; i < num_roots; i++) {
+		size_t len = strlen(roots[i].path);
+		if (len > library_len && (strcmp(roots[i].path, path) == 0 || path_contains(roots[i].path, path))) {
+			library = roots[i].path;
+			library_len = len;
 		}
 	}
+	return library;
 }
 
-/* Remove completed scans from the array */
-static void pending_cleanup(void) {
-	int i, j;
+/* Check if a path is the last stop for escalation, its library root or a path outside any library */
+static bool pending_root(const char *path) {
+	const char *library = pending_library(path);
+	return !library || strcmp(library, path) == 0;
+}
 
-	/* Compact the array by removing completed scans */
-	for (i = 0, j = 0; i < num_pending; i++) {
-		if (pending[i].is_pending) {
-			if (i != j) {
-				pending[j] = pending[i];
-			}
-			j++;
+/* Check if any pending scan lies at or below a path */
+static bool pending_covers(const char *path) {
+	for (int i = 0; i < num_pending; i++) {
+		if (pending[i]->is_pending &&
+			(strcmp(pending[i]->path, path) == 0 || path_contains(path, pending[i]->path))) {
+			return true;
 		}
 	}
+	return false;
+}
+
+/* Find the nearest ancestor that would absorb pending scans, stopping at the library root */
+static char *pending_ancestor(const char *path) {
+	if (pending_root(path)) {
+		return NULL;
+	}
 
-	/* Update count */
-	num_pending = j;
+	char *ancestor = strdup(path);
+	if (!ancestor) {
+		return NULL;
+	}
+
+	do {
+		*strrchr(ancestor, '/') = '\0';
+	} while (!pending_covers(ancestor) && !pending_root(ancestor));
+
+	return ancestor;
 }
 
-/* Handle a file system event */
-void events_handle(const char *path, int section_id) {
+/* Check if a new entry would take the pending scans over their memory cap */
+static bool pending_full(size_t path_len) {
+	size_t need = pending_size(path_len);
+	if (num_pending >= pending_capacity) {
+		need += pending_capacity * sizeof(pending_t *); /* The array would double */
+	}
+	return pending_bytes + need > (size_t) g_config.pending_memory * 1024;
+}
+
+/* Schedule a scan, `escalated` is set once the path was raised to stay within the memory cap */
+static void pending_insert(const char *path, int server, int section_id, scan_class_t scan_class,
+						   bool escalated) {
 	int idx, parent_idx;
 	time_t now = time(NULL);
-	const int debounce_delay = g_config.scan_interval;
+	time_t deadline = now + g_config.latency[scan_class];
+	const profile_t *profile = config_profile(server, section_id);
 
 	/* First, check if there's already a pending scan for a parent directory */
 	parent_idx = pending_parent(path);
 	if (parent_idx >= 0) {
 		/* Parent directory scan will cover this one, extend its delay */
-		pending[parent_idx].scheduled_time = now + debounce_delay;
+		pending_escalate(pending[parent_idx], scan_class, deadline);
+		pending_extend(pending[parent_idx], now);
+		PROBE3(scan__coalesce, pending[parent_idx]->path, section_id, scan_class);
 		log_message(LOG_DEBUG, "Event for %s covered by parent scan of %s",
-					path, pending[parent_idx].path);
+					path, pending[parent_idx]->path);
 		return;
 	}
 
@@ -134,104 +268,610 @@ void events_handle(const char *path, int section_id) {
 
 	if (idx >= 0) {
 		/* Already scheduled, extend the delay to coalesce with new event */
-		pending[idx].scheduled_time = now + debounce_delay;
+		pending_escalate(pending[idx], scan_class, deadline);
+		pending_extend(pending[idx], now);
+		PROBE3(scan__coalesce, path, section_id, scan_class);
 		log_message(LOG_DEBUG, "Rescheduled scan for %s to coalesce with new event", path);
 		return;
 	}
 
-	/* Check if this path is a parent of any pending scans */
-	int child_indices[256];
-	int num_children = 0;
-	const int max_children = sizeof(child_indices) / sizeof(child_indices[0]);
-
-	pending_child(path, child_indices, &num_children, max_children);
+	/* Over the memory cap, scan the nearest ancestor that already has pending scans below it
+	 * instead. It absorbs them, so the set shrinks rather than grows. The cap is soft: the
+	 * ancestor itself and library roots, which have nothing above them, are still allocated */
+	size_t path_len = strlen(path);
+	if (!escalated && pending_full(path_len)) {
+		char *ancestor = pending_ancestor(path);
+		if (ancestor) {
+			log_message(LOG_INFO, "Pending scans at memory cap, escalating %s to %s", path, ancestor);
+			pending_insert(ancestor, server, section_id, scan_class, true);
+			free(ancestor);
+			return;
+		}
+	}
 
-	/* Ensure capacity for the new scan (both cases add exactly 1 scan) */
+	/* Ensure capacity for the new scan */
 	if (num_pending >= pending_capacity) {
-		int new_capacity = pending_capacity > 0 ? pending_capacity * 2 : 128;
-		pending_t *new_pending = realloc(pending, new_capacity * sizeof(pending_t));
-		if (!new_pending) {
+		if (!pending_resize(pending_capacity * 2)) {
 			log_message(LOG_ERR, "Failed to reallocate pending scans, cannot schedule scan for %s", path);
 			return;
 		}
-		pending = new_pending;
-		pending_capacity = new_capacity;
-		log_message(LOG_DEBUG, "Expanded pending scans capacity to %d", new_capacity);
+		log_message(LOG_DEBUG, "Expanded pending scans capacity to %d", pending_capacity);
 	}
 
-	/* Set up the new scan with common properties */
-	idx = num_pending++;
-	strncpy(pending[idx].path, path, PATH_MAX_LEN - 1);
-	pending[idx].path[PATH_MAX_LEN - 1] = '\0';
-	pending[idx].section_id = section_id;
-	pending[idx].first_event_time = now;
-	pending[idx].scheduled_time = now + debounce_delay;
-	pending[idx].is_pending = true;
+	/* Set up the new scan with the path stored inline at its exact length */
+	pending_t *scan = malloc(pending_size(path_len));
+	if (!scan) {
+		log_message(LOG_ERR, "Failed to allocate memory for pending scan of %s", path);
+		return;
+	}
+	memcpy(scan->path, path, path_len + 1);
+	scan->server = server;
+	scan->section_id = section_id;
+	scan->first_event_time = now;
+	scan->debounce = profile->debounce_min;
+	scan->scheduled_time = now + profile->debounce_min;
+	scan->scan_class = scan_class;
+	scan->deadline = deadline;
+	scan->is_pending = true;
+	if (scan->scheduled_time > deadline) scan->scheduled_time = deadline;
+
+	pending[num_pending++] = scan;
+	pending_bytes += pending_size(path_len);
+	PROBE3(scan__schedule, path, section_id, scan_class);
 
+	/* Check if this path is a parent of any pending scans */
+	int num_children = pending_absorb(scan);
 	if (num_children > 0) {
-		/* This is a parent directory consolidating child scans */
-		log_message(LOG_DEBUG, "Path %s is parent of %d pending scans, consolidating", path, num_children);
-
-		/* Mark child scans as not pending */
-		for (int i = 0; i < num_children; i++) {
-			pending[child_indices[i]].is_pending = false;
-			log_message(LOG_DEBUG, "Removed child scan %s in favor of parent %s",
-						pending[child_indices[i]].path, path);
-		}
-
 		log_message(LOG_DEBUG, "Scheduled new parent scan for %s (replaced %d child scans)",
 					path, num_children);
+		pending_cleanup();
 	} else {
 		/* New independent scan with no related existing scans */
-		log_message(LOG_DEBUG, "Scheduled new scan for %s", path);
+		log_message(LOG_DEBUG, "Scheduled new %s scan for %s", class_names[scan_class], path);
+	}
+}
+
+/* Handle a file system event */
+void events_handle(const char *path, int server, int section_id, scan_class_t scan_class) {
+	if (observer) {
+		observer(path, server, section_id, scan_class, observer_arg);
+	}
+	pending_insert(path, server, section_id, scan_class, false);
+}
+
+/* Watch every change handed to the event processor */
+void events_observe(void (*fn)(const char *path, int server, int section_id, scan_class_t scan_class,
+							   void *arg),
+					void *arg) {
+	observer = fn;
+	observer_arg = arg;
+}
+
+/* Call a function for every scan still pending */
+void events_each(void (*fn)(const pending_t *scan, void *arg), void *arg) {
+	for (int i = 0; i < num_pending; i++) {
+		if (pending[i]->is_pending) {
+			fn(pending[i], arg);
+		}
+	}
+}
+
+/* Find the release state of a section, created on first use */
+static window_t *window_get(int server, int section_id, time_t now) {
+	for (int i = 0; i < num_windows; i++) {
+		if (windows[i].server == server && windows[i].section_id == section_id) {
+			return &windows[i];
+		}
+	}
+
+	if (num_windows >= windows_capacity) {
+		int new_capacity = windows_capacity > 0 ? windows_capacity * 2 : WINDOW_INITIAL_CAPACITY;
+		window_t *new_windows = realloc(windows, new_capacity * sizeof(window_t));
+		if (!new_windows) {
+			log_message(LOG_ERR, "Failed to allocate memory for scan windows");
+			return NULL;
+		}
+		windows = new_windows;
+		windows_capacity = new_capacity;
 	}
+
+	const profile_t *profile = config_profile(server, section_id);
+	window_t *window = &windows[num_windows++];
+	window->server = server;
+	window->section_id = section_id;
+	window->open = config_window(profile, now) == now;
+	window->tokens = profile->window_rate;
+	window->refilled = now;
+	return window;
+}
+
+/* Check if a due scan may be sent now, otherwise push it back to when it may */
+static bool pending_release(pending_t *scan, time_t now) {
+	const profile_t *profile = config_profile(scan->server, scan->section_id);
+
+	/* Sections without a window and urgent changes are never held */
+	if (profile->window_open == profile->window_close || (int) scan->scan_class < profile->window_urgent) {
+		return true;
+	}
+
+	window_t *window = window_get(scan->server, scan->section_id, now);
+	time_t opens = config_window(profile, now);
+	if (opens > now) {
+		scan->scheduled_time = opens;
+		return false;
+	}
+	if (!window || profile->window_rate == 0) {
+		return true;
+	}
+
+	/* Token bucket holding at most a minute's worth of scans */
+	double per_second = profile->window_rate / 60.0;
+	window->tokens += (now - window->refilled) * per_second;
+	if (window->tokens > profile->window_rate) window->tokens = profile->window_rate;
+	window->refilled = now;
+
+	if (window->tokens < 1.0) {
+		scan->scheduled_time = now + (time_t) ((1.0 - window->tokens) / per_second) + 1;
+		return false;
+	}
+	window->tokens -= 1.0;
+	return true;
+}
+
+/* Count the pending scans of a section */
+static int pending_count(int server, int section_id) {
+	int count = 0;
+	for (int i = 0; i < num_pending; i++) {
+		if (pending[i]->is_pending && pending[i]->server == server &&
+			pending[i]->section_id == section_id) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/* Number of slashes in a path, its depth below the filesystem root */
+static int pending_depth(const char *path) {
+	int depth = 0;
+	for (const char *c = path; *c; c++) {
+		if (*c == '/') depth++;
+	}
+	return depth;
+}
+
+/* Compare the parent directories of two paths */
+static int pending_siblings(const char *a, const char *b) {
+	size_t len_a = strrchr(a, '/') - a;
+	size_t len_b = strrchr(b, '/') - b;
+	int cmp = strncmp(a, b, len_a < len_b ? len_a : len_b);
+	return cmp != 0 ? cmp : (len_a > len_b) - (len_a < len_b);
+}
+
+/* Order fold candidates deepest first, siblings next to each other */
+static int fold_compare(const void *a, const void *b) {
+	const fold_t *fold_a = a;
+	const fold_t *fold_b = b;
+
+	if (fold_a->depth != fold_b->depth) {
+		return fold_b->depth - fold_a->depth;
+	}
+	return pending_siblings(pending[fold_a->index]->path, pending[fold_b->index]->path);
+}
+
+/* Replace sibling scans by one scan of their parent, which takes over the first one's slot */
+static bool pending_fold(const fold_t *group, int size) {
+	pending_t *first = pending[group[0].index];
+	size_t len = strrchr(first->path, '/') - first->path;
+
+	pending_t *parent = malloc(pending_size(len));
+	if (!parent) {
+		log_message(LOG_ERR, "Failed to allocate memory for parent scan of %s", first->path);
+		return false;
+	}
+	memcpy(parent, first, sizeof(pending_t));
+	memcpy(parent->path, first->path, len);
+	parent->path[len] = '\0';
+
+	for (int i = 1; i < size; i++) {
+		pending_t *child = pending[group[i].index];
+		pending_escalate(parent, child->scan_class, child->deadline);
+		if (child->first_event_time < parent->first_event_time) {
+			parent->first_event_time = child->first_event_time;
+		}
+		if (child->scheduled_time < parent->scheduled_time) {
+			parent->scheduled_time = child->scheduled_time;
+		}
+		child->is_pending = false;
+	}
+
+	pending_bytes += pending_size(len);
+	pending_bytes -= pending_size(strlen(first->path));
+	pending[group[0].index] = parent;
+	free(first);
+	return true;
+}
+
+/* Fold a section's backlog into parent directories, deepest first, until at most `limit`
+ * scans remain. Candidates are collected once and folded a level at a time */
+static void pending_compact(int server, int section_id, int limit) {
+	int count = 0;
+	int num_folds = 0;
+
+	fold_t *folds = malloc(num_pending * sizeof(fold_t));
+	if (!folds) {
+		log_message(LOG_ERR, "Failed to allocate memory for scan compaction");
+		return;
+	}
+
+	/* Library roots count against the limit but have nothing to fold into */
+	for (int i = 0; i < num_pending; i++) {
+		if (!pending[i]->is_pending || pending[i]->server != server ||
+			pending[i]->section_id != section_id) {
+			continue;
+		}
+		count++;
+		if (!pending_root(pending[i]->path)) {
+			folds[num_folds].index = i;
+			folds[num_folds].depth = pending_depth(pending[i]->path);
+			num_folds++;
+		}
+	}
+
+	while (count > limit && num_folds > 0) {
+		qsort(folds, num_folds, sizeof(fold_t), fold_compare);
+		int depth = folds[0].depth;
+
+		/* Fold each group of siblings at the deepest level, the parent stays a candidate */
+		for (int i = 0; i < num_folds && folds[i].depth == depth && count > limit;) {
+			int end = i + 1;
+			while (end < num_folds && folds[end].depth == depth &&
+				   pending_siblings(pending[folds[i].index]->path, pending[folds[end].index]->path) == 0) {
+				end++;
+			}
+
+			if (!pending_fold(&folds[i], end - i)) {
+				count = limit; /* Leave the rest as it is */
+				break;
+			}
+			count -= end - i - 1;
+
+			const pending_t *parent = pending[folds[i].index];
+			folds[i].depth = depth - 1;
+			if (pending_root(parent->path)) {
+				folds[i].index = -1;
+			}
+			for (int j = i + 1; j < end; j++) {
+				folds[j].index = -1;
+			}
+			i = end;
+		}
+
+		/* Drop folded and finished candidates */
+		int kept = 0;
+		for (int i = 0; i < num_folds; i++) {
+			if (folds[i].index >= 0) {
+				folds[kept++] = folds[i];
+			}
+		}
+		num_folds = kept;
+	}
+
+	free(folds);
+	pending_cleanup();
+}
+
+/* Merge the backlog of sections whose scan window just opened */
+static void pending_windows(time_t now) {
+	for (int i = 0; i < num_windows; i++) {
+		int server = windows[i].server;
+		int section_id = windows[i].section_id;
+		const profile_t *profile = config_profile(server, section_id);
+		bool open = config_window(profile, now) == now;
+
+		if (open && !windows[i].open) {
+			int held = pending_count(server, section_id);
+			if (profile->window_rate > 0 && held > profile->window_rate) {
+				pending_compact(server, section_id, profile->window_rate);
+			}
+			log_message(LOG_INFO, "Scan window of section %d opened, releasing %d held scans as %d",
+						section_id, held, pending_count(server, section_id));
+		}
+		windows[i].open = open;
+	}
+}
+
+/* Estimated work for Plex to scan a path, the request itself plus the directories and files it walks */
+static long pending_cost(const char *path) {
+	int dirs, files;
+
+	/* Deleted or not yet crawled directories are cheap to scan */
+	if (!dircache_size(path, &dirs, &files)) {
+		dirs = 1;
+		files = 0;
+	}
+	return PLAN_REQUEST_COST + dirs + files;
+}
+
+/* Replace due scans by a common ancestor wherever one scan of the ancestor costs less */
+static void pending_plan(time_t now) {
+	int due[PLAN_MAX_SCANS];
+	long cost[PLAN_MAX_SCANS];
+	char ancestor[PATH_MAX_LEN];
+	char best[PATH_MAX_LEN];
+
+	while (true) {
+		int num_due = 0;
+		for (int i = 0; i < num_pending; i++) {
+			if (pending[i]->is_pending && now >= pending[i]->scheduled_time) {
+				if (num_due == PLAN_MAX_SCANS) {
+					return; /* Too many to plan, the memory cap keeps these coarse instead */
+				}
+				cost[num_due] = pending_cost(pending[i]->path);
+				due[num_due++] = i;
+			}
+		}
+		if (num_due < 2) {
+			return;
+		}
+
+		/* Greedy: take the ancestor with the largest saving, then look again */
+		long best_saving = 0;
+		long best_separate = 0;
+		int best_server = 0;
+		int best_section = 0;
+		int best_covered = 0;
+		scan_class_t best_class = SCAN_VERIFY;
+
+		for (int i = 0; i < num_due; i++) {
+			const pending_t *scan = pending[due[i]];
+			snprintf(ancestor, sizeof(ancestor), "%s", scan->path);
+
+			while (!pending_root(ancestor)) {
+				*strrchr(ancestor, '/') = '\0';
+
+				long separate = 0;
+				int covered = 0;
+				scan_class_t scan_class = SCAN_VERIFY;
+				for (int j = 0; j < num_due; j++) {
+					const pending_t *other = pending[due[j]];
+					if (other->server == scan->server && other->section_id == scan->section_id &&
+						path_contains(ancestor, other->path)) {
+						separate += cost[j];
+						covered++;
+						if (other->scan_class < scan_class) scan_class = other->scan_class;
+					}
+				}
+
+				long saving = covered >= 2 ? separate - pending_cost(ancestor) : 0;
+				if (saving > best_saving) {
+					best_saving = saving;
+					best_separate = separate;
+					best_server = scan->server;
+					best_section = scan->section_id;
+					best_covered = covered;
+					best_class = scan_class;
+					snprintf(best, sizeof(best), "%s", ancestor);
+				}
+			}
+		}
+
+		if (best_saving <= 0) {
+			return;
+		}
+
+		log_message(LOG_DEBUG, "Scanning %s instead of %d directories below it (cost %ld instead of %ld)",
+					best, best_covered, best_separate - best_saving, best_separate);
+		pending_insert(best, best_server, best_section, best_class, true);
+
+		/* The ancestor is due with the scans it replaced. Without it, allocation failed
+		 * and nothing changed, so looking again would pick the same ancestor forever */
+		int idx = pending_find(best);
+		if (idx < 0) {
+			return;
+		}
+		pending[idx]->scheduled_time = now;
+	}
+}
+
+/* Forget scans sent longer ago than the echo window */
+static void echo_expire(time_t now) {
+	int kept = 0;
+	for (int i = 0; i < num_echoes; i++) {
+		if (now - echoes[i].sent < g_config.echo_window) {
+			echoes[kept++] = echoes[i];
+		} else {
+			free(echoes[i].path);
+		}
+	}
+	num_echoes = kept;
+}
+
+/* Remember a sent scan, so Plex writing back into the path is not mistaken for a change */
+static void echo_record(const char *path, time_t now) {
+	echo_expire(now);
+
+	for (int i = 0; i < num_echoes; i++) {
+		if (strcmp(echoes[i].path, path) == 0) {
+			echoes[i].sent = now;
+			return;
+		}
+	}
+
+	if (num_echoes >= echoes_capacity) {
+		int new_capacity = echoes_capacity > 0 ? echoes_capacity * 2 : ECHO_INITIAL_CAPACITY;
+		echo_t *new_echoes = realloc(echoes, new_capacity * sizeof(echo_t));
+		if (!new_echoes) {
+			log_message(LOG_WARNING, "Failed to allocate memory for sent scans");
+			return;
+		}
+		echoes = new_echoes;
+		echoes_capacity = new_capacity;
+	}
+
+	char *copy = strdup(path);
+	if (!copy) {
+		log_message(LOG_WARNING, "Failed to allocate memory for sent scan path");
+		return;
+	}
+	echoes[num_echoes].path = copy;
+	echoes[num_echoes].sent = now;
+	num_echoes++;
+}
+
+/* Order due scans by deadline, then by profile priority, then by age */
+static int pending_compare(const void *a, const void *b) {
+	const pending_t *scan_a = pending[*(const int *) a];
+	const pending_t *scan_b = pending[*(const int *) b];
+
+	if (scan_a->deadline != scan_b->deadline) {
+		return (scan_a->deadline > scan_b->deadline) - (scan_a->deadline < scan_b->deadline);
+	}
+
+	int priority_a = config_profile(scan_a->server, scan_a->section_id)->priority;
+	int priority_b = config_profile(scan_b->server, scan_b->section_id)->priority;
+	if (priority_a != priority_b) {
+		return priority_b - priority_a;
+	}
+	return (scan_a->first_event_time > scan_b->first_event_time) -
+		   (scan_a->first_event_time < scan_b->first_event_time);
 }
 
 /* Process any pending scans that are due */
 void events_pending(void) {
 	time_t now = time(NULL);
-	bool scans_executed = false;
+	int num_due = 0;
+
+	/* Scans held outside their window are merged before the window releases them */
+	pending_windows(now);
+
+	/* Cover the due scans with the cheapest set of targets */
+	pending_plan(now);
+
+	/* Collect scans that are due */
+	int *due = malloc(num_pending * sizeof(int));
+	if (!due && num_pending > 0) {
+		log_message(LOG_ERR, "Failed to allocate memory for due scans");
+		return;
+	}
 
 	for (int i = 0; i < num_pending; i++) {
-		if (pending[i].is_pending && now >= pending[i].scheduled_time) {
-			/* Time to execute this scan */
-			log_message(LOG_INFO, "Executing scan for %s (scanning delayed for %lds)",
-						pending[i].path, now - pending[i].first_event_time);
+		if (pending[i]->is_pending && now >= pending[i]->scheduled_time) {
+			due[num_due++] = i;
+		}
+	}
+
+	/* Dispatch earliest deadline first */
+	if (num_due > 1) {
+		qsort(due, num_due, sizeof(int), pending_compare);
+	}
+
+	int num_sent = 0;
+	for (int i = 0; i < num_due; i++) {
+		pending_t *scan = pending[due[i]];
+
+		/* Outside its window or over its release rate, keep accumulating */
+		if (!pending_release(scan, now)) {
+			continue;
+		}
 
-			plexapi_scan(pending[i].path, pending[i].section_id);
+		/* Time to execute this scan */
+		log_message(LOG_INFO, "Executing %s scan for %s (scanning delayed for %lds)",
+					class_names[scan->scan_class], scan->path, now - scan->first_event_time);
+		PROBE4(scan__dispatch, scan->path, scan->section_id, scan->scan_class,
+			   (long) (now - scan->first_event_time));
 
-			/* Mark as completed */
-			pending[i].is_pending = false;
-			scans_executed = true;
+		/* Workers hand due scans to the supervisor, which owns the servers */
+		if (!shard_forward(scan->path, scan->deadline)) {
+			plexapi_submit(scan->path, scan->deadline);
 		}
+		hotspots_record(scan->path, HOTSPOT_SCAN);
+
+		/* Mark as completed */
+		scan->is_pending = false;
+		num_sent++;
 	}
 
+	free(due);
+
 	/* Only clean up if we executed scans */
-	if (scans_executed) {
+	if (num_sent > 0) {
+		pending_cleanup();
+	}
+}
+
+/* Drop pending scans at or below a path */
+void events_discard(const char *path) {
+	int discarded = 0;
+
+	for (int i = 0; i < num_pending; i++) {
+		if (pending[i]->is_pending &&
+			(strcmp(pending[i]->path, path) == 0 || path_contains(path, pending[i]->path))) {
+			pending[i]->is_pending = false;
+			discarded++;
+		}
+	}
+
+	if (discarded > 0) {
+		log_message(LOG_DEBUG, "Discarded %d pending scans under %s", discarded, path);
+		pending_cleanup();
+	}
+}
+
+/* Hand every pending scan to the supervisor, for a worker about to exit. Scans it
+ * could not take stay pending, so the state file still has them */
+void events_handoff(void) {
+	int handed = 0;
+
+	for (int i = 0; i < num_pending; i++) {
+		if (!pending[i]->is_pending) {
+			continue;
+		}
+		if (!shard_handoff(pending[i]->path, pending[i]->deadline)) {
+			break;
+		}
+		pending[i]->is_pending = false;
+		handed++;
+	}
+
+	if (handed > 0) {
+		log_message(LOG_INFO, "Handed %d pending scans to the supervisor", handed);
 		pending_cleanup();
 	}
 }
 
+/* Remember that Plex was just asked to scan a path, in the worker watching it when sharded */
+void events_sent(const char *path) {
+	if (g_config.echo_window > 0 && !shard_sent(path)) {
+		echo_record(path, time(NULL));
+	}
+}
+
+/* Get when the latest scan covering a path was sent, 0 if none within the echo window */
+time_t events_echo(const char *path) {
+	time_t now = time(NULL);
+	time_t sent = 0;
+
+	echo_expire(now);
+	for (int i = 0; i < num_echoes; i++) {
+		if ((strcmp(echoes[i].path, path) == 0 || path_contains(echoes[i].path, path)) &&
+			echoes[i].sent > sent) {
+			sent = echoes[i].sent;
+		}
+	}
+	return sent;
+}
+
 /* Get time until next scheduled scan */
 time_t events_schedule(void) {
 	time_t next_time = 0;
 	time_t now = time(NULL);
 
 	for (int i = 0; i < num_pending; i++) {
-		if (pending[i].is_pending && pending[i].scheduled_time > now) {
-			if (next_time == 0 || pending[i].scheduled_time < next_time) {
-				next_time = pending[i].scheduled_time;
+		if (pending[i]->is_pending && pending[i]->scheduled_time > now) {
+			if (next_time == 0 || pending[i]->scheduled_time < next_time) {
+				next_time = pending[i]->scheduled_time;
 			}
 		}
 	}
 	return next_time;
 }
-
-/* Calculate the timeout for the next scan */
-void calculate_timeout(time_t next_scan, struct timespec *timeout) {
-	time_t now = time(NULL);
-	time_t time_left = next_scan > now ? next_scan - now : 0;
-
-	timeout->tv_sec = time_left;
-	timeout->tv_nsec = 0;
-}
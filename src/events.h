@@ -4,28 +4,71 @@
 #include <stdbool.h>
 #include <time.h>
 
+#include "config.h"
+
 /* Event processing configuration */
 #define PATH_MAX_LEN 1024              /* Maximum length for filesystem paths */
+#define PENDING_INITIAL_CAPACITY 128   /* Initial size of the pending scans array */
+#define WINDOW_INITIAL_CAPACITY 8      /* Initial size of the scan window array */
+#define PLAN_REQUEST_COST 100          /* Fixed cost of a scan request, in directory entries walked */
+#define PLAN_MAX_SCANS 64              /* Due scans above which planning is skipped */
+#define ECHO_INITIAL_CAPACITY 16       /* Initial size of the sent scans array */
 
 /* Structure to track pending scan requests */
 typedef struct pending {
-	char path[PATH_MAX_LEN];           /* Path to scan when delay expires */
-	int section_id;                    /* Associated Plex library section ID */
+	int server;                        /* Index of the Plex server reporting the library */
+	int section_id;                    /* Associated Plex library section ID on that server */
 	time_t first_event_time;           /* Timestamp when first event was received */
 	time_t scheduled_time;             /* Timestamp when the scan is scheduled to run */
+	int debounce;                      /* Current quiet period in seconds, grows with new events */
+	scan_class_t scan_class;           /* Most urgent class of change covered by the scan */
+	time_t deadline;                   /* Latency target of that class, dispatch order key */
 	bool is_pending;                   /* Whether this scan is still pending execution */
+	char path[];                       /* Path to scan when delay expires, allocated to fit */
 } pending_t;
 
+/* Release state of a library section with a scan window */
+typedef struct window {
+	int server;                        /* Plex server of the library section */
+	int section_id;                    /* Library section the window belongs to */
+	bool open;                         /* Whether the window was open at the last check */
+	double tokens;                     /* Scans that may be released right away */
+	time_t refilled;                   /* Last time tokens were added */
+} window_t;
+
+/* Pending scan considered for folding into its parent when a scan window opens */
+typedef struct fold {
+	int index;                         /* Slot in the pending array, -1 once folded away */
+	int depth;                         /* Depth of its path */
+} fold_t;
+
+/* Scan sent recently, Plex may still be writing below its path */
+typedef struct echo {
+	char *path;                        /* Path the scan was sent for */
+	time_t sent;                       /* When it was sent */
+} echo_t;
+
 /* Event processing lifecycle */
 bool events_init(void);
 void events_cleanup(void);
 
 /* Event handling operations */
-void events_handle(const char *path, int section_id);
+void events_handle(const char *path, int server, int section_id, scan_class_t scan_class);
 void events_pending(void);
+void events_discard(const char *path);
+void events_handoff(void);
+
+/* Saved state */
+void events_each(void (*fn)(const pending_t *scan, void *arg), void *arg);
 
 /* Event scheduling utilities */
 time_t events_schedule(void);
-void calculate_timeout(time_t next_scan, struct timespec *timeout);
+void events_sent(const char *path);
+time_t events_echo(const char *path);
+
+/* Watch every change handed to the event processor, NULL stops watching */
+void events_observe(void (*fn)(const char *path, int server, int section_id, scan_class_t scan_class,
+							   void *arg),
+					void *arg);
 
 #endif /* EVENTS_H */
@@ -0,0 +1,220 @@
+#include "hotspots.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+
+static uint32_t *sketch[2] = { NULL, NULL };  /* Count-min sketches, one per activity kind */
+static hotspot_t top[HOTSPOT_TOP_K];          /* Heavy-hitter candidates */
+static int top_count = 0;                     /* Number of used heavy-hitter slots */
+static time_t last_decay = 0;                 /* Time of the last decay step */
+
+/* Hash a path with 64-bit FNV-1a */
+static uint64_t hotspots_hash(const char *path) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (const unsigned char *p = (const unsigned char *) path; *p; p++) {
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Get the counter column for a sketch row using double hashing */
+static uint32_t hotspots_column(uint64_t hash, int row) {
+	uint32_t h1 = (uint32_t) hash;
+	uint32_t h2 = (uint32_t) (hash >> 32) | 1;
+	return (h1 + (uint32_t) row * h2) & (HOTSPOT_WIDTH - 1);
+}
+
+/* Add to the sketch and return the new count-min estimate */
+static uint32_t hotspots_add(uint32_t *counters, uint64_t hash) {
+	uint32_t estimate = UINT32_MAX;
+
+	for (int row = 0; row < HOTSPOT_DEPTH; row++) {
+		uint32_t *counter = &counters[row * HOTSPOT_WIDTH + hotspots_column(hash, row)];
+		if (*counter < UINT32_MAX) (*counter)++;
+		if (*counter < estimate) estimate = *counter;
+	}
+
+	return estimate;
+}
+
+/* Query the count-min estimate without updating the sketch */
+static uint32_t hotspots_estimate(const uint32_t *counters, uint64_t hash) {
+	uint32_t estimate = UINT32_MAX;
+
+	for (int row = 0; row < HOTSPOT_DEPTH; row++) {
+		uint32_t counter = counters[row * HOTSPOT_WIDTH + hotspots_column(hash, row)];
+		if (counter < estimate) estimate = counter;
+	}
+
+	return estimate;
+}
+
+/* Combined activity score used for ranking */
+static uint64_t hotspots_score(const hotspot_t *spot) {
+	return (uint64_t) spot->events + spot->scans;
+}
+
+/* Halve all counters once per elapsed decay interval */
+static void hotspots_decay(time_t now) {
+	if (last_decay == 0) {
+		last_decay = now;
+		return;
+	}
+
+	time_t periods = (now - last_decay) / HOTSPOT_DECAY_INTERVAL;
+	if (periods <= 0) {
+		return;
+	}
+	last_decay += periods * HOTSPOT_DECAY_INTERVAL;
+
+	int shift = periods >= 32 ? 32 : (int) periods;
+
+	for (int kind = 0; kind < 2; kind++) {
+		for (int i = 0; i < HOTSPOT_DEPTH * HOTSPOT_WIDTH; i++) {
+			sketch[kind][i] = shift >= 32 ? 0 : sketch[kind][i] >> shift;
+		}
+	}
+
+	/* Decay heavy hitters and drop the ones that faded out */
+	int i, j;
+	for (i = 0, j = 0; i < top_count; i++) {
+		top[i].events = shift >= 32 ? 0 : top[i].events >> shift;
+		top[i].scans = shift >= 32 ? 0 : top[i].scans >> shift;
+		if (hotspots_score(&top[i]) == 0) {
+			free(top[i].path);
+			continue;
+		}
+		if (i != j) {
+			top[j] = top[i];
+		}
+		j++;
+	}
+	top_count = j;
+
+	log_message(LOG_DEBUG, "Decayed hotspot counters by %d period(s)", shift);
+}
+
+/* Initialize the hotspot tracker */
+bool hotspots_init(void) {
+	log_message(LOG_INFO, "Initializing hotspot tracker (%dx%d sketch, top %d)",
+				HOTSPOT_DEPTH, HOTSPOT_WIDTH, HOTSPOT_TOP_K);
+
+	for (int kind = 0; kind < 2; kind++) {
+		sketch[kind] = calloc(HOTSPOT_DEPTH * HOTSPOT_WIDTH, sizeof(uint32_t));
+		if (!sketch[kind]) {
+			log_message(LOG_ERR, "Failed to allocate memory for hotspot sketch");
+			hotspots_cleanup();
+			return false;
+		}
+	}
+
+	top_count = 0;
+	last_decay = time(NULL);
+
+	return true;
+}
+
+/* Clean up the hotspot tracker */
+void hotspots_cleanup(void) {
+	for (int kind = 0; kind < 2; kind++) {
+		free(sketch[kind]);
+		sketch[kind] = NULL;
+	}
+
+	for (int i = 0; i < top_count; i++) {
+		free(top[i].path);
+	}
+	top_count = 0;
+}
+
+/* Record activity for a directory */
+void hotspots_record(const char *path, hotspot_kind_t kind) {
+	if (!sketch[0] || !path) {
+		return;
+	}
+
+	hotspots_decay(time(NULL));
+
+	uint64_t hash = hotspots_hash(path);
+	hotspot_t candidate = { NULL, hash, 0, 0 };
+
+	if (kind == HOTSPOT_EVENT) {
+		candidate.events = hotspots_add(sketch[HOTSPOT_EVENT], hash);
+		candidate.scans = hotspots_estimate(sketch[HOTSPOT_SCAN], hash);
+	} else {
+		candidate.scans = hotspots_add(sketch[HOTSPOT_SCAN], hash);
+		candidate.events = hotspots_estimate(sketch[HOTSPOT_EVENT], hash);
+	}
+
+	/* Update in place if already a heavy hitter, remember the weakest slot otherwise */
+	int weakest = -1;
+	for (int i = 0; i < top_count; i++) {
+		if (top[i].hash == hash && strcmp(top[i].path, path) == 0) {
+			top[i].events = candidate.events;
+			top[i].scans = candidate.scans;
+			return;
+		}
+		if (weakest < 0 || hotspots_score(&top[i]) < hotspots_score(&top[weakest])) {
+			weakest = i;
+		}
+	}
+
+	/* Take a free slot, or evict the weakest entry if the candidate outranks it */
+	int slot;
+	if (top_count < HOTSPOT_TOP_K) {
+		slot = top_count;
+	} else if (hotspots_score(&candidate) > hotspots_score(&top[weakest])) {
+		slot = weakest;
+	} else {
+		return;
+	}
+
+	candidate.path = strdup(path);
+	if (!candidate.path) {
+		log_message(LOG_WARNING, "Failed to allocate memory for hotspot path");
+		return;
+	}
+
+	if (slot == top_count) {
+		top_count++;
+	} else {
+		free(top[slot].path);
+	}
+	top[slot] = candidate;
+}
+
+/* Compare hotspots by descending score */
+static int hotspots_compare(const void *a, const void *b) {
+	uint64_t score_a = hotspots_score(a);
+	uint64_t score_b = hotspots_score(b);
+	return (score_a < score_b) - (score_a > score_b);
+}
+
+/* Log the current heavy hitters */
+void hotspots_report(void) {
+	if (!sketch[0]) {
+		return;
+	}
+
+	hotspots_decay(time(NULL));
+
+	if (top_count == 0) {
+		log_message(LOG_INFO, "No directory activity recorded");
+		return;
+	}
+
+	hotspot_t sorted[HOTSPOT_TOP_K];
+	memcpy(sorted, top, top_count * sizeof(hotspot_t));
+	qsort(sorted, top_count, sizeof(hotspot_t), hotspots_compare);
+
+	log_message(LOG_INFO, "Most active directories (decayed every %ds):", HOTSPOT_DECAY_INTERVAL);
+	for (int i = 0; i < top_count; i++) {
+		log_message(LOG_INFO, "  %2d. %s (events: ~%u, scans: ~%u)",
+					i + 1, sorted[i].path, sorted[i].events, sorted[i].scans);
+	}
+}
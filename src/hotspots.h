@@ -0,0 +1,35 @@
+#ifndef HOTSPOTS_H
+#define HOTSPOTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hotspot tracking configuration */
+#define HOTSPOT_DEPTH 4                /* Number of hash rows in the count-min sketch */
+#define HOTSPOT_WIDTH 4096             /* Counters per row (power of two) */
+#define HOTSPOT_TOP_K 20               /* Number of heavy hitters to keep */
+#define HOTSPOT_DECAY_INTERVAL 300     /* Seconds between halving all counters */
+
+/* Kinds of activity attributed to a directory */
+typedef enum {
+	HOTSPOT_EVENT,                     /* Kernel event received for the directory */
+	HOTSPOT_SCAN                       /* Plex scan dispatched for the directory */
+} hotspot_kind_t;
+
+/* Structure to hold a heavy-hitter directory */
+typedef struct hotspot {
+	char *path;                        /* Directory path (owned) */
+	uint64_t hash;                     /* Cached path hash for cheap comparisons */
+	uint32_t events;                   /* Estimated decayed event count */
+	uint32_t scans;                    /* Estimated decayed scan count */
+} hotspot_t;
+
+/* Hotspot tracker lifecycle */
+bool hotspots_init(void);
+void hotspots_cleanup(void);
+
+/* Hotspot operations */
+void hotspots_record(const char *path, hotspot_kind_t kind);
+void hotspots_report(void);
+
+#endif /* HOTSPOTS_H */
@@ -6,12 +6,18 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "bench.h"
 #include "config.h"
 #include "dircache.h"
 #include "events.h"
+#include "hotspots.h"
 #include "logger.h"
 #include "monitor.h"
+#include "mounts.h"
+#include "persist.h"
 #include "plexapi.h"
+#include "reactor.h"
+#include "shard.h"
 
 #define PLEXMON_VERSION "1.0.0"           /* Version information */
 
@@ -31,20 +37,29 @@ static void print_usage(const char *prog_name) {
 	fprintf(stderr, "  -v         Verbose mode\n");
 	fprintf(stderr, "  -d         Run as daemon\n");
 	fprintf(stderr, "  -t SECONDS Startup timeout in seconds (default: 60)\n");
+	fprintf(stderr, "  -b DIR     Benchmark the monitoring backends in DIR and exit\n");
 	fprintf(stderr, "  -h         Show this help message\n");
 }
 
-/* Signal handler */
-static void signal_handler(int sig) {
+/* Signal handler, runs from the reactor rather than in signal context */
+static void signal_handler(uintptr_t sig, uint32_t count, void *arg) {
+	(void) count;
+	(void) arg;
+
 	switch (sig) {
 		case SIGINT:
 		case SIGTERM:
-			log_message(LOG_INFO, "Received signal %d, shutting down", sig);
-			monitor_exit(); /* Signal exit through kqueue */
+			log_message(LOG_INFO, "Received signal %d, shutting down", (int) sig);
+			monitor_exit(); /* Signal exit through the reactor */
 			break;
 		case SIGHUP:
 			log_message(LOG_INFO, "Received SIGHUP, reloading configuration");
-			monitor_reload(); /* Signal reload through kqueue */
+			monitor_reload(); /* Signal reload through the reactor */
+			shard_signal(SIGHUP);
+			break;
+		case SIGUSR1:
+			monitor_dump(); /* Signal statistics dump through the reactor */
+			shard_signal(SIGUSR1);
 			break;
 	}
 }
@@ -53,19 +68,54 @@ static void signal_handler(int sig) {
 int main(int argc, char *argv[]) {
 	int opt;
 	char *config_path = DEFAULT_CONFIG_FILE;
+	char *bench_dir = NULL;
 
 	/* Set default configuration values */
 	memset(&g_config, 0, sizeof(g_config));
-	strcpy(g_config.plex_url, DEFAULT_PLEX_URL);
+	strcpy(g_config.servers[0].name, "default");
+	strcpy(g_config.servers[0].url, DEFAULT_PLEX_URL);
+	g_config.servers[0].scan_burst = DEFAULT_SCAN_BURST;
+	g_config.num_servers = 1;
 	strcpy(g_config.log_file, DEFAULT_LOG_FILE);
-	g_config.scan_interval = DEFAULT_SCAN_INTERVAL;
+	g_config.defaults.section_id = PROFILE_UNSET;
+	g_config.defaults.debounce_min = DEFAULT_SCAN_INTERVAL;
+	g_config.defaults.debounce_max = DEFAULT_DEBOUNCE_MAX;
+	g_config.defaults.max_scan_delay = DEFAULT_MAX_SCAN_DELAY;
+	g_config.defaults.backend = BACKEND_WATCH;
+	g_config.defaults.poll_interval = DEFAULT_POLL_INTERVAL;
+	g_config.defaults.priority = DEFAULT_PRIORITY;
+	g_config.defaults.crawl_concurrency = DEFAULT_CRAWL_CONCURRENCY;
+	g_config.defaults.window_open = 0;
+	g_config.defaults.window_close = 0;
+	g_config.defaults.window_rate = DEFAULT_WINDOW_RATE;
+	g_config.defaults.window_urgent = 0;
 	g_config.startup_timeout = 60;
+	g_config.mount_poll_interval = DEFAULT_MOUNT_POLL_INTERVAL;
+	g_config.timer_slack = DEFAULT_TIMER_SLACK;
+	g_config.batch_window = DEFAULT_BATCH_WINDOW;
+	g_config.batch_rate = DEFAULT_BATCH_RATE;
+	g_config.pending_memory = DEFAULT_PENDING_MEMORY;
+	g_config.throttle_low = DEFAULT_THROTTLE_LOW;
+	g_config.throttle_high = DEFAULT_THROTTLE_HIGH;
+	g_config.workers = 1;
+	g_config.disk_scans = 0;
+	g_config.disk_busy = DEFAULT_DISK_BUSY;
+	g_config.follow_symlinks = false;
+	g_config.state_file[0] = '\0';
+	g_config.state_interval = DEFAULT_STATE_INTERVAL;
+	g_config.echo_window = DEFAULT_ECHO_WINDOW;
+	strcpy(g_config.echo_patterns, DEFAULT_ECHO_PATTERNS);
+	g_config.echo_uid = -1;
+	g_config.latency[SCAN_NEW] = DEFAULT_LATENCY_NEW;
+	g_config.latency[SCAN_DELETE] = DEFAULT_LATENCY_DELETE;
+	g_config.latency[SCAN_METADATA] = DEFAULT_LATENCY_METADATA;
+	g_config.latency[SCAN_VERIFY] = DEFAULT_LATENCY_VERIFY;
 	g_config.verbose = false;
 	g_config.daemonize = false;
 	g_config.log_level = DEFAULT_LOG_LEVEL;
 
 	/* Parse command line options */
-	while ((opt = getopt(argc, argv, "c:t:vdh")) != -1) {
+	while ((opt = getopt(argc, argv, "c:t:b:vdh")) != -1) {
 		switch (opt) {
 			case 'c':
 				config_path = optarg;
@@ -77,6 +127,9 @@ int main(int argc, char *argv[]) {
 					return EXIT_FAILURE;
 				}
 				break;
+			case 'b':
+				bench_dir = optarg;
+				break;
 			case 'v':
 				g_config.verbose = true;
 				break;
@@ -92,6 +145,11 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	/* The benchmark needs neither a configuration nor a Plex server */
+	if (bench_dir) {
+		return bench_run(bench_dir) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	/* Load configuration */
 	if (!config_load(config_path)) {
 		fprintf(stderr, "Failed to load configuration from %s\n", config_path);
@@ -114,10 +172,18 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	/* Initialize the reactor every subsystem waits on */
+	if (!reactor_init()) {
+		log_message(LOG_ERR, "Failed to initialize event reactor");
+		log_cleanup();
+		return EXIT_FAILURE;
+	}
+
 	/* Set up signal handlers */
-	signal(SIGINT, signal_handler);
-	signal(SIGHUP, signal_handler);
-	signal(SIGTERM, signal_handler);
+	reactor_signal(SIGINT, signal_handler, NULL);
+	reactor_signal(SIGHUP, signal_handler, NULL);
+	reactor_signal(SIGTERM, signal_handler, NULL);
+	reactor_signal(SIGUSR1, signal_handler, NULL);
 
 	/* Initialize components */
 	if (!plexapi_init()) {
@@ -132,6 +198,12 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	if (!hotspots_init()) {
+		log_message(LOG_ERR, "Failed to initialize hotspot tracker");
+		cleanup();
+		return EXIT_FAILURE;
+	}
+
 	/* Initialize directory cache */
 	if (!dircache_init()) {
 		log_message(LOG_ERR, "Failed to initialize directory cache");
@@ -139,6 +211,13 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	/* Initialize mount tracking */
+	if (!mounts_init()) {
+		log_message(LOG_ERR, "Failed to initialize mount tracking");
+		cleanup();
+		return EXIT_FAILURE;
+	}
+
 	/* Initialize file system monitoring */
 	if (!monitor_init()) {
 		log_message(LOG_ERR, "Failed to initialize file system monitoring");
@@ -153,6 +232,13 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	/* Split libraries across worker processes if configured */
+	if (!shard_init(signal_handler)) {
+		log_message(LOG_ERR, "Failed to initialize worker supervision");
+		cleanup();
+		return EXIT_FAILURE;
+	}
+
 	/* Get libraries from Plex */
 	if (!plexapi_libraries()) {
 		log_message(LOG_ERR, "Failed to get library directories from Plex");
@@ -160,7 +246,17 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	log_message(LOG_INFO, "Monitoring %d directories for changes", monitor_count());
+	if (!shard_supervisor()) {
+		log_message(LOG_INFO, "Monitoring %d directories for changes", monitor_count());
+		persist_start();
+	} else if (!shard_start()) {
+		log_message(LOG_ERR, "Failed to start worker processes");
+		cleanup();
+		return EXIT_FAILURE;
+	}
+
+	/* Workers are forked by now and never send requests, so only this process probes */
+	plexapi_probe();
 
 	/* Main event loop */
 	if (!monitor_loop()) {
@@ -256,8 +352,14 @@ static bool daemonize(void) {
 
 /* Clean up all components */
 static void cleanup(void) {
+	shard_cleanup();
+	persist_cleanup();
 	monitor_cleanup();
+	mounts_cleanup();
 	events_cleanup();
+	hotspots_cleanup();
 	dircache_cleanup();
 	plexapi_cleanup();
+	config_cleanup();
+	reactor_cleanup();
 }
@@ -3,30 +3,139 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/event.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../lib/khash.h"
 #include "config.h"
 #include "dircache.h"
 #include "events.h"
+#include "hotspots.h"
 #include "logger.h"
+#include "mounts.h"
+#include "persist.h"
+#include "probes.h"
+#include "plexapi.h"
+#include "prefetch.h"
 #include "queue.h"
+#include "reactor.h"
+#include "shard.h"
+#include "throttle.h"
 #include "utilities.h"
 
-KHASH_MAP_INIT_STR(mon_dir, int) /* Hash map from string to monitored_dir_t index */
+KHASH_MAP_INIT_STR(mon_dir, int) /* Hash map from string to monitored directory slot */
+
+/* Hash map from directory identity to the path it is crawled under */
+#define identity_hash(id) kh_int64_hash_func((khint64_t) (id).inode ^ ((khint64_t) (id).device << 32))
+#define identity_equal(a, b) ((a).device == (b).device && (a).inode == (b).inode)
+KHASH_INIT(dir_id, dir_identity_t, char *, 1, identity_hash, identity_equal)
+
+/* Events registered for every monitored directory */
+#define WATCH_FLAGS (NOTE_WRITE | NOTE_RENAME | NOTE_DELETE | NOTE_EXTEND | NOTE_REVOKE)
 
 /* Static variables for monitor implementation */
-static monitored_dir_t *monitored_dirs = NULL; /* Dynamic array of monitored directories */
-static int dirs_capacity = 0;				   /* Current capacity of the array */
-static int active_count = 0;				   /* Number of active directories */
-static int free_head = -1;					   /* Head of the free list for empty slots */
+static monitored_dirs_t dirs = { 0 };		   /* Table of monitored directories */
 static khash_t(mon_dir) * dirs_hash;		   /* Hash table for fast path lookups */
-static int kqueue_fd = -1;					   /* Global kqueue descriptor */
-uintptr_t user_event = 0;					   /* Global user event identifier */
+static int kqueue_fd = -1;					   /* Reactor kqueue used for directory watches */
+static time_t last_activity = 0;			   /* Time of the last directory event */
+static bool compact_armed = false;			   /* Whether the compaction timer is pending */
+static bool compact_due = false;			   /* Compaction timer fired during this pass */
+static time_t armed_deadline = 0;			   /* Deadline the scan timer is armed for, 0 if none */
+static khash_t(dir_id) * identities;		   /* Owners of directories reached through symlinks */
+static monitor_alias_t *aliases = NULL;		   /* Symlinked paths to directories crawled elsewhere */
+static int num_aliases = 0;					   /* Number of aliases */
+static int aliases_capacity = 0;			   /* Allocated alias slots */
+static struct kevent watch_changes[WATCH_BATCH]; /* Watch registrations not yet submitted */
+static int watch_count = 0;					   /* Number of queued registrations */
+static crawl_t *crawls = NULL;				   /* Background crawls, oldest first */
+static bool crawl_prefetch = false;			   /* Whether prefetch workers belong to the crawls */
+static batch_event_t batch[BATCH_MAX_EVENTS];  /* Directory events not yet processed */
+static int batch_count = 0;					   /* Number of events in the batch */
+static double event_rate = 0;				   /* Recent directory events per second */
+static long long rate_time = 0;				   /* When the event rate was last updated, in microseconds */
+static long long batch_delay = 0;			   /* Microseconds the current batch was held open */
+static batch_stats_t batch_stats = { 0 };	   /* Batching statistics since startup */
+
+/* Forward declarations for helper functions */
+static void monitor_poll(int server, int section_id);
+static void monitor_vnode(const struct kevent *kev, void *arg);
+static void monitor_timer(uintptr_t ident, uint32_t data, void *arg);
+static void monitor_wake(uintptr_t ident, uint32_t data, void *arg);
+static void monitor_crawl(void);
+static void monitor_flush(void);
+static bool monitor_walk(const char *dir_path, int server, int section_id, bool revalidate,
+						 bool throttled);
+
+/* Build the kqueue udata handle for a slot, tagged with its generation */
+static uintptr_t handle_make(int index) {
+	return (uintptr_t) index | ((uintptr_t) dirs.generation[index] << MONITOR_INDEX_BITS);
+}
+
+/* Resolve a handle to a slot, returns -1 if the slot was released or moved since */
+static int handle_index(uintptr_t handle) {
+	int index = (int) (handle & (MONITOR_MAX_CAPACITY - 1));
+	if (index >= dirs.capacity || dirs.fd[index] < 0 || handle_make(index) != handle) {
+		return -1;
+	}
+	return index;
+}
+
+/* Reallocate every column of the table, capacity is only updated if all succeed */
+static bool monitor_resize(int new_capacity) {
+	void *column;
+
+	/* A failed shrink keeps the larger block, which is still valid */
+#define RESIZE_COLUMN(name)                                                      \
+	column = realloc((void *) dirs.name, new_capacity * sizeof(*dirs.name));     \
+	if (column) {                                                                \
+		dirs.name = column;                                                      \
+	} else if (new_capacity > dirs.capacity) {                                   \
+		return false;                                                            \
+	}
+
+	RESIZE_COLUMN(fd)
+	RESIZE_COLUMN(section_id)
+	RESIZE_COLUMN(server)
+	RESIZE_COLUMN(generation)
+	RESIZE_COLUMN(path)
+	RESIZE_COLUMN(device)
+	RESIZE_COLUMN(inode)
+	RESIZE_COLUMN(next_free)
+#undef RESIZE_COLUMN
+
+	/* Initialize new slots and chain them into the free list, shrinking leaves it to the caller */
+	for (int i = dirs.capacity; i < new_capacity; i++) {
+		dirs.fd[i] = -1;
+		dirs.generation[i] = 0;
+		dirs.path[i] = NULL;
+		dirs.next_free[i] = (i + 1 < new_capacity) ? (i + 1) : dirs.free_head;
+	}
+	if (new_capacity > dirs.capacity) {
+		dirs.free_head = dirs.capacity;
+	}
+
+	dirs.capacity = new_capacity;
+	return true;
+}
+
+/* Release every column of the table */
+static void monitor_release(void) {
+	free(dirs.fd);
+	free(dirs.section_id);
+	free(dirs.server);
+	free(dirs.generation);
+	free((void *) dirs.path);
+	free(dirs.device);
+	free(dirs.inode);
+	free(dirs.next_free);
+	memset(&dirs, 0, sizeof(dirs));
+	dirs.free_head = -1;
+}
 
 /* Helper function to find a monitored directory by its path */
 static int path_monitored(const char *path) {
@@ -38,7 +147,7 @@ static int path_monitored(const char *path) {
 	if (k != kh_end(dirs_hash)) {
 		int index = kh_value(dirs_hash, k);
 		/* Check if the found dir is active */
-		if (index >= 0 && index < dirs_capacity && monitored_dirs[index].fd != -1) {
+		if (index >= 0 && index < dirs.capacity && dirs.fd[index] != -1) {
 			return index;
 		}
 	}
@@ -50,29 +159,20 @@ static int path_monitored(const char *path) {
 bool monitor_init(void) {
 	log_message(LOG_INFO, "Initializing file system monitoring");
 
-	/* Allocate and initialize the dynamic array for monitored directories */
-	dirs_capacity = INITIAL_MONITOR_CAPACITY;
-	monitored_dirs = malloc(dirs_capacity * sizeof(monitored_dir_t));
-	if (!monitored_dirs) {
+	/* Allocate the table of monitored directories, this also builds the free list */
+	dirs.free_head = -1;
+	if (!monitor_resize(INITIAL_MONITOR_CAPACITY)) {
 		log_message(LOG_ERR, "Failed to allocate memory for monitored directories");
+		monitor_release();
 		return false;
 	}
+	dirs.active = 0;
 
-	/* Build the free list */
-	for (int i = 0; i < dirs_capacity; i++) {
-		monitored_dirs[i].fd = -1;
-		monitored_dirs[i].next_free = (i + 1);
-	}
-	monitored_dirs[dirs_capacity - 1].next_free = -1; /* End of list */
-	free_head = 0;
-	active_count = 0;
-
-	/* Create kqueue */
-	kqueue_fd = kqueue();
+	/* Directory watches are registered on the reactor's kqueue */
+	kqueue_fd = reactor_kqueue();
 	if (kqueue_fd == -1) {
-		log_message(LOG_ERR, "Failed to create kqueue: %s", strerror(errno));
-		free(monitored_dirs);
-		monitored_dirs = NULL;
+		log_message(LOG_ERR, "Reactor is not initialized");
+		monitor_release();
 		return false;
 	}
 
@@ -80,30 +180,42 @@ bool monitor_init(void) {
 	dirs_hash = kh_init(mon_dir);
 	if (!dirs_hash) {
 		log_message(LOG_ERR, "Failed to create monitored dirs hash table");
-		close(kqueue_fd);
 		kqueue_fd = -1;
-		free(monitored_dirs);
-		monitored_dirs = NULL;
+		monitor_release();
 		return false;
 	}
 
-	/* Set up user event for clean wake-up */
-	struct kevent kev;
-	user_event = getpid(); /* Use PID as the identifier */
+	/* Initialize the identity map for symlinked directories */
+	identities = kh_init(dir_id);
+	if (!identities) {
+		log_message(LOG_ERR, "Failed to create directory identity hash table");
+		kqueue_fd = -1;
+		kh_destroy(mon_dir, dirs_hash);
+		dirs_hash = NULL;
+		monitor_release();
+		return false;
+	}
 
-	EV_SET(&kev, user_event, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
-	if (kevent(kqueue_fd, &kev, 1, NULL, 0, NULL) == -1) {
-		log_message(LOG_ERR, "Failed to register user event: %s", strerror(errno));
-		close(kqueue_fd);
+	/* Set up wakeups for exit, reload and statistics requests */
+	if (!reactor_wakeup(monitor_wake, NULL)) {
+		log_message(LOG_ERR, "Failed to register wakeup handler");
 		kqueue_fd = -1;
 		kh_destroy(mon_dir, dirs_hash);
 		dirs_hash = NULL;
-		free(monitored_dirs);
-		monitored_dirs = NULL;
+		kh_destroy(dir_id, identities);
+		identities = NULL;
+		monitor_release();
 		return false;
 	}
+	reactor_vnodes(monitor_vnode, NULL);
+
+	/* Set up periodic timer for mount table polling */
+	if (g_config.mount_poll_interval > 0 &&
+		!reactor_timer(TIMER_MOUNTS, g_config.mount_poll_interval * 1000L, true, monitor_timer, NULL)) {
+		log_message(LOG_WARNING, "Failed to register mount poll timer");
+	}
 
-	log_message(LOG_INFO, "Kqueue created successfully with descriptor %d", kqueue_fd);
+	log_message(LOG_INFO, "Watching directories on kqueue descriptor %d", kqueue_fd);
 	return true;
 }
 
@@ -111,21 +223,39 @@ bool monitor_init(void) {
 void monitor_cleanup(void) {
 	log_message(LOG_INFO, "Cleaning up file system monitoring");
 
-	if (monitored_dirs) {
-		/* Close all file descriptors */
-		for (int i = 0; i < dirs_capacity; i++) {
-			if (monitored_dirs[i].fd >= 0) {
-				close(monitored_dirs[i].fd);
-				monitored_dirs[i].fd = -1;
-			}
+	/* Close all file descriptors, queued registrations and events go with them */
+	watch_count = 0;
+	batch_count = 0;
+	for (int i = 0; i < dirs.capacity; i++) {
+		if (dirs.fd[i] >= 0) {
+			close(dirs.fd[i]);
+			dirs.fd[i] = -1;
 		}
 	}
 
-	/* Close kqueue */
+	/* The kqueue itself belongs to the reactor */
 	if (kqueue_fd != -1) {
-		close(kqueue_fd);
+		reactor_vnodes(NULL, NULL);
+		reactor_cancel(TIMER_MOUNTS);
+		reactor_cancel(TIMER_COMPACT);
+		reactor_cancel(TIMER_DEADLINE);
+		reactor_cancel(TIMER_CRAWL);
 		kqueue_fd = -1;
 	}
+	armed_deadline = 0;
+
+	/* Abandon unfinished crawls */
+	while (crawls) {
+		crawl_t *crawl = crawls;
+		crawls = crawl->next;
+		queue_free(&crawl->queue);
+		free(crawl->root);
+		free(crawl);
+	}
+	if (crawl_prefetch) {
+		prefetch_stop();
+		crawl_prefetch = false;
+	}
 
 	/* Destroy the hash table */
 	if (dirs_hash) {
@@ -139,47 +269,46 @@ void monitor_cleanup(void) {
 		dirs_hash = NULL;
 	}
 
-	/* Free the dynamic array */
-	if (monitored_dirs) {
-		free(monitored_dirs);
-		monitored_dirs = NULL;
+	/* Destroy the identity map and aliases */
+	if (identities) {
+		khint_t k;
+		for (k = kh_begin(identities); k != kh_end(identities); ++k) {
+			if (kh_exist(identities, k)) {
+				free(kh_value(identities, k));
+			}
+		}
+		kh_destroy(dir_id, identities);
+		identities = NULL;
 	}
-
-	dirs_capacity = 0;
-	active_count = 0;
-	free_head = -1;
+	for (int i = 0; i < num_aliases; i++) {
+		free(aliases[i].path);
+		free(aliases[i].target);
+	}
+	free(aliases);
+	aliases = NULL;
+	num_aliases = 0;
+	aliases_capacity = 0;
+
+	/* Free the table */
+	monitor_release();
+	compact_armed = false;
 }
 
 /* Signal to the event loop to exit */
 void monitor_exit(void) {
-	struct kevent kev;
-
-	if (kqueue_fd == -1) return;
-
 	log_message(LOG_INFO, "Sending exit signal to event loop");
-
-	/* Set up and trigger the user event for exit */
-	EV_SET(&kev, user_event, EVFILT_USER, EV_ENABLE, NOTE_TRIGGER, USER_EVENT_EXIT, NULL);
-
-	if (kevent(kqueue_fd, &kev, 1, NULL, 0, NULL) == -1) {
-		log_message(LOG_ERR, "Failed to signal exit event: %s", strerror(errno));
-	}
+	reactor_wake(USER_EVENT_EXIT);
 }
 
 /* Signal to the event loop to reload configuration */
 void monitor_reload(void) {
-	struct kevent kev;
-
-	if (kqueue_fd == -1) return;
-
 	log_message(LOG_INFO, "Sending reload signal to event loop");
+	reactor_wake(USER_EVENT_RELOAD);
+}
 
-	/* Set up and trigger the user event for reload */
-	EV_SET(&kev, user_event, EVFILT_USER, EV_ENABLE, NOTE_TRIGGER, USER_EVENT_RELOAD, NULL);
-
-	if (kevent(kqueue_fd, &kev, 1, NULL, 0, NULL) == -1) {
-		log_message(LOG_ERR, "Failed to signal reload event: %s", strerror(errno));
-	}
+/* Signal to the event loop to dump runtime statistics */
+void monitor_dump(void) {
+	reactor_wake(USER_EVENT_DUMP);
 }
 
 /* Get the kqueue file descriptor */
@@ -189,36 +318,72 @@ int monitor_kqueue(void) {
 
 /* Return the current count of monitored directories */
 int monitor_count(void) {
-	return active_count;
+	return dirs.active;
+}
+
+/* Arm a one-shot timer to compact the table once the watcher goes quiet */
+static void monitor_defer(int seconds) {
+	if (!reactor_timer(TIMER_COMPACT, seconds * 1000L, false, monitor_timer, NULL)) {
+		log_message(LOG_WARNING, "Failed to register compaction timer");
+		return;
+	}
+	compact_armed = true;
+}
+
+/* Drop a queued watch registration, closing the descriptor removes any submitted one */
+static void monitor_unqueue(int fd) {
+	for (int i = watch_count - 1; i >= 0; i--) {
+		if ((int) watch_changes[i].ident == fd) {
+			watch_changes[i] = watch_changes[--watch_count];
+		}
+	}
 }
 
 /* Remove a directory from the monitoring list by marking it as inactive */
 void monitor_remove(int index) {
-	if (index < 0 || index >= dirs_capacity) {
+	if (index < 0 || index >= dirs.capacity) {
 		return;
 	}
 
-	monitored_dir_t *dir = &monitored_dirs[index];
-
 	/* Close file descriptor if valid */
-	if (dir->fd >= 0) {
-		log_message(LOG_DEBUG, "Removing directory %s from monitoring", dir->path);
-		close(dir->fd);
-		dir->fd = -1; /* Mark as inactive */
+	if (dirs.fd[index] >= 0) {
+		monitor_unqueue(dirs.fd[index]); /* A queued registration must not outlive its descriptor */
+		log_message(LOG_DEBUG, "Removing directory %s from monitoring", dirs.path[index]);
+		PROBE2(watch__remove, dirs.path[index], dirs.fd[index]);
+		close(dirs.fd[index]);
+		dirs.fd[index] = -1; /* Mark as inactive */
+		dirs.generation[index]++; /* Invalidate handles still queued in kqueue */
+
+		/* Another path may lead to the same directory from now on */
+		if (identities) {
+			dir_identity_t id = { dirs.device[index], dirs.inode[index] };
+			khint_t k = kh_get(dir_id, identities, id);
+			if (k != kh_end(identities) && strcmp(kh_value(identities, k), dirs.path[index]) == 0) {
+				free(kh_value(identities, k));
+				kh_del(dir_id, identities, k);
+			}
+		}
 
 		/* Remove from hash table */
 		if (dirs_hash) {
-			khint_t k = kh_get(mon_dir, dirs_hash, dir->path);
+			khint_t k = kh_get(mon_dir, dirs_hash, dirs.path[index]);
 			if (k != kh_end(dirs_hash)) {
 				free((void *) kh_key(dirs_hash, k));
 				kh_del(mon_dir, dirs_hash, k);
 			}
 		}
+		dirs.path[index] = NULL;
 
 		/* Add to free list */
-		dir->next_free = free_head;
-		free_head = index;
-		active_count--;
+		dirs.next_free[index] = dirs.free_head;
+		dirs.free_head = index;
+		dirs.active--;
+
+		/* Mostly empty table, compact it after the current burst settles */
+		if (!compact_armed && kqueue_fd != -1 && dirs.capacity > INITIAL_MONITOR_CAPACITY &&
+			dirs.active < dirs.capacity / 2) {
+			monitor_defer(COMPACT_DELAY);
+		}
 	}
 }
 
@@ -229,12 +394,10 @@ bool monitor_validate(const char *path) {
 		return false;
 	}
 
-	monitored_dir_t *dir = &monitored_dirs[index];
-
 	/* Verify the directory still exists and is the same */
 	struct stat path_stat;
-	if (dir->fd >= 0 && stat(path, &path_stat) == 0 &&
-		path_stat.st_dev == dir->device && path_stat.st_ino == dir->inode) {
+	if (dirs.fd[index] >= 0 && stat(path, &path_stat) == 0 &&
+		path_stat.st_dev == dirs.device[index] && path_stat.st_ino == dirs.inode[index]) {
 		return true;
 	}
 
@@ -243,35 +406,62 @@ bool monitor_validate(const char *path) {
 	return false;
 }
 
-/* Register a directory with kqueue */
-static bool monitor_register(int fd, monitored_dir_t *dir_info) {
-	struct kevent change;
-	int index = (int) (dir_info - monitored_dirs);
+/* Submit queued watch registrations, dropping directories the kernel refused */
+static void monitor_flush(void) {
+	int nchanges = watch_count;
+	if (nchanges == 0 || kqueue_fd == -1) {
+		return;
+	}
+	watch_count = 0; /* Removals below must not resubmit the batch */
+
+	/* EV_RECEIPT reports every entry in place instead of stopping at the first error */
+	struct kevent receipts[nchanges];
+	int nrec = kevent(kqueue_fd, watch_changes, nchanges, receipts, nchanges, NULL);
+	if (nrec == -1) {
+		log_message(LOG_ERR, "Failed to register %d directory watches: %s", nchanges, strerror(errno));
+		for (int i = 0; i < nchanges; i++) {
+			monitor_remove(handle_index((uintptr_t) watch_changes[i].udata));
+		}
+		return;
+	}
+
+	for (int i = 0; i < nrec; i++) {
+		if ((receipts[i].flags & EV_ERROR) && receipts[i].data != 0) {
+			int index = handle_index((uintptr_t) receipts[i].udata);
+			log_message(LOG_WARNING, "Failed to watch directory %s: %s",
+						index >= 0 ? dirs.path[index] : "(unknown)", strerror(receipts[i].data));
+			monitor_remove(index);
+		}
+	}
+}
 
-	/* Set up the kevent structure for this directory */
-	EV_SET(&change, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR | EV_ENABLE,
-		   NOTE_WRITE | NOTE_RENAME | NOTE_DELETE | NOTE_EXTEND, 0, (void *) (intptr_t) index);
+/* Queue a watch registration for a slot, EV_ADD on an existing knote replaces its udata */
+static void monitor_watch(int index) {
+	EV_SET(&watch_changes[watch_count++], dirs.fd[index], EVFILT_VNODE,
+		   EV_ADD | EV_CLEAR | EV_ENABLE | EV_RECEIPT, WATCH_FLAGS, 0, (void *) handle_make(index));
 
-	/* Register event with kqueue */
-	if (kevent(kqueue_fd, &change, 1, NULL, 0, NULL) == -1) {
-		log_message(LOG_ERR, "Error registering directory %s with kqueue: %s",
-					dir_info->path, strerror(errno));
-		return false;
+	if (watch_count == WATCH_BATCH) {
+		monitor_flush();
 	}
+}
 
-	return true;
+/* Return a slot that failed to be filled to the free list */
+static void monitor_release_slot(int index) {
+	dirs.fd[index] = -1;
+	dirs.path[index] = NULL;
+	dirs.next_free[index] = dirs.free_head;
+	dirs.free_head = index;
 }
 
 /* Add a directory to the monitoring list */
-int monitor_add(const char *path, int section_id) {
+int monitor_add(const char *path, int server, int section_id) {
 	/* Check if already monitored with a single hash lookup */
 	int existing_idx = path_monitored(path);
 	if (existing_idx >= 0) {
 		/* Verify the directory is still valid */
-		monitored_dir_t *dir = &monitored_dirs[existing_idx];
 		struct stat path_stat;
-		if (dir->fd >= 0 && stat(path, &path_stat) == 0 &&
-			path_stat.st_dev == dir->device && path_stat.st_ino == dir->inode) {
+		if (stat(path, &path_stat) == 0 && path_stat.st_dev == dirs.device[existing_idx] &&
+			path_stat.st_ino == dirs.inode[existing_idx]) {
 			log_message(LOG_DEBUG, "Directory %s is already being monitored and is valid", path);
 			return existing_idx;
 		}
@@ -280,40 +470,29 @@ int monitor_add(const char *path, int section_id) {
 		monitor_remove(existing_idx);
 	}
 
-	/* If no free slots, resize the array */
-	if (free_head == -1) {
-		int old_capacity = dirs_capacity;
-		int new_capacity = (old_capacity > 0) ? (old_capacity * 2) : INITIAL_MONITOR_CAPACITY;
-		monitored_dir_t *new_dirs = realloc(monitored_dirs, new_capacity * sizeof(monitored_dir_t));
-
-		if (!new_dirs) {
-			log_message(LOG_ERR, "Failed to resize monitored directories array");
+	/* If no free slots, grow the table */
+	if (dirs.free_head == -1) {
+		if (dirs.capacity >= MONITOR_MAX_CAPACITY) {
+			log_message(LOG_ERR, "Cannot monitor more than %d directories", MONITOR_MAX_CAPACITY);
 			return -1;
 		}
-		monitored_dirs = new_dirs;
-		dirs_capacity = new_capacity;
-
-		/* Rebuild the free list for the new portion */
-		for (int i = old_capacity; i < new_capacity; i++) {
-			monitored_dirs[i].fd = -1;
-			monitored_dirs[i].next_free = (i + 1);
+		int new_capacity = (dirs.capacity > 0) ? (dirs.capacity * 2) : INITIAL_MONITOR_CAPACITY;
+		if (!monitor_resize(new_capacity)) {
+			log_message(LOG_ERR, "Failed to resize monitored directories table");
+			return -1;
 		}
-		monitored_dirs[new_capacity - 1].next_free = -1;
-		free_head = old_capacity;
 		log_message(LOG_DEBUG, "Resized monitored directories to %d", new_capacity);
 	}
 
 	/* Get a free slot from the head of the list */
-	int new_index = free_head;
-	monitored_dir_t *new_dir = &monitored_dirs[new_index];
-	free_head = new_dir->next_free;
+	int new_index = dirs.free_head;
+	dirs.free_head = dirs.next_free[new_index];
 
 	/* Open directory */
 	int fd = open(path, O_RDONLY);
 	if (fd == -1) {
 		log_message(LOG_ERR, "Failed to open directory %s: %s", path, strerror(errno));
-		new_dir->next_free = free_head;
-		free_head = new_index; /* Return slot to free list */
+		monitor_release_slot(new_index);
 		return -1;
 	}
 
@@ -322,8 +501,7 @@ int monitor_add(const char *path, int section_id) {
 	if (fstat(fd, &dir_stat) == -1) {
 		log_message(LOG_ERR, "Failed to stat directory %s: %s", path, strerror(errno));
 		close(fd);
-		new_dir->next_free = free_head;
-		free_head = new_index; /* Return slot to free list */
+		monitor_release_slot(new_index);
 		return -1;
 	}
 
@@ -332,8 +510,7 @@ int monitor_add(const char *path, int section_id) {
 	if (!key) {
 		log_message(LOG_ERR, "Failed to allocate memory for hash table key");
 		close(fd);
-		new_dir->next_free = free_head;
-		free_head = new_index; /* Return slot to free list */
+		monitor_release_slot(new_index);
 		return -1;
 	}
 
@@ -343,54 +520,332 @@ int monitor_add(const char *path, int section_id) {
 		log_message(LOG_ERR, "Failed to add directory to hash table");
 		free(key);
 		close(fd);
-		new_dir->next_free = free_head;
-		free_head = new_index; /* Return slot to free list */
+		monitor_release_slot(new_index);
 		return -1;
 	}
 
-	/* Add to monitored directories array */
-	new_dir->fd = fd;
-	new_dir->path = kh_key(dirs_hash, k);
-	new_dir->section_id = section_id;
-	new_dir->device = dir_stat.st_dev;
-	new_dir->inode = dir_stat.st_ino;
+	/* Fill the slot */
+	dirs.fd[new_index] = fd;
+	dirs.path[new_index] = kh_key(dirs_hash, k);
+	dirs.section_id[new_index] = section_id;
+	dirs.server[new_index] = server;
+	dirs.device[new_index] = dir_stat.st_dev;
+	dirs.inode[new_index] = dir_stat.st_ino;
 	kh_value(dirs_hash, k) = new_index;
+	dirs.active++;
 
-	/* Register with kqueue */
-	if (!monitor_register(fd, new_dir)) {
-		/* If registration fails, we need to undo the add */
-		free((void *) kh_key(dirs_hash, k));
-		kh_del(mon_dir, dirs_hash, k);
-		close(fd);
-		new_dir->fd = -1;
-		new_dir->next_free = free_head;
-		free_head = new_index; /* Return slot to free list */
-		return -1;
-	}
+	/* Registered with the next batch, a refused watch is removed again when it is flushed */
+	monitor_watch(new_index);
+	PROBE2(watch__add, path, fd);
 
-	active_count++;
 	log_message(LOG_DEBUG, "Added directory %s to monitoring", path);
 	return new_index;
 }
 
+/* Move the highest active slots into the lowest free ones and shrink the table */
+static void monitor_compact(void) {
+	int moved = 0;
+	int old_capacity = dirs.capacity;
+
+	compact_armed = false;
+	if (dirs.capacity <= INITIAL_MONITOR_CAPACITY || dirs.active >= dirs.capacity / 2) {
+		return;
+	}
+	monitor_flush(); /* Queued registrations carry handles of the slots about to move */
+
+	/* Pack active slots into the front of the table */
+	int low = 0;
+	int high = dirs.capacity - 1;
+	while (true) {
+		while (low < high && dirs.fd[low] >= 0) low++;
+		while (high > low && dirs.fd[high] < 0) high--;
+		if (low >= high) {
+			break;
+		}
+
+		dirs.fd[low] = dirs.fd[high];
+		dirs.section_id[low] = dirs.section_id[high];
+		dirs.server[low] = dirs.server[high];
+		dirs.path[low] = dirs.path[high];
+		dirs.device[low] = dirs.device[high];
+		dirs.inode[low] = dirs.inode[high];
+		dirs.generation[low]++;
+
+		dirs.fd[high] = -1;
+		dirs.path[high] = NULL;
+		dirs.generation[high]++; /* Events queued for the old slot are dropped */
+
+		khint_t k = kh_get(mon_dir, dirs_hash, dirs.path[low]);
+		if (k != kh_end(dirs_hash)) {
+			kh_value(dirs_hash, k) = low;
+		}
+
+		/* Re-registering replaces the knote's udata with the new handle */
+		monitor_watch(low);
+		moved++;
+	}
+	monitor_flush();
+
+	/* Shrink to the smallest power of two that leaves room to grow */
+	int used = 0;
+	for (int i = 0; i < dirs.capacity; i++) {
+		if (dirs.fd[i] >= 0) used = i + 1;
+	}
+	int new_capacity = INITIAL_MONITOR_CAPACITY;
+	while (new_capacity < used * 2) new_capacity *= 2;
+	if (new_capacity < dirs.capacity) {
+		monitor_resize(new_capacity);
+	}
+
+	/* Rebuild the free list so the lowest slots are reused first */
+	dirs.free_head = -1;
+	for (int i = dirs.capacity - 1; i >= 0; i--) {
+		if (dirs.fd[i] < 0) {
+			dirs.next_free[i] = dirs.free_head;
+			dirs.free_head = i;
+		}
+	}
+
+	log_message(LOG_INFO, "Compacted monitored directories from %d to %d slots, moved %d",
+				old_capacity, dirs.capacity, moved);
+}
+
+/* Forget aliases at or below a path that went away */
+static void monitor_unalias(const char *path) {
+	int kept = 0;
+
+	for (int i = 0; i < num_aliases; i++) {
+		if (strcmp(aliases[i].path, path) == 0 || path_contains(path, aliases[i].path)) {
+			log_message(LOG_DEBUG, "Dropping symlink alias %s", aliases[i].path);
+			free(aliases[i].path);
+			free(aliases[i].target);
+			continue;
+		}
+		aliases[kept++] = aliases[i];
+	}
+	num_aliases = kept;
+}
+
+/* Record a path as another name for a directory crawled under target */
+static void monitor_alias(const char *path, const char *target, int server, int section_id) {
+	for (int i = 0; i < num_aliases; i++) {
+		if (strcmp(aliases[i].path, path) == 0) {
+			if (strcmp(aliases[i].target, target) != 0) {
+				char *copy = strdup(target);
+				if (!copy) return;
+				free(aliases[i].target);
+				aliases[i].target = copy;
+			}
+			aliases[i].server = server;
+			aliases[i].section_id = section_id;
+			return;
+		}
+	}
+
+	if (num_aliases >= aliases_capacity) {
+		int new_capacity = aliases_capacity > 0 ? aliases_capacity * 2 : 8;
+		monitor_alias_t *new_aliases = realloc(aliases, new_capacity * sizeof(monitor_alias_t));
+		if (!new_aliases) {
+			log_message(LOG_ERR, "Failed to allocate memory for symlink aliases");
+			return;
+		}
+		aliases = new_aliases;
+		aliases_capacity = new_capacity;
+	}
+
+	char *path_copy = strdup(path);
+	char *target_copy = strdup(target);
+	if (!path_copy || !target_copy) {
+		log_message(LOG_ERR, "Failed to allocate memory for symlink alias");
+		free(path_copy);
+		free(target_copy);
+		return;
+	}
+
+	aliases[num_aliases].path = path_copy;
+	aliases[num_aliases].target = target_copy;
+	aliases[num_aliases].server = server;
+	aliases[num_aliases].section_id = section_id;
+	num_aliases++;
+	log_message(LOG_INFO, "Following %s to %s, which is already crawled", path, target);
+}
+
+/* Claim a directory for this path when following symlinks. Returns false when the
+ * directory is already crawled under another path, or when the path leads into a cycle */
+static bool monitor_claim(const char *path, int server, int section_id) {
+	if (!g_config.follow_symlinks || !identities) {
+		return true;
+	}
+
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return true; /* Let the refresh report it */
+	}
+
+	dir_identity_t id = { st.st_dev, st.st_ino };
+	int ret;
+	khint_t k = kh_put(dir_id, identities, id, &ret);
+	if (ret == -1) {
+		return true;
+	}
+
+	if (ret == 0) {
+		const char *owner = kh_value(identities, k);
+		if (strcmp(owner, path) == 0) {
+			return true;
+		}
+
+		/* Only an owner that still leads to this directory keeps it */
+		struct stat owner_st;
+		if (stat(owner, &owner_st) == 0 && owner_st.st_dev == id.device &&
+			owner_st.st_ino == id.inode) {
+			if (path_contains(owner, path)) {
+				log_message(LOG_WARNING, "Not following symlink cycle from %s back to %s", path, owner);
+			} else {
+				monitor_alias(path, owner, server, section_id);
+			}
+			return false;
+		}
+		free(kh_value(identities, k));
+	}
+
+	char *copy = strdup(path);
+	if (!copy) {
+		log_message(LOG_ERR, "Failed to allocate memory for directory identity");
+		kh_del(dir_id, identities, k);
+		return true;
+	}
+	kh_value(identities, k) = copy;
+
+	/* A former alias that now owns the directory is crawled under its own name */
+	monitor_unalias(path);
+	return true;
+}
+
+/* Queue a scan, and the same scan for every symlinked path leading to the directory */
+static void monitor_queue(const char *path, int server, int section_id, scan_class_t scan_class) {
+	events_handle(path, server, section_id, scan_class);
+
+	for (int i = 0; i < num_aliases; i++) {
+		const char *target = aliases[i].target;
+		if (strcmp(target, path) != 0 && !path_contains(target, path)) {
+			continue;
+		}
+
+		char alias_path[PATH_MAX_LEN];
+		int len = snprintf(alias_path, sizeof(alias_path), "%s%s",
+						   aliases[i].path, path + strlen(target));
+		if (len < 0 || len >= (int) sizeof(alias_path)) {
+			log_message(LOG_WARNING, "Symlinked path too long under %s", aliases[i].path);
+			continue;
+		}
+		events_handle(alias_path, aliases[i].server, aliases[i].section_id, scan_class);
+	}
+}
+
+/* Classify what a directory change means for the library */
+static scan_class_t monitor_classify(const dir_changes_t *changes) {
+	if (changes->added_count > 0 || changes->media_delta > 0) {
+		return SCAN_NEW;
+	}
+	/* Media renamed or replaced in place leaves the counts alone but is still new to Plex */
+	for (int i = 0; i < changes->files_count; i++) {
+		if (is_media_file(changes->files[i])) {
+			return SCAN_NEW;
+		}
+	}
+	if (changes->removed_count > 0 || changes->media_delta < 0 || changes->other_delta < 0) {
+		return SCAN_DELETE;
+	}
+	return SCAN_METADATA;
+}
+
+/* Check whether every file the last sync of a path found new matches Plex's own writes since
+ * its latest scan, by name or, for files other than media, by the user Plex runs as. Deleted
+ * files leave nothing to attribute */
+static bool monitor_echo(const char *path, const dir_changes_t *changes) {
+	if (g_config.echo_window <= 0 || changes->files_count == 0) {
+		return false;
+	}
+
+	time_t sent = events_echo(path);
+	if (sent == 0) {
+		return false;
+	}
+
+	int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		return false;
+	}
+
+	int echoes = 0;
+	bool foreign = false;
+	for (int i = 0; i < changes->files_count && !foreign; i++) {
+		const char *name = changes->files[i];
+		struct stat st;
+
+		/* Gone again already */
+		if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+
+		/* Ownership never vouches for media, a user copying files in as Plex's user is not Plex.
+		 * Files that arrived before the scan was sent cannot be its echo either */
+		if ((st.st_mtime >= sent || st.st_ctime >= sent) &&
+			(is_plex_file(name) || (!is_media_file(name) && g_config.echo_uid >= 0 &&
+									 st.st_uid == (uid_t) g_config.echo_uid))) {
+			echoes++;
+		} else {
+			foreign = true;
+		}
+	}
+	close(dir_fd);
+
+	return echoes > 0 && !foreign;
+}
+
 /* Handle directory events */
-static void monitor_event(monitored_dir_t *md, int fflags) {
-	log_message(LOG_INFO, "Change detected in directory: %s (flags: 0x%x)", md->path, fflags);
+static void monitor_event(int index, int fflags) {
+	/* Checking the mounts may suspend a library, which frees the slot, or resume one, which
+	 * moves the table. Additions below may reuse it too, so only our own copy is used */
+	char *path = strdup(dirs.path[index]);
+	int section_id = dirs.section_id[index];
+	int server = dirs.server[index];
+	if (!path) {
+		log_message(LOG_ERR, "Failed to allocate memory for event path");
+		return;
+	}
+
+	log_message(LOG_INFO, "Change detected in directory: %s (flags: 0x%x)", path, fflags);
+	PROBE2(event, path, fflags);
+	hotspots_record(path, HOTSPOT_EVENT);
+
+	/* A revoked or deleted vnode may mean the filesystem underneath went away */
+	if (fflags & (NOTE_REVOKE | NOTE_DELETE)) {
+		mounts_check();
+	}
+	if (mounts_suspended(path)) {
+		log_message(LOG_DEBUG, "Ignoring event in suspended library path %s", path);
+		free(path);
+		return;
+	}
 
 	/* Check for new subdirectories that need to be monitored */
-	if (!is_directory(md->path, D_TYPE_UNAVAILABLE)) {
-		events_handle(md->path, md->section_id);
+	if (!is_directory(path, D_TYPE_UNAVAILABLE)) {
+		monitor_queue(path, server, section_id, SCAN_DELETE);
+		free(path);
 		return;
 	}
 
 	bool dir_changed = false;
 	dir_changes_t changes = { 0 };
+	scan_class_t scan_class = SCAN_NEW; /* Unknown changes are treated as the most urgent */
 
 	/* Directory cache with mtime checking and change tracking */
-	if (dircache_refresh(md->path, &dir_changed, &changes)) {
+	if (dircache_refresh(path, &dir_changed, &changes)) {
+		scan_class = monitor_classify(&changes);
 		if (dir_changed) {
-			log_message(LOG_DEBUG, "Structure changed in %s, processing changes",
-						md->path);
+			log_message(LOG_DEBUG, "Structure changed in %s, processing changes", path);
 
 			/* Process removed directories first */
 			if (changes.removed_count > 0) {
@@ -401,6 +856,7 @@ static void monitor_event(monitored_dir_t *md, int fflags) {
 					if (idx >= 0) {
 						monitor_remove(idx);
 					}
+					monitor_unalias(changes.removed[i]);
 				}
 			}
 
@@ -410,100 +866,324 @@ static void monitor_event(monitored_dir_t *md, int fflags) {
 							changes.added_count);
 				int added_count = 0;
 				for (int i = 0; i < changes.added_count; i++) {
-					if (monitor_add(changes.added[i], md->section_id) >= 0) {
+					if (monitor_claim(changes.added[i], server, section_id) &&
+						monitor_add(changes.added[i], server, section_id) >= 0) {
 						added_count++;
 					}
 				}
 				if (added_count > 0) {
 					log_message(LOG_DEBUG, "Successfully registered %d new directories under %s",
-								added_count, md->path);
+								added_count, path);
 				}
 			}
-
+		} else if (scan_class == SCAN_METADATA && monitor_echo(path, &changes)) {
+			/* Plex saving subtitles or artwork after our scan would otherwise ask for another one */
+			log_message(LOG_DEBUG, "Ignoring files written by Plex in %s after its scan", path);
 			changes_free(&changes);
+			free(path);
+			return;
 		} else {
 			/* Still queue a Plex scan but skip directory tree rescanning */
-			log_message(LOG_DEBUG, "File change detected in %s, skip directory rescan",
-						md->path);
+			log_message(LOG_DEBUG, "File change detected in %s, skip directory rescan", path);
 		}
+		changes_free(&changes);
 	} else {
+		/* The filesystem may have been unmounted underneath us, keep the cache as it is */
+		mounts_check();
+		if (mounts_suspended(path)) {
+			log_message(LOG_DEBUG, "Skipping refresh of %s in suspended library", path);
+			free(path);
+			return;
+		}
+
 		/* Cache check failed, fall back to targeted refresh */
-		log_message(LOG_WARNING, "Failed to check cache for %s, using targeted refresh",
-					md->path);
-		monitor_tree(md->path, md->section_id);
+		log_message(LOG_WARNING, "Failed to check cache for %s, using targeted refresh", path);
+		monitor_tree(path, server, section_id);
 	}
 
 	/* Queue event */
-	events_handle(md->path, md->section_id);
+	monitor_queue(path, server, section_id, scan_class);
+	free(path);
 }
 
-/* Process events from kqueue */
-void monitor_process(void) {
-	struct timespec timeout;
-	int nev;
+/* Monotonic clock in microseconds */
+static long long monitor_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-	/* Scale event buffer to actual need with reasonable bounds */
-	int event_capacity = active_count;
-	if (event_capacity < 16) event_capacity = 16;	/* Minimum for efficiency */
-	if (event_capacity > 256) event_capacity = 256; /* Cap to prevent excessive stack usage */
+/* Order batched events by directory, so events for the same one end up together */
+static int batch_compare(const void *a, const void *b) {
+	uintptr_t handle_a = ((const batch_event_t *) a)->handle;
+	uintptr_t handle_b = ((const batch_event_t *) b)->handle;
+	return (handle_a > handle_b) - (handle_a < handle_b);
+}
 
-	struct kevent events[event_capacity];
+/* Decaying count of the events in the last BATCH_RATE_TAU, scaled to a second */
+static void monitor_rate(int count) {
+	long long now = monitor_clock();
+	double elapsed = (now - rate_time) / 1000.0;
+	if (elapsed >= BATCH_RATE_TAU) {
+		event_rate = count * 1000.0 / elapsed;
+	} else {
+		event_rate = event_rate * (1.0 - elapsed / BATCH_RATE_TAU) + count * 1000.0 / BATCH_RATE_TAU;
+	}
+	rate_time = now;
+}
 
-	calculate_timeout(events_schedule(), &timeout);
+/* Process the batched events, each directory once with the flags of all its events */
+static void monitor_batch(void) {
+	int count = batch_count;
+	if (count == 0) {
+		return;
+	}
+	batch_count = 0;
 
-	/* Indefinite wait if no scans and no events */
-	nev = kevent(kqueue_fd, NULL, 0, events, event_capacity,
-				 (timeout.tv_sec == 0 && timeout.tv_nsec == 0) ? NULL : &timeout);
+	monitor_rate(count);
 
-	if (nev == -1) {
-		if (errno != EINTR) {
-			log_message(LOG_ERR, "Error in kevent: %s", strerror(errno));
+	if (count > 1) {
+		qsort(batch, count, sizeof(batch_event_t), batch_compare);
+	}
+
+	int directories = 0;
+	for (int i = 0; i < count;) {
+		uintptr_t handle = batch[i].handle;
+		int fflags = 0;
+		while (i < count && batch[i].handle == handle) {
+			fflags |= batch[i++].fflags;
+		}
+		directories++;
+
+		/* Events earlier in the batch may have released or moved the slot */
+		int md_idx = handle_index(handle);
+		if (md_idx < 0) {
+			log_message(LOG_DEBUG, "Dropping event for a directory no longer monitored");
+			continue;
 		}
+		last_activity = time(NULL);
+		monitor_event(md_idx, fflags);
+	}
+
+	PROBE3(batch, count, directories, (long) batch_delay);
+	batch_stats.batches++;
+	batch_stats.events += count;
+	batch_stats.directories += directories;
+	batch_stats.delay_us += batch_delay;
+	if (count > batch_stats.max_events) batch_stats.max_events = count;
+	if (batch_delay > batch_stats.max_delay_us) batch_stats.max_delay_us = batch_delay;
+	batch_delay = 0;
+}
+
+/* Under load, keep the batch open for up to the batch window to collect a larger one */
+static void monitor_gather(void) {
+	if (batch_count == 0 || g_config.batch_window <= 0) {
 		return;
 	}
 
-	/* Process received events */
-	for (int i = 0; i < nev; i++) {
-		/* Check for user events */
-		if (events[i].filter == EVFILT_USER && events[i].ident == user_event) {
-			uint32_t data = events[i].data;
+	/* The rate only moves when batches are processed, let it decay over the idle time first */
+	monitor_rate(0);
+	if (event_rate < g_config.batch_rate) {
+		return;
+	}
 
-			if (data == USER_EVENT_EXIT) {
-				g_running = 0; /* Signal to exit the main loop */
-				log_message(LOG_INFO, "Received exit event");
-			} else if (data == USER_EVENT_RELOAD) {
-				log_message(LOG_INFO, "Received reload event, reloading configuration");
-				config_load(DEFAULT_CONFIG_FILE);
-			}
-			continue;
+	long long start = monitor_clock();
+	long long end = start + g_config.batch_window * 1000LL;
+	long long now = start;
+	while (g_running && batch_count < BATCH_MAX_EVENTS && now < end) {
+		if (reactor_wait((int) ((end - now + 999) / 1000)) == -1) {
+			break;
 		}
+		now = monitor_clock();
+	}
+	batch_delay = now - start;
+}
+
+/* Log the event batching statistics */
+static void monitor_report(void) {
+	if (batch_stats.batches == 0) {
+		return;
+	}
 
-		if (events[i].flags & EV_ERROR) {
-			log_message(LOG_ERR, "Event error: %s", strerror(events[i].data));
-			int md_idx = (int) (intptr_t) events[i].udata;
-			if (md_idx >= 0 && md_idx < dirs_capacity) {
-				log_message(LOG_WARNING, "Removing invalid watch for index %d", md_idx);
-				monitor_remove(md_idx);
+	log_message(LOG_INFO, "Event batches: %ld, %.1f events and %.1f directories each (largest %d), "
+				"added latency %.1fms on average (longest %.1fms), %.0f events/s recently",
+				batch_stats.batches, (double) batch_stats.events / batch_stats.batches,
+				(double) batch_stats.directories / batch_stats.batches, batch_stats.max_events,
+				batch_stats.delay_us / 1000.0 / batch_stats.batches, batch_stats.max_delay_us / 1000.0,
+				event_rate);
+}
+
+/* Reload the configuration, re-arming poll timers and moving libraries whose profile
+ * switched between watching and polling over to the new backend */
+static void monitor_configure(void) {
+	int num_roots = 0;
+	const mount_root_t *roots = mounts_roots(&num_roots);
+
+	/* Profiles are replaced by the reload, remember which roots were watched */
+	bool *watched = num_roots > 0 ? malloc(num_roots * sizeof(bool)) : NULL;
+	for (int i = 0; watched && i < num_roots; i++) {
+		watched[i] = config_profile(roots[i].server, roots[i].section_id)->backend != BACKEND_POLL;
+	}
+
+	config_load(DEFAULT_CONFIG_FILE);
+
+	for (int i = 0; i < num_roots; i++) {
+		int server = roots[i].server;
+		int section_id = roots[i].section_id;
+		bool watch = config_profile(server, section_id)->backend != BACKEND_POLL;
+
+		if (watched && watched[i] != watch && !roots[i].suspended) {
+			/* Drop the old watches and walk again, scanning what changed while not watched */
+			log_message(LOG_INFO, "Library %s switched to %s, walking it again",
+						roots[i].path, watch ? "watching" : "polling");
+			monitor_suspend(roots[i].path);
+			if (!monitor_walk(roots[i].path, server, section_id, true, false)) {
+				log_message(LOG_WARNING, "Failed to walk library %s again", roots[i].path);
 			}
-			continue;
 		}
+		monitor_schedule(server, section_id);
+	}
 
-		int md_idx = (int) (intptr_t) events[i].udata;
-		if (md_idx < 0 || md_idx >= dirs_capacity) {
-			log_message(LOG_WARNING, "Received event for invalid directory index: %d", md_idx);
-			continue;
+	free(watched);
+}
+
+/* Handle a directory watch event delivered by the reactor */
+static void monitor_vnode(const struct kevent *kev, void *arg) {
+	(void) arg;
+
+	/* Resolve the handle, stale generations belong to released or moved slots */
+	int md_idx = handle_index((uintptr_t) kev->udata);
+
+	if (kev->flags & EV_ERROR) {
+		log_message(LOG_ERR, "Event error: %s", strerror(kev->data));
+		if (md_idx >= 0) {
+			log_message(LOG_WARNING, "Removing invalid watch for %s", dirs.path[md_idx]);
+			monitor_remove(md_idx);
 		}
+		return;
+	}
 
-		monitored_dir_t *md = &monitored_dirs[md_idx];
+	if (md_idx < 0) {
+		log_message(LOG_DEBUG, "Dropping event for a directory no longer monitored");
+		return;
+	}
 
-		/* Ensure the directory wasn't removed while the event was pending */
-		if (md && md->fd >= 0 && events[i].fflags) {
-			monitor_event(md, events[i].fflags);
+	if (kev->fflags) {
+		/* A full batch is processed at once, latency beats unbounded memory */
+		if (batch_count == BATCH_MAX_EVENTS) {
+			monitor_batch();
+		}
+		batch[batch_count].handle = (uintptr_t) kev->udata;
+		batch[batch_count].fflags = kev->fflags;
+		batch_count++;
+	}
+}
+
+/* Handle timers owned by the monitor */
+static void monitor_timer(uintptr_t ident, uint32_t data, void *arg) {
+	(void) data;
+	(void) arg;
+
+	if (ident == TIMER_MOUNTS) {
+		mounts_poll();
+	} else if (ident == TIMER_COMPACT) {
+		compact_due = true;
+	} else if (ident == TIMER_DEADLINE) {
+		armed_deadline = 0; /* Due scans are handled after the batch */
+	} else if (ident == TIMER_CRAWL) {
+		monitor_crawl();
+	} else if (ident >= TIMER_POLL_BASE) {
+		uintptr_t library = ident - TIMER_POLL_BASE;
+		monitor_poll((int) (library >> TIMER_POLL_SERVER),
+					 (int) (library & (((uintptr_t) 1 << TIMER_POLL_SERVER) - 1)));
+	}
+}
+
+/* Handle exit, reload and statistics requests */
+static void monitor_wake(uintptr_t ident, uint32_t data, void *arg) {
+	(void) ident;
+	(void) arg;
+
+	if (data & USER_EVENT_EXIT) {
+		g_running = 0; /* Signal to exit the main loop */
+		log_message(LOG_INFO, "Received exit event");
+	}
+	if (data & USER_EVENT_RELOAD) {
+		log_message(LOG_INFO, "Received reload event, reloading configuration");
+		monitor_configure();
+	}
+	if (data & USER_EVENT_DUMP) {
+		log_message(LOG_INFO, "Received dump event, reporting statistics");
+		hotspots_report();
+		monitor_report();
+	}
+}
+
+/* Keep the scan timer armed for the next due scan or rate limited dispatch */
+static void monitor_deadline(void) {
+	time_t next_scan = events_schedule();
+	time_t next_dispatch = plexapi_schedule();
+	if (next_dispatch != 0 && (next_scan == 0 || next_dispatch < next_scan)) {
+		next_scan = next_dispatch;
+	}
+
+	/* Round up to the slack grid, so deadlines in the same window share one wakeup */
+	if (next_scan != 0 && g_config.timer_slack > 1) {
+		time_t slack = g_config.timer_slack;
+		next_scan = ((next_scan + slack - 1) / slack) * slack;
+	}
+
+	/* Only touch the timer when the aligned deadline moved */
+	if (next_scan == armed_deadline) {
+		return;
+	}
+
+	if (next_scan == 0) {
+		reactor_cancel(TIMER_DEADLINE);
+		armed_deadline = 0;
+		return;
+	}
+
+	time_t now = time(NULL);
+	long delay_ms = next_scan > now ? (long) (next_scan - now) * 1000L : 0;
+	if (reactor_timer(TIMER_DEADLINE, delay_ms, false, monitor_timer, NULL)) {
+		armed_deadline = next_scan;
+	}
+}
+
+/* Wait for one batch of events and run the work it made due */
+void monitor_process(void) {
+	/* Nothing else wakes the loop for scans, so arm the deadline first */
+	monitor_deadline();
+
+	if (reactor_wait(-1) == -1) {
+		return;
+	}
+
+	/* Busy periods trade a few milliseconds for fewer passes over the same directories */
+	monitor_gather();
+	monitor_batch();
+
+	/* Watches added while handling the batch */
+	monitor_flush();
+
+	/* Compact only once events have been quiet for a while, otherwise try again later */
+	if (compact_due) {
+		compact_due = false;
+		time_t idle = time(NULL) - last_activity;
+		if (idle >= COMPACT_DELAY) {
+			monitor_compact();
+		} else {
+			compact_armed = false;
+			monitor_defer((int) (COMPACT_DELAY - idle));
 		}
 	}
 
 	/* Process any pending scans that are ready */
 	events_pending();
+
+	/* Send queued scans to each server within its rate limit */
+	plexapi_flush();
 }
 
 /* Run the filesystem event monitor loop */
@@ -522,12 +1202,305 @@ bool monitor_loop(void) {
 	return true;
 }
 
-/* Traverses a directory tree to add all subdirectories to monitoring */
-bool monitor_tree(const char *dir_path, int section_id) {
+/* Count the watched directories at or below a path */
+int monitor_weight(const char *dir_path) {
+	int count = 0;
+
+	for (int i = 0; i < dirs.capacity; i++) {
+		if (dirs.fd[i] >= 0 &&
+			(strcmp(dirs.path[i], dir_path) == 0 || path_contains(dir_path, dirs.path[i]))) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* Find the device a path lives on, from its watch or the nearest existing ancestor */
+dev_t monitor_device(const char *path) {
+	char buf[PATH_MAX_LEN];
+	struct stat st;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	while (true) {
+		int index = path_monitored(buf);
+		if (index >= 0) {
+			return dirs.device[index];
+		}
+		if (stat(buf, &st) == 0) {
+			return st.st_dev;
+		}
+
+		/* Deleted directories are scanned on the disk that held them */
+		char *slash = strrchr(buf, '/');
+		if (!slash || slash == buf) {
+			return 0;
+		}
+		*slash = '\0';
+	}
+}
+
+/* Abandon background crawls of a tree, a later walk starts over from its root */
+static void monitor_uncrawl(const char *dir_path) {
+	crawl_t **link = &crawls;
+	while (*link) {
+		crawl_t *crawl = *link;
+		if (strcmp(crawl->root, dir_path) != 0 && !path_contains(dir_path, crawl->root)) {
+			link = &crawl->next;
+			continue;
+		}
+
+		log_message(LOG_DEBUG, "Abandoning crawl of %s", crawl->root);
+		*link = crawl->next;
+		queue_free(&crawl->queue);
+		free(crawl->root);
+		free(crawl);
+	}
+
+	if (!crawls) {
+		reactor_cancel(TIMER_CRAWL);
+		if (crawl_prefetch) {
+			prefetch_stop();
+			crawl_prefetch = false;
+		}
+	}
+}
+
+/* Stop watching every directory at or below a path, keeping its cached structure */
+void monitor_suspend(const char *dir_path) {
+	int suspended = 0;
+
+	/* Directories an unfinished crawl already visited lose their watches below,
+	 * so the crawl must not be left to finish as if they were still watched */
+	monitor_uncrawl(dir_path);
+
+	for (int i = 0; i < dirs.capacity; i++) {
+		if (dirs.fd[i] >= 0 &&
+			(strcmp(dirs.path[i], dir_path) == 0 || path_contains(dir_path, dirs.path[i]))) {
+			monitor_remove(i);
+			suspended++;
+		}
+	}
+
+	log_message(LOG_INFO, "Suspended %d watched directories under %s", suspended, dir_path);
+}
+
+/* Visit one directory of a walk: refresh its cache, watch it and queue its subdirectories.
+ * Returns false when the walk cannot go on, failures below the root are only logged */
+static bool monitor_visit(const char *current_path, const char *dir_path, int server, int section_id,
+						  bool revalidate, bool is_root, queue_t *queue, int *new_count) {
+	const profile_t *profile = config_profile(server, section_id);
+	bool watch = profile->backend != BACKEND_POLL;
+
+	/* Directories reached through several symlinks are crawled only once */
+	if (!monitor_claim(current_path, server, section_id)) {
+		return true;
+	}
+
+	/* Compare against the preserved cache before refreshing it */
+	bool stale = revalidate && dircache_stale(current_path);
+
+	/* Refresh the cache for the current directory */
+	bool dir_changed;
+	dir_changes_t changes = { 0 };
+	if (!dircache_refresh(current_path, &dir_changed, &changes)) {
+		changes_free(&changes);
+		if (is_root) {
+			/* Root directory cache refresh failed */
+			log_message(LOG_ERR, "Failed to refresh cache for root directory %s", dir_path);
+			return false;
+		}
+		/* Subdirectory, continue */
+		log_message(LOG_WARNING, "Failed to refresh cache for %s", current_path);
+		return true;
+	}
+
+	/* Drop watches for directories that disappeared since the last walk */
+	for (int i = 0; i < changes.removed_count; i++) {
+		int idx = path_monitored(changes.removed[i]);
+		if (idx >= 0) {
+			monitor_remove(idx);
+		}
+		monitor_unalias(changes.removed[i]);
+	}
+	changes_free(&changes);
+
+	/* Add the current directory to monitoring if it's not already */
+	int prev_count = monitor_count();
+	int index = watch ? monitor_add(current_path, server, section_id) : -1;
+
+	/* Submit the root's watch at once, so a refused root still fails the walk */
+	if (index >= 0 && is_root) {
+		monitor_flush();
+		index = path_monitored(current_path);
+	}
+
+	if (!watch) {
+		/* Polled libraries are only tracked in the directory cache */
+	} else if (index < 0) {
+		if (is_root) {
+			/* Root directory failed to add - fatal */
+			log_message(LOG_ERR, "Failed to add root directory %s to monitoring", dir_path);
+			return false;
+		}
+		/* Subdirectory failed, continue */
+		log_message(LOG_WARNING, "Failed to add directory %s to monitoring", current_path);
+	} else if (monitor_count() > prev_count) {
+		/* Only count if it was newly added */
+		(*new_count)++;
+	}
+
+	/* Contents changed while we were not watching, let Plex catch up */
+	if (stale) {
+		monitor_queue(current_path, server, section_id, SCAN_VERIFY);
+	}
+
+	/* Get subdirectories from the now-warm cache */
+	int subdir_count = 0;
+	const char **subdirs = dircache_subdirs(current_path, &subdir_count);
+	bool success = true;
+
+	if (subdirs) {
+		/* Enqueue all found subdirectories for the next iteration */
+		for (int i = 0; i < subdir_count; i++) {
+			if (!queue_enqueue(queue, subdirs[i])) {
+				log_message(LOG_ERR, "Failed to allocate memory for directory queue");
+				success = false;
+				break;
+			}
+			prefetch_submit(subdirs[i]);
+		}
+		dircache_free(subdirs);
+	}
+
+	return success;
+}
+
+/* Report a finished walk */
+static void monitor_walked(const char *dir_path, int new_count) {
+	if (new_count > 0) {
+		log_message(LOG_INFO, "Added %d new directories under %s to monitoring",
+					new_count, dir_path);
+	}
+}
+
+/* Arm the crawl timer for the next batch */
+static void monitor_pace(long delay_ms) {
+	if (delay_ms < 1) delay_ms = 1;
+	if (!reactor_timer(TIMER_CRAWL, delay_ms, false, monitor_timer, NULL)) {
+		log_message(LOG_ERR, "Failed to register crawl timer");
+	}
+}
+
+/* Finish the oldest crawl */
+static void monitor_crawled(void) {
+	crawl_t *crawl = crawls;
+	crawls = crawl->next;
+
+	monitor_walked(crawl->root, crawl->new_count);
+	queue_free(&crawl->queue);
+	free(crawl->root);
+	free(crawl);
+
+	/* Prefetch workers live as long as there is crawling left */
+	if (!crawls && crawl_prefetch) {
+		prefetch_stop();
+		crawl_prefetch = false;
+	}
+}
+
+/* Hand the rest of a walk over to the crawl timer */
+static bool monitor_defer_walk(const char *dir_path, int server, int section_id, bool revalidate,
+							   queue_t *queue, int new_count) {
+	if (queue_empty(queue)) {
+		monitor_walked(dir_path, new_count);
+		return true;
+	}
+
+	crawl_t *crawl = calloc(1, sizeof(crawl_t));
+	char *root = strdup(dir_path);
+	if (!crawl || !root) {
+		log_message(LOG_ERR, "Failed to allocate memory for crawl of %s", dir_path);
+		free(crawl);
+		free(root);
+		return false;
+	}
+
+	crawl->queue = *queue;
+	crawl->root = root;
+	crawl->server = server;
+	crawl->section_id = section_id;
+	crawl->revalidate = revalidate;
+	crawl->new_count = new_count;
+	queue_init(queue);
+
+	/* Append so roots are crawled in the order they were walked */
+	crawl_t **tail = &crawls;
+	while (*tail) tail = &(*tail)->next;
+	bool first = crawls == NULL;
+	*tail = crawl;
+
+	if (first) {
+		monitor_pace(0);
+	}
+	return true;
+}
+
+/* Read the next batch of directories, pacing crawls by system pressure */
+static void monitor_crawl(void) {
+	int batch = 0;
+	long delay = throttle_pace(&batch);
+
+	while (crawls && batch > 0) {
+		crawl_t *crawl = crawls;
+
+		/* Drop the rest of a crawl whose filesystem went away */
+		node_t *node = mounts_suspended(crawl->root) ? NULL : queue_dequeue(&crawl->queue);
+		if (!node) {
+			monitor_crawled();
+			continue;
+		}
+
+		if (!monitor_visit(node->path, crawl->root, crawl->server, crawl->section_id, crawl->revalidate,
+						   false, &crawl->queue, &crawl->new_count)) {
+			log_message(LOG_WARNING, "Stopped crawl of %s", crawl->root);
+			free(node);
+			monitor_crawled();
+			continue;
+		}
+
+		free(node);
+		batch--;
+	}
+	monitor_flush();
+
+	if (crawls) {
+		monitor_pace(delay);
+	}
+}
+
+/* Traverses a directory tree, optionally scheduling scans for directories that changed.
+ * A throttled walk only visits the root here and crawls the rest from the event loop */
+static bool monitor_walk(const char *dir_path, int server, int section_id, bool revalidate,
+						 bool throttled) {
 	queue_t queue;
 	node_t *node;
 	int new_count = 0;
 	bool is_root = true;
+	bool success = true;
+	bool prefetching = false;
+	const profile_t *profile = config_profile(server, section_id);
+
+	/* Nothing to do while the same tree is still being crawled */
+	if (throttled) {
+		for (crawl_t *crawl = crawls; crawl; crawl = crawl->next) {
+			if (crawl->server == server && crawl->section_id == section_id &&
+				strcmp(crawl->root, dir_path) == 0) {
+				log_message(LOG_DEBUG, "Directory tree %s is still being crawled", dir_path);
+				return true;
+			}
+		}
+	}
 
 	/* Initialize queue */
 	queue_init(&queue);
@@ -538,76 +1511,121 @@ bool monitor_tree(const char *dir_path, int section_id) {
 		return false;
 	}
 
-	log_message(LOG_DEBUG, "Starting directory tree traversal from %s", dir_path);
+	log_message(LOG_DEBUG, "Starting directory tree %s from %s",
+				revalidate ? "revalidation" : "traversal", dir_path);
 
-	/* Process directories from the queue */
-	while ((node = queue_dequeue(&queue))) {
-		char *current_path = node->path;
-
-		/* Refresh the cache for the current directory */
-		bool dir_changed;
-		if (!dircache_refresh(current_path, &dir_changed, NULL)) {
-			if (is_root) {
-				/* Root directory cache refresh failed */
-				log_message(LOG_ERR, "Failed to refresh cache for root directory %s", dir_path);
-				free(node);
-				queue_free(&queue);
-				return false;
-			}
-			/* Subdirectory, continue */
-			log_message(LOG_WARNING, "Failed to refresh cache for %s", current_path);
-			free(node);
-			continue;
+	/* Read directories ahead of the crawl when the library allows it */
+	if (profile->crawl_concurrency > 1) {
+		if (!throttled) {
+			prefetching = prefetch_start(profile->crawl_concurrency - 1);
+		} else if (!crawl_prefetch) {
+			crawl_prefetch = prefetch_start(profile->crawl_concurrency - 1);
 		}
+	}
 
-		/* Add the current directory to monitoring if it's not already */
-		int prev_count = monitor_count();
-		if (monitor_add(current_path, section_id) < 0) {
-			if (is_root) {
-				/* Root directory failed to add - fatal */
-				log_message(LOG_ERR, "Failed to add root directory %s to monitoring", dir_path);
-				free(node);
-				queue_free(&queue);
-				return false;
-			}
-			/* Subdirectory failed, continue */
-			log_message(LOG_WARNING, "Failed to add directory %s to monitoring", current_path);
-		} else if (monitor_count() > prev_count) {
-			/* Only count if it was newly added */
-			new_count++;
-		}
-
-		/* Get subdirectories from the now-warm cache */
-		int subdir_count = 0;
-		const char **subdirs = dircache_subdirs(current_path, &subdir_count);
-
-		if (subdirs) {
-			/* Enqueue all found subdirectories for the next iteration */
-			for (int i = 0; i < subdir_count; i++) {
-				if (!queue_enqueue(&queue, subdirs[i])) {
-					log_message(LOG_ERR, "Failed to allocate memory for directory queue");
-					dircache_free(subdirs);
-					free(node);
-					queue_free(&queue);
-					return false;
-				}
-			}
-			dircache_free(subdirs);
-		}
+	/* Process directories from the queue */
+	while (success && (node = queue_dequeue(&queue))) {
+		success = monitor_visit(node->path, dir_path, server, section_id, revalidate, is_root,
+								&queue, &new_count);
 
 		/* After processing the root, all subsequent are subdirectories */
 		is_root = false;
-
 		free(node);
+
+		if (success && throttled) {
+			success = monitor_defer_walk(dir_path, server, section_id, revalidate, &queue, new_count);
+			break;
+		}
 	}
 
+	/* Submit the watches still queued */
+	monitor_flush();
+
 	/* Clean up queue */
+	if (prefetching) {
+		prefetch_stop();
+	}
+	if (throttled && !crawls && crawl_prefetch) {
+		prefetch_stop();
+		crawl_prefetch = false;
+	}
 	queue_free(&queue);
 
-	if (new_count > 0) {
-		log_message(LOG_INFO, "Added %d new directories under %s to monitoring",
-					new_count, dir_path);
+	if (!throttled) {
+		monitor_walked(dir_path, new_count);
 	}
 
-	return true;
+	return success;
+}
+
+/* Traverses a directory tree to add all subdirectories to monitoring */
+bool monitor_tree(const char *dir_path, int server, int section_id) {
+	return monitor_walk(dir_path, server, section_id, false, false);
+}
+
+/* Re-attaches a directory tree, scanning only directories whose mtime moved on.
+ * Runs as a background crawl paced by system pressure */
+bool monitor_revalidate(const char *dir_path, int server, int section_id) {
+	return monitor_walk(dir_path, server, section_id, true, true);
+}
+
+/* Arm or disarm the poll timer of a library section according to its profile */
+void monitor_schedule(int server, int section_id) {
+	const profile_t *profile = config_profile(server, section_id);
+	uintptr_t ident = TIMER_POLL_BASE + ((uintptr_t) server << TIMER_POLL_SERVER) + (uintptr_t) section_id;
+
+	if (kqueue_fd == -1) return;
+
+	if (profile->backend == BACKEND_WATCH) {
+		reactor_cancel(ident);
+		return;
+	}
+
+	if (!reactor_timer(ident, profile->poll_interval * 1000L, true, monitor_timer, NULL)) {
+		log_message(LOG_ERR, "Failed to register poll timer for section %d", section_id);
+		return;
+	}
+
+	log_message(LOG_DEBUG, "Polling section %d every %ds", section_id, profile->poll_interval);
+}
+
+/* Poll every root of a library section for changes against the cache */
+static void monitor_poll(int server, int section_id) {
+	int num_roots = 0;
+	const mount_root_t *roots = mounts_roots(&num_roots);
+
+	for (int i = 0; i < num_roots; i++) {
+		if (roots[i].server != server || roots[i].section_id != section_id || roots[i].suspended) {
+			continue;
+		}
+
+		log_message(LOG_DEBUG, "Polling library %s for changes", roots[i].path);
+		if (!monitor_revalidate(roots[i].path, server, section_id)) {
+			log_message(LOG_WARNING, "Failed to poll library %s", roots[i].path);
+		}
+	}
+}
+
+/* Start monitoring a library root with the backend chosen by its profile */
+bool monitor_library(const char *path, int server, int section_id) {
+	/* Path profiles are looked up by section from here on */
+	config_bind(path, server, section_id);
+
+	/* A supervisor only hands libraries out to its workers */
+	if (shard_supervisor()) {
+		return shard_assign(path, server, section_id);
+	}
+
+	/* Restore what the previous run saved for this root, whichever process watched it */
+	persist_load(path, server);
+
+	/* The initial crawl yields to live events and to the rest of the system,
+	 * a restored cache is checked against the disk for changes made meanwhile */
+	bool success = monitor_walk(path, server, section_id, dircache_cached(path), true);
+
+	/* Follow the filesystem holding the library across unmounts and remounts */
+	mounts_track(path, server, section_id);
+
+	monitor_schedule(server, section_id);
+	return success;
 }
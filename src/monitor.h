@@ -3,25 +3,86 @@
 
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+#include "queue.h"
+
 #define INITIAL_MONITOR_CAPACITY 256       /* Initial size for monitored directories array */
-#define USER_EVENT_EXIT 1                  /* User event identifier for exit signal */
-#define USER_EVENT_RELOAD 2                /* User event identifier for reload signal */
+#define MONITOR_INDEX_BITS 24              /* Slot index bits in a directory handle */
+#define MONITOR_MAX_CAPACITY (1 << MONITOR_INDEX_BITS) /* Maximum number of monitored directories */
+#define COMPACT_DELAY 60                   /* Seconds without events before compacting the table */
+#define WATCH_BATCH 512                    /* Watch registrations submitted per kevent call */
+#define BATCH_MAX_EVENTS 4096              /* Directory events collected into one batch at most */
+#define BATCH_RATE_TAU 1000                /* Milliseconds the event rate is averaged over */
+#define USER_EVENT_EXIT 0x1                /* Wake bit for exit signal */
+#define USER_EVENT_RELOAD 0x2              /* Wake bit for reload signal */
+#define USER_EVENT_DUMP 0x4                /* Wake bit for statistics dump */
+#define TIMER_MOUNTS 1                     /* Timer identifier for mount table polling */
+#define TIMER_COMPACT 2                    /* Timer identifier for directory table compaction */
+#define TIMER_DEADLINE 3                   /* Timer identifier for the next due scan */
+#define TIMER_CRAWL 4                      /* Timer identifier for the next background crawl batch */
+#define TIMER_POLL_BASE 1000               /* Timer identifier base for per-section polling */
+#define TIMER_POLL_SERVER 24               /* Bit position of the server in a poll timer identifier */
 
 /* Global variables */
-extern uintptr_t user_event;               /* Global user event identifier for kqueue */
 extern volatile sig_atomic_t g_running;    /* Global running flag for signal safety */
 
-/* Structure to hold a monitored directory */
-typedef struct {
-	int fd;                                /* File descriptor for kqueue monitoring */
-	const char *path;                      /* Full path to the monitored directory */
+/* Struct-of-arrays table of monitored directories, hot fields first */
+typedef struct monitored_dirs {
+	int *fd;                               /* File descriptor for kqueue monitoring, -1 if free */
+	int *section_id;                       /* Associated Plex library section ID */
+	int *server;                           /* Index of the Plex server reporting the section */
+	uint32_t *generation;                  /* Bumped whenever a slot is released or moved */
+	const char **path;                     /* Full path to the monitored directory */
+	dev_t *device;                         /* Device ID for path validation */
+	ino_t *inode;                          /* Inode number for path validation */
+	int *next_free;                        /* For free-list management of the slots */
+	int capacity;                          /* Number of allocated slots */
+	int active;                            /* Number of slots in use */
+	int free_head;                         /* Head of the free list for empty slots */
+} monitored_dirs_t;
+
+/* Directory event waiting in the current batch */
+typedef struct batch_event {
+	uintptr_t handle;                      /* Generation tagged handle of the directory */
+	int fflags;                            /* Vnode event flags */
+} batch_event_t;
+
+/* Event batching statistics since startup */
+typedef struct batch_stats {
+	long batches;                          /* Batches processed */
+	long events;                           /* Directory events received */
+	long directories;                      /* Directories processed after merging events */
+	int max_events;                        /* Largest batch */
+	long long delay_us;                    /* Latency added by holding batches open */
+	long long max_delay_us;                /* Longest a batch was held open */
+} batch_stats_t;
+
+/* Identity of a directory, shared by every path that leads to it */
+typedef struct dir_identity {
+	dev_t device;                          /* Device ID */
+	ino_t inode;                           /* Inode number */
+} dir_identity_t;
+
+/* Library path leading through a symlink to a directory crawled under another path */
+typedef struct monitor_alias {
+	char *path;                            /* Path as seen by the library */
+	char *target;                          /* Path the directory is crawled and watched under */
+	int server;                            /* Plex server of the alias path's library */
+	int section_id;                        /* Library section ID of the alias path */
+} monitor_alias_t;
+
+/* Background crawl of a directory tree, paced by system pressure */
+typedef struct crawl {
+	queue_t queue;                         /* Directories left to visit */
+	char *root;                            /* Directory the crawl started from */
+	int server;                            /* Index of the Plex server reporting the section */
 	int section_id;                        /* Associated Plex library section ID */
-	dev_t device;                          /* Device ID for path validation */
-	ino_t inode;                           /* Inode number for path validation */
-	int next_free;                         /* For free-list management of the directories array */
-} monitored_dir_t;
+	bool revalidate;                       /* Whether stale directories get verification scans */
+	int new_count;                         /* Directories newly added to monitoring */
+	struct crawl *next;                    /* Next crawl in line */
+} crawl_t;
 
 /* Monitor lifecycle management */
 bool monitor_init(void);
@@ -32,13 +93,20 @@ void monitor_exit(void);
 bool monitor_loop(void);
 void monitor_process(void);
 void monitor_reload(void);
+void monitor_dump(void);
 int monitor_kqueue(void);
 
 /* Directory management */
-int monitor_add(const char *path, int section_id);
+int monitor_add(const char *path, int server, int section_id);
 void monitor_remove(int index);
 int monitor_count(void);
+int monitor_weight(const char *dir_path);
+dev_t monitor_device(const char *path);
 bool monitor_validate(const char *path);
-bool monitor_tree(const char *dir_path, int section_id);
+bool monitor_library(const char *path, int server, int section_id);
+void monitor_schedule(int server, int section_id);
+bool monitor_tree(const char *dir_path, int server, int section_id);
+bool monitor_revalidate(const char *dir_path, int server, int section_id);
+void monitor_suspend(const char *dir_path);
 
 #endif /* MONITOR_H */
@@ -0,0 +1,268 @@
+#include "mounts.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/ucred.h>
+#include <sys/mount.h>
+
+#include "events.h"
+#include "logger.h"
+#include "monitor.h"
+#include "utilities.h"
+
+/* Structure to hold a snapshot of the mount table */
+typedef struct mount_table {
+	char **mountpoints;                /* Array of mount point paths */
+	int count;                         /* Number of mount points */
+	int capacity;                      /* Allocated capacity of `mountpoints` */
+} mount_table_t;
+
+static mount_root_t *roots = NULL;     /* Array of tracked library roots */
+static int num_roots = 0;              /* Current number of tracked roots */
+static int roots_capacity = 0;         /* Allocated capacity of roots array */
+static time_t last_check = 0;          /* Time of the last mount table check */
+
+/* Append a mount point to the table */
+static bool table_add(mount_table_t *table, const char *mountpoint) {
+	if (table->count >= table->capacity) {
+		int new_capacity = table->capacity > 0 ? table->capacity * 2 : 32;
+		char **new_list = realloc(table->mountpoints, new_capacity * sizeof(char *));
+		if (!new_list) {
+			log_message(LOG_ERR, "Failed to allocate memory for mount table");
+			return false;
+		}
+		table->mountpoints = new_list;
+		table->capacity = new_capacity;
+	}
+
+	char *copy = strdup(mountpoint);
+	if (!copy) {
+		log_message(LOG_ERR, "Failed to allocate memory for mount point");
+		return false;
+	}
+
+	table->mountpoints[table->count++] = copy;
+	return true;
+}
+
+/* Free a mount table snapshot */
+static void table_free(mount_table_t *table) {
+	for (int i = 0; i < table->count; i++) {
+		free(table->mountpoints[i]);
+	}
+	free(table->mountpoints);
+	table->mountpoints = NULL;
+	table->count = 0;
+	table->capacity = 0;
+}
+
+/* Read the mount table with getmntinfo() */
+static bool table_read(mount_table_t *table) {
+	struct statfs *mounts;
+	int count = getmntinfo(&mounts, MNT_NOWAIT);
+	if (count == 0) {
+		log_message(LOG_ERR, "Failed to read mount table: %s", strerror(errno));
+		return false;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (!table_add(table, mounts[i].f_mntonname)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Find the deepest mount point that contains a path */
+static const char *table_lookup(const mount_table_t *table, const char *path) {
+	const char *best = NULL;
+	size_t best_len = 0;
+
+	for (int i = 0; i < table->count; i++) {
+		const char *mountpoint = table->mountpoints[i];
+		size_t len = strlen(mountpoint);
+
+		if ((strcmp(mountpoint, "/") == 0 || path_contains(mountpoint, path)) &&
+			(!best || len > best_len)) {
+			best = mountpoint;
+			best_len = len;
+		}
+	}
+
+	return best;
+}
+
+/* Initialize mount tracking */
+bool mounts_init(void) {
+	log_message(LOG_INFO, "Initializing mount tracking");
+
+	roots_capacity = 8;
+	roots = malloc(roots_capacity * sizeof(mount_root_t));
+	if (!roots) {
+		log_message(LOG_ERR, "Failed to allocate memory for tracked roots");
+		return false;
+	}
+
+	num_roots = 0;
+	last_check = 0;
+
+	return true;
+}
+
+/* Clean up mount tracking */
+void mounts_cleanup(void) {
+	log_message(LOG_INFO, "Cleaning up mount tracking");
+
+	for (int i = 0; i < num_roots; i++) {
+		free(roots[i].path);
+		free(roots[i].mountpoint);
+	}
+	free(roots);
+	roots = NULL;
+	num_roots = 0;
+	roots_capacity = 0;
+}
+
+/* Start tracking the mount that holds a library root */
+bool mounts_track(const char *path, int server, int section_id) {
+	mount_table_t table = { 0 };
+
+	if (!roots) {
+		return false;
+	}
+
+	if (!table_read(&table)) {
+		table_free(&table);
+		return false;
+	}
+
+	const char *mountpoint = table_lookup(&table, path);
+	if (!mountpoint) {
+		log_message(LOG_WARNING, "No mount point found for %s", path);
+		table_free(&table);
+		return false;
+	}
+
+	if (num_roots >= roots_capacity) {
+		int new_capacity = roots_capacity * 2;
+		mount_root_t *new_roots = realloc(roots, new_capacity * sizeof(mount_root_t));
+		if (!new_roots) {
+			log_message(LOG_ERR, "Failed to allocate memory for tracked roots");
+			table_free(&table);
+			return false;
+		}
+		roots = new_roots;
+		roots_capacity = new_capacity;
+	}
+
+	mount_root_t *root = &roots[num_roots];
+	root->path = strdup(path);
+	root->mountpoint = strdup(mountpoint);
+	root->server = server;
+	root->section_id = section_id;
+	root->suspended = false;
+	table_free(&table);
+
+	if (!root->path || !root->mountpoint) {
+		log_message(LOG_ERR, "Failed to allocate memory for tracked root");
+		free(root->path);
+		free(root->mountpoint);
+		return false;
+	}
+
+	num_roots++;
+	log_message(LOG_DEBUG, "Library root %s is on mount %s", root->path, root->mountpoint);
+	return true;
+}
+
+/* Suspend a library root whose filesystem went away */
+static void mounts_suspend(mount_root_t *root) {
+	log_message(LOG_WARNING, "Mount %s for library %s disappeared, suspending monitoring",
+				root->mountpoint, root->path);
+
+	root->suspended = true;
+	monitor_suspend(root->path);
+	events_discard(root->path);
+}
+
+/* Resume a library root after its filesystem came back */
+static void mounts_resume(mount_root_t *root, const char *mountpoint) {
+	log_message(LOG_INFO, "Mount %s for library %s is available, revalidating cache",
+				mountpoint, root->path);
+
+	char *copy = strdup(mountpoint);
+	if (copy) {
+		free(root->mountpoint);
+		root->mountpoint = copy;
+	}
+
+	root->suspended = false;
+	if (!monitor_revalidate(root->path, root->server, root->section_id)) {
+		log_message(LOG_WARNING, "Failed to revalidate library %s", root->path);
+	}
+}
+
+/* Compare tracked roots against the current mount table */
+void mounts_poll(void) {
+	mount_table_t table = { 0 };
+
+	if (num_roots == 0) {
+		return;
+	}
+
+	last_check = time(NULL);
+
+	if (!table_read(&table)) {
+		table_free(&table);
+		return;
+	}
+
+	for (int i = 0; i < num_roots; i++) {
+		mount_root_t *root = &roots[i];
+		const char *mountpoint = table_lookup(&table, root->path);
+		if (!mountpoint || strcmp(mountpoint, root->mountpoint) == 0) {
+			if (mountpoint && root->suspended) {
+				mounts_resume(root, mountpoint);
+			}
+			continue;
+		}
+
+		if (strlen(mountpoint) > strlen(root->mountpoint)) {
+			/* A filesystem was mounted over the root, e.g. a disk attached late */
+			mounts_resume(root, mountpoint);
+		} else if (!root->suspended) {
+			/* The filesystem holding the root was unmounted */
+			mounts_suspend(root);
+		}
+	}
+
+	table_free(&table);
+}
+
+/* Check the mount table unless it was checked very recently */
+void mounts_check(void) {
+	if (time(NULL) - last_check >= MOUNT_CHECK_INTERVAL) {
+		mounts_poll();
+	}
+}
+
+/* Check if a path lies in a suspended library root */
+bool mounts_suspended(const char *path) {
+	for (int i = 0; i < num_roots; i++) {
+		if (roots[i].suspended &&
+			(strcmp(roots[i].path, path) == 0 || path_contains(roots[i].path, path))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Get the tracked library roots */
+const mount_root_t *mounts_roots(int *count) {
+	*count = num_roots;
+	return roots;
+}
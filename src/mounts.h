@@ -0,0 +1,30 @@
+#ifndef MOUNTS_H
+#define MOUNTS_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/* Mount tracking configuration */
+#define MOUNT_CHECK_INTERVAL 1         /* Minimum seconds between event-triggered checks */
+
+/* Structure to track the mount holding a library root */
+typedef struct mount_root {
+	char *path;                        /* Library root path */
+	char *mountpoint;                  /* Mount point that holds the root when healthy */
+	int server;                        /* Index of the Plex server reporting the library */
+	int section_id;                    /* Associated Plex library section ID on that server */
+	bool suspended;                    /* Whether the subtree is suspended after unmount */
+} mount_root_t;
+
+/* Mount tracking lifecycle */
+bool mounts_init(void);
+void mounts_cleanup(void);
+
+/* Mount tracking operations */
+bool mounts_track(const char *path, int server, int section_id);
+void mounts_poll(void);
+void mounts_check(void);
+bool mounts_suspended(const char *path);
+const mount_root_t *mounts_roots(int *count);
+
+#endif /* MOUNTS_H */
@@ -0,0 +1,528 @@
+#include "persist.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dircache.h"
+#include "events.h"
+#include "logger.h"
+#include "mounts.h"
+#include "reactor.h"
+#include "utilities.h"
+
+/* Static variables for persistence implementation */
+static bool started = false;			/* Whether snapshots are being taken */
+static pid_t writer_pid = 0;			/* Background snapshot writer, 0 if none */
+static int writer_fd = -1;				/* Read end of the writer's status pipe */
+static time_t writer_started = 0;		/* Time the running snapshot was started */
+static char *buffer = NULL;				/* Output buffer, allocated before forking */
+static restored_scan_t *restored = NULL; /* Scans waiting to be queued again */
+static int num_restored = 0;			/* Number of waiting scans */
+
+/* Build the state file path of a library root, named by a hash of the root so the
+ * state follows it to whichever process watches it after a restart or rebalance */
+static void persist_path(char *buf, size_t size, const char *root, int server, const char *suffix) {
+	uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+	for (const unsigned char *c = (const unsigned char *) root; *c; c++) {
+		hash = (hash ^ *c) * 1099511628211ULL;
+	}
+	hash = (hash ^ (uint64_t) server) * 1099511628211ULL;
+	snprintf(buf, size, "%s.%016llx%s", g_config.state_file, (unsigned long long) hash, suffix);
+}
+
+/* Check whether a path lies at or below a library root */
+static bool persist_within(const char *root, const char *path) {
+	return strcmp(root, path) == 0 || path_contains(root, path);
+}
+
+/* Write out the buffered part of a snapshot */
+static void persist_drain(persist_out_t *out) {
+	size_t done = 0;
+	while (out->err == 0 && done < out->len) {
+		ssize_t written = write(out->fd, out->buf + done, out->len - done);
+		if (written < 0) {
+			if (errno != EINTR) out->err = errno;
+		} else {
+			done += (size_t) written;
+		}
+	}
+	out->len = 0;
+}
+
+/* Append bytes to a snapshot, stdio is avoided since the writer is a forked child */
+static void persist_put(persist_out_t *out, const void *data, size_t size) {
+	const char *bytes = data;
+	while (size > 0 && out->err == 0) {
+		size_t chunk = PERSIST_BUFFER - out->len;
+		if (chunk > size) chunk = size;
+		memcpy(out->buf + out->len, bytes, chunk);
+		out->len += chunk;
+		bytes += chunk;
+		size -= chunk;
+		if (out->len == PERSIST_BUFFER) {
+			persist_drain(out);
+		}
+	}
+}
+
+/* Write one cached directory, subdirectories are stored by name */
+static void persist_dir(const cached_dir_t *dir, void *arg) {
+	persist_out_t *out = arg;
+	if (!persist_within(out->root, dir->path)) {
+		return;
+	}
+
+	uint8_t tag = PERSIST_DIR;
+	int64_t mtime = dir->mtime;
+	int32_t media_files = dir->media_files;
+	int32_t other_files = dir->other_files;
+	uint32_t count = dir->subdirs ? kh_size(dir->subdirs) : 0;
+	size_t path_len = strlen(dir->path);
+	uint16_t len = (uint16_t) path_len;
+
+	persist_put(out, &tag, sizeof(tag));
+	persist_put(out, &mtime, sizeof(mtime));
+	persist_put(out, &media_files, sizeof(media_files));
+	persist_put(out, &other_files, sizeof(other_files));
+	persist_put(out, &count, sizeof(count));
+	persist_put(out, &len, sizeof(len));
+	persist_put(out, dir->path, len);
+
+	if (count == 0) {
+		return;
+	}
+	for (khint_t k = kh_begin(dir->subdirs); k != kh_end(dir->subdirs); ++k) {
+		if (!kh_exist(dir->subdirs, k)) continue;
+
+		/* Keys are the directory path, a slash and the name */
+		const char *name = kh_key(dir->subdirs, k) + path_len + 1;
+		uint16_t name_len = (uint16_t) strlen(name);
+		persist_put(out, &name_len, sizeof(name_len));
+		persist_put(out, name, name_len);
+	}
+}
+
+/* Write one pending scan */
+static void persist_scan(const pending_t *scan, void *arg) {
+	persist_out_t *out = arg;
+	if (scan->server != out->server || !persist_within(out->root, scan->path)) {
+		return;
+	}
+
+	uint8_t tag = PERSIST_SCAN;
+	int32_t server = scan->server;
+	int32_t section_id = scan->section_id;
+	int32_t scan_class = scan->scan_class;
+	uint16_t len = (uint16_t) strlen(scan->path);
+
+	persist_put(out, &tag, sizeof(tag));
+	persist_put(out, &server, sizeof(server));
+	persist_put(out, &section_id, sizeof(section_id));
+	persist_put(out, &scan_class, sizeof(scan_class));
+	persist_put(out, &len, sizeof(len));
+	persist_put(out, scan->path, len);
+}
+
+/* Write a complete snapshot of one root next to its state file and move it into place, returns an errno */
+static int persist_root(const mount_root_t *root) {
+	char tmp_path[PATH_MAX_LEN + 32];
+	char final_path[PATH_MAX_LEN + 32];
+	persist_path(tmp_path, sizeof(tmp_path), root->path, root->server, ".tmp");
+	persist_path(final_path, sizeof(final_path), root->path, root->server, "");
+
+	persist_out_t out = { .buf = buffer, .len = 0, .err = 0, .root = root->path, .server = root->server };
+	out.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out.fd < 0) {
+		return errno;
+	}
+
+	uint32_t version = PERSIST_VERSION;
+	uint8_t end = PERSIST_END;
+	persist_put(&out, PERSIST_MAGIC, 8);
+	persist_put(&out, &version, sizeof(version));
+	dircache_each(persist_dir, &out);
+	events_each(persist_scan, &out);
+	persist_put(&out, &end, sizeof(end));
+	persist_drain(&out);
+
+	/* Only a complete and synced file may replace the previous snapshot */
+	int err = out.err;
+	if (err == 0 && fsync(out.fd) != 0) {
+		err = errno;
+	}
+	if (close(out.fd) != 0 && err == 0) {
+		err = errno;
+	}
+	if (err == 0 && rename(tmp_path, final_path) != 0) {
+		err = errno;
+	}
+	if (err != 0) {
+		unlink(tmp_path);
+		return err;
+	}
+
+	/* Make the rename itself durable */
+	char *slash = strrchr(final_path, '/');
+	if (slash) {
+		*(slash == final_path ? slash + 1 : slash) = '\0';
+		int dir_fd = open(final_path, O_RDONLY);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+	}
+
+	return 0;
+}
+
+/* Write a snapshot of every library root this process watches, returns the first errno */
+static int persist_write(void) {
+	int num_roots = 0;
+	const mount_root_t *roots = mounts_roots(&num_roots);
+
+	for (int i = 0; i < num_roots; i++) {
+		int err = persist_root(&roots[i]);
+		if (err != 0) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+/* Allocate the output buffer, kept for later snapshots */
+static bool persist_buffer(void) {
+	if (!buffer) {
+		buffer = malloc(PERSIST_BUFFER);
+		if (!buffer) {
+			log_message(LOG_ERR, "Failed to allocate state snapshot buffer");
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Collect the result of a background snapshot */
+static void persist_done(uintptr_t ident, uint32_t data, void *arg) {
+	(void) ident;
+	(void) data;
+	(void) arg;
+
+	int err = -1;
+	ssize_t len = read(writer_fd, &err, sizeof(err));
+
+	reactor_unwatch(writer_fd);
+	close(writer_fd);
+	writer_fd = -1;
+	waitpid(writer_pid, NULL, 0); /* Already reaped when SIGCHLD is ignored */
+	writer_pid = 0;
+
+	if (len == sizeof(err) && err == 0) {
+		log_message(LOG_INFO, "Saved state in %lds", (long) (time(NULL) - writer_started));
+	} else {
+		log_message(LOG_WARNING, "Failed to save state: %s",
+					len == sizeof(err) ? strerror(err) : "writer exited early");
+	}
+}
+
+/* Write a snapshot from a forked copy of the process, the loop keeps running meanwhile */
+void persist_save(void) {
+	int pipefd[2];
+
+	if (writer_pid > 0) {
+		log_message(LOG_DEBUG, "Previous state snapshot still being written");
+		return;
+	}
+
+	if (!persist_buffer()) {
+		return;
+	}
+
+	if (pipe(pipefd) == -1) {
+		log_message(LOG_ERR, "Failed to create snapshot pipe: %s", strerror(errno));
+		return;
+	}
+
+	/* The child sees the state as of the fork, pages are copied only as the parent changes them */
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_message(LOG_ERR, "Failed to fork snapshot writer: %s", strerror(errno));
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		close(pipefd[0]);
+		int err = persist_write();
+		ssize_t written = write(pipefd[1], &err, sizeof(err));
+		(void) written;
+		_exit(err == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	close(pipefd[1]);
+	writer_pid = pid;
+	writer_fd = pipefd[0];
+	writer_started = time(NULL);
+
+	if (!reactor_fd(writer_fd, REACTOR_READ, persist_done, NULL)) {
+		log_message(LOG_ERR, "Failed to watch snapshot writer");
+	}
+}
+
+/* Take a snapshot on the timer */
+static void persist_tick(uintptr_t ident, uint32_t data, void *arg) {
+	(void) ident;
+	(void) data;
+	(void) arg;
+
+	persist_save();
+}
+
+/* Read exactly `size` bytes */
+static bool persist_read(FILE *fp, void *buf, size_t size) {
+	return fread(buf, 1, size, fp) == size;
+}
+
+/* Read a length-prefixed string, allocated to fit since pending paths have no length limit */
+static char *persist_string(FILE *fp) {
+	uint16_t len;
+	if (!persist_read(fp, &len, sizeof(len))) {
+		return NULL;
+	}
+
+	char *buf = malloc((size_t) len + 1);
+	if (!buf) {
+		log_message(LOG_ERR, "Failed to allocate memory for restored path");
+		return NULL;
+	}
+	if (!persist_read(fp, buf, len)) {
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+/* Read one cached directory record, restoring it if it lies in the root being loaded */
+static bool persist_load_dir(FILE *fp, const char *root, int *dirs) {
+	int64_t mtime;
+	int32_t media_files, other_files;
+	uint32_t count;
+
+	if (!persist_read(fp, &mtime, sizeof(mtime)) || !persist_read(fp, &media_files, sizeof(media_files)) ||
+		!persist_read(fp, &other_files, sizeof(other_files)) || !persist_read(fp, &count, sizeof(count))) {
+		return false;
+	}
+
+	char *path = persist_string(fp);
+	if (!path) {
+		return false;
+	}
+
+	char **subdirs = count > 0 ? malloc(count * sizeof(char *)) : NULL;
+	if (count > 0 && !subdirs) {
+		log_message(LOG_ERR, "Failed to allocate memory for restored subdirectories");
+		free(path);
+		return false;
+	}
+
+	uint32_t filled = 0;
+	bool success = true;
+	for (; filled < count; filled++) {
+		char *name = persist_string(fp);
+		if (!name) {
+			success = false;
+			break;
+		}
+		size_t len = strlen(path) + strlen(name) + 2;
+		subdirs[filled] = malloc(len);
+		if (!subdirs[filled]) {
+			free(name);
+			success = false;
+			break;
+		}
+		snprintf(subdirs[filled], len, "%s/%s", path, name);
+		free(name);
+	}
+
+	if (!success) {
+		for (uint32_t i = 0; i < filled; i++) {
+			free(subdirs[i]);
+		}
+		free(subdirs);
+		free(path);
+		return false;
+	}
+
+	if (persist_within(root, path)) {
+		dircache_restore(path, (time_t) mtime, media_files, other_files, subdirs, (int) count);
+		(*dirs)++;
+	} else {
+		for (uint32_t i = 0; i < count; i++) {
+			free(subdirs[i]);
+		}
+	}
+	free(subdirs);
+	free(path);
+	return true;
+}
+
+/* Read one pending scan record of the root being loaded, kept until the libraries are bound */
+static bool persist_load_scan(FILE *fp, const char *root, int root_server, int *scans) {
+	int32_t server, section_id, scan_class;
+
+	if (!persist_read(fp, &server, sizeof(server)) ||
+		!persist_read(fp, &section_id, sizeof(section_id)) ||
+		!persist_read(fp, &scan_class, sizeof(scan_class))) {
+		return false;
+	}
+
+	char *path = persist_string(fp);
+	if (!path) {
+		return false;
+	}
+	if (scan_class < 0 || scan_class >= SCAN_CLASSES || server != root_server || !persist_within(root, path)) {
+		free(path);
+		return true;
+	}
+	(*scans)++;
+
+	/* Roots bound after startup queue their scans at once */
+	if (started) {
+		events_handle(path, server, section_id, (scan_class_t) scan_class);
+		free(path);
+		return true;
+	}
+
+	restored_scan_t *grown = realloc(restored, (num_restored + 1) * sizeof(restored_scan_t));
+	if (!grown) {
+		log_message(LOG_WARNING, "Failed to allocate memory for restored scan %s", path);
+		free(path);
+		return true;
+	}
+	restored = grown;
+	restored[num_restored].path = path;
+	restored[num_restored].server = server;
+	restored[num_restored].section_id = section_id;
+	restored[num_restored].scan_class = (scan_class_t) scan_class;
+	num_restored++;
+	return true;
+}
+
+/* Restore the directory cache and pending scans saved for a library root by the previous run,
+ * entries of other roots are dropped */
+void persist_load(const char *root, int server) {
+	char path[PATH_MAX_LEN + 32];
+	char magic[8];
+	uint32_t version;
+	uint8_t tag;
+	int dirs = 0;
+	int scans = 0;
+	bool complete = false;
+
+	if (g_config.state_file[0] == '\0') {
+		return;
+	}
+
+	persist_path(path, sizeof(path), root, server, "");
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		if (errno != ENOENT) {
+			log_message(LOG_WARNING, "Failed to open state file %s: %s", path, strerror(errno));
+		}
+		return;
+	}
+	setvbuf(fp, NULL, _IOFBF, PERSIST_BUFFER);
+
+	if (!persist_read(fp, magic, sizeof(magic)) || memcmp(magic, PERSIST_MAGIC, sizeof(magic)) != 0 ||
+		!persist_read(fp, &version, sizeof(version)) || version != PERSIST_VERSION) {
+		log_message(LOG_WARNING, "Ignoring state file %s with unknown format", path);
+		fclose(fp);
+		return;
+	}
+
+	while (persist_read(fp, &tag, sizeof(tag))) {
+		if (tag == PERSIST_END) {
+			complete = true;
+			break;
+		} else if (tag == PERSIST_DIR) {
+			if (!persist_load_dir(fp, root, &dirs)) break;
+		} else if (tag != PERSIST_SCAN || !persist_load_scan(fp, root, server, &scans)) {
+			break;
+		}
+	}
+	fclose(fp);
+
+	if (!complete) {
+		log_message(LOG_WARNING, "State file %s is incomplete, restored what was readable", path);
+	}
+	log_message(LOG_INFO, "Restored %d cached directories and %d pending scans of %s from %s",
+				dirs, scans, root, path);
+}
+
+/* Queue restored scans and start taking snapshots */
+bool persist_start(void) {
+	for (int i = 0; i < num_restored; i++) {
+		events_handle(restored[i].path, restored[i].server, restored[i].section_id,
+					  restored[i].scan_class);
+		free(restored[i].path);
+	}
+	free(restored);
+	restored = NULL;
+	num_restored = 0;
+
+	if (g_config.state_file[0] == '\0') {
+		return true;
+	}
+
+	if (g_config.state_interval > 0 &&
+		!reactor_timer(TIMER_PERSIST, g_config.state_interval * 1000L, true, persist_tick, NULL)) {
+		log_message(LOG_ERR, "Failed to register state snapshot timer");
+		return false;
+	}
+
+	started = true;
+	return true;
+}
+
+/* Wait for a running snapshot and write the final one in the foreground */
+void persist_cleanup(void) {
+	for (int i = 0; i < num_restored; i++) {
+		free(restored[i].path);
+	}
+	free(restored);
+	restored = NULL;
+	num_restored = 0;
+
+	if (!started) {
+		return;
+	}
+	started = false;
+
+	reactor_cancel(TIMER_PERSIST);
+	if (writer_pid > 0) {
+		reactor_unwatch(writer_fd);
+		close(writer_fd);
+		writer_fd = -1;
+		waitpid(writer_pid, NULL, 0);
+		writer_pid = 0;
+	}
+
+	/* Nothing changes the state any more, no need for a copy */
+	int err = persist_buffer() ? persist_write() : ENOMEM;
+	free(buffer);
+	buffer = NULL;
+	if (err != 0) {
+		log_message(LOG_WARNING, "Failed to save state: %s", strerror(err));
+	} else {
+		log_message(LOG_INFO, "Saved state for the next start");
+	}
+}
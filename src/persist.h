@@ -0,0 +1,46 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "config.h"
+
+/* State file configuration */
+#define PERSIST_MAGIC "PLXSTATE"       /* File signature, 8 bytes without terminator */
+#define PERSIST_VERSION 2              /* Format version, bumped on incompatible changes */
+#define PERSIST_BUFFER (1 << 20)       /* Write buffer of the snapshot writer */
+#define TIMER_PERSIST 90               /* Timer identifier for periodic snapshots */
+
+/* Record tags, each record starts with one */
+#define PERSIST_DIR 'D'                /* Cached directory with its subdirectory names */
+#define PERSIST_SCAN 'P'               /* Pending scan */
+#define PERSIST_END 'E'                /* End of a complete snapshot */
+
+/* Snapshot being written, buffered by hand since the writer runs in a forked child */
+typedef struct persist_out {
+	int fd;                            /* Temporary state file */
+	char *buf;                         /* Output buffer of PERSIST_BUFFER bytes */
+	size_t len;                        /* Bytes waiting in the buffer */
+	int err;                           /* First write error, 0 if none */
+	const char *root;                  /* Library root the snapshot covers */
+	int server;                        /* Index of the Plex server reporting the root */
+} persist_out_t;
+
+/* Pending scan read from the state file, queued once libraries are bound */
+typedef struct restored_scan {
+	char *path;                        /* Directory to scan */
+	int server;                        /* Index of the Plex server reporting the library */
+	int section_id;                    /* Associated Plex library section ID on that server */
+	scan_class_t scan_class;           /* Class of change the scan covers */
+} restored_scan_t;
+
+/* State persistence lifecycle */
+void persist_load(const char *root, int server);
+bool persist_start(void);
+void persist_cleanup(void);
+
+/* Write a snapshot from a forked copy of the process */
+void persist_save(void);
+
+#endif /* PERSIST_H */
@@ -2,16 +2,52 @@
 
 #include <curl/curl.h>
 #include <json-c/json.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "events.h"
 #include "logger.h"
 #include "monitor.h"
-
-static CURL *curl_handle = NULL;           /* CURL handle */
+#include "probes.h"
+#include "utilities.h"
+
+/* Structure to hold the state of one Plex server */
+typedef struct plex_server {
+	const server_t *config;            /* Server settings */
+	CURL *curl;                        /* CURL handle for this server */
+	bool online;                       /* Whether the server passed the startup check */
+	library_t *libraries;              /* Library roots known to this server */
+	int num_libraries;                 /* Number of library roots */
+	int libraries_capacity;            /* Allocated capacity of libraries array */
+	dispatch_t *queue;                 /* Min-heap of scans waiting to be sent, by deadline */
+	int queue_count;                   /* Number of queued scans */
+	int queue_capacity;                /* Allocated capacity of the heap */
+	unsigned long queue_seq;           /* Next submission sequence number */
+	double tokens;                     /* Scans that may be sent right now */
+	struct timespec refilled;          /* Time the token bucket was last refilled */
+	endpoint_t endpoints[PLEX_MAX_ENDPOINTS]; /* Addresses in configured order, health guarded by health_lock */
+	int num_endpoints;                 /* Number of endpoints */
+	int active;                        /* Endpoint the last request went to */
+	time_t retry;                      /* Time queued scans are retried after every endpoint failed */
+	time_t blocked;                    /* Time a busy disk holding back queued scans frees up */
+	bool submitted;                    /* Whether scans were queued since the last flush */
+} plex_server_t;
+
+static plex_server_t servers[MAX_SERVERS]; /* Plex servers */
+static int num_servers = 0;                /* Number of Plex servers */
+static disk_t *disks = NULL;               /* Disks scans were sent for */
+static int num_disks = 0;                  /* Number of known disks */
+static int disks_capacity = 0;             /* Allocated capacity of disks array */
+static pthread_t prober;                   /* Background endpoint prober */
+static bool probing = false;               /* Whether the prober should keep going */
+static pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_wake = PTHREAD_COND_INITIALIZER;
 
 /* Callback for writing curl response data */
 static size_t curl_write(void *contents, size_t size, size_t nmemb, void *userp) {
@@ -33,39 +69,300 @@ static size_t curl_write(void *contents, size_t size, size_t nmemb, void *userp)
 }
 
 /* Create curl headers for Plex API requests */
-static struct curl_slist *curl_headers(void) {
+static struct curl_slist *curl_headers(const plex_server_t *server) {
 	struct curl_slist *headers = NULL;
 
 	/* Set common headers */
 	headers = curl_slist_append(headers, "Accept: application/json");
 
 	/* Add auth token if available */
-	if (strlen(g_config.plex_token) > 0) {
+	if (strlen(server->config->token) > 0) {
 		char auth_header[TOKEN_MAX_LEN + 20];
 		snprintf(auth_header, sizeof(auth_header), "X-Plex-Token: %s",
-				 g_config.plex_token);
+				 server->config->token);
 		headers = curl_slist_append(headers, auth_header);
 	}
 
 	return headers;
 }
 
+/* Split the configured URL list of a server into endpoints */
+static void plexapi_endpoints(plex_server_t *server) {
+	char list[PATH_MAX_LEN];
+	char *saveptr = NULL;
+
+	snprintf(list, sizeof(list), "%s", server->config->url);
+	server->num_endpoints = 0;
+
+	for (char *url = strtok_r(list, ", \t", &saveptr); url; url = strtok_r(NULL, ", \t", &saveptr)) {
+		if (server->num_endpoints >= PLEX_MAX_ENDPOINTS) {
+			log_message(LOG_WARNING, "Too many URLs for Plex server %s, ignoring %s",
+						server->config->name, url);
+			continue;
+		}
+
+		endpoint_t *endpoint = &server->endpoints[server->num_endpoints++];
+		snprintf(endpoint->url, sizeof(endpoint->url), "%s", url);
+		size_t len = strlen(endpoint->url);
+		while (len > 0 && endpoint->url[len - 1] == '/') endpoint->url[--len] = '\0';
+		endpoint->healthy = true;
+		endpoint->latency = 0;
+	}
+
+	if (server->num_endpoints == 0) {
+		snprintf(server->endpoints[0].url, sizeof(server->endpoints[0].url), "%s", DEFAULT_PLEX_URL);
+		server->endpoints[0].healthy = true;
+		server->num_endpoints = 1;
+	}
+}
+
+/* Record the outcome of a request or probe, latency only comes from probes */
+static void plexapi_report(plex_server_t *server, int index, bool ok, double seconds) {
+	pthread_mutex_lock(&health_lock);
+	endpoint_t *endpoint = &server->endpoints[index];
+	endpoint->healthy = ok;
+	if (ok && seconds > 0) {
+		endpoint->latency = endpoint->latency > 0 ? PLEX_LATENCY_WEIGHT * seconds +
+														(1 - PLEX_LATENCY_WEIGHT) * endpoint->latency
+												  : seconds;
+	}
+	pthread_mutex_unlock(&health_lock);
+}
+
+/* Check if an endpoint is preferable to another: healthy first, then measured by a probe, then faster */
+static bool plexapi_better(const endpoint_t *endpoint, const endpoint_t *other) {
+	if (endpoint->healthy != other->healthy) {
+		return endpoint->healthy;
+	}
+	if (!endpoint->healthy) {
+		return false; /* Endpoints that failed are tried in order */
+	}
+
+	/* A latency of 0 means no probe got through yet, which says nothing about its speed */
+	if ((endpoint->latency > 0) != (other->latency > 0)) {
+		return endpoint->latency > 0;
+	}
+	return endpoint->latency < other->latency;
+}
+
+/* Pick the healthy endpoint with the lowest measured latency not tried yet, unprobed ones only
+ * when none was measured and the first untried one if none is healthy */
+static int plexapi_select(plex_server_t *server, unsigned int tried) {
+	int best = -1;
+
+	pthread_mutex_lock(&health_lock);
+	for (int i = 0; i < server->num_endpoints; i++) {
+		if (tried & (1u << i)) continue;
+
+		if (best < 0 || plexapi_better(&server->endpoints[i], &server->endpoints[best])) {
+			best = i;
+		}
+	}
+	pthread_mutex_unlock(&health_lock);
+
+	if (best >= 0 && best != server->active) {
+		log_message(LOG_INFO, "Using %s for Plex server %s", server->endpoints[best].url,
+					server->config->name);
+		server->active = best;
+	}
+	return best;
+}
+
+/* Check if any endpoint of a server answered its last request or probe */
+static bool plexapi_reachable(plex_server_t *server) {
+	bool reachable = false;
+
+	pthread_mutex_lock(&health_lock);
+	for (int i = 0; i < server->num_endpoints && !reachable; i++) {
+		reachable = server->endpoints[i].healthy;
+	}
+	pthread_mutex_unlock(&health_lock);
+	return reachable;
+}
+
+/* Send a request to one endpoint, the response is kept only if the request went through */
+static bool plexapi_request(plex_server_t *server, int index, const char *resource, bool timed,
+							curl_response_t *response, long *http_code) {
+	char url[PATH_MAX_LEN * 3];
+	curl_response_t discard;
+	curl_response_t *out = response ? response : &discard;
+
+	*http_code = 0;
+	out->data = malloc(1);
+	if (!out->data) {
+		log_message(LOG_ERR, "Memory allocation failed");
+		return false;
+	}
+	out->data[0] = '\0';
+	out->size = 0;
+
+	snprintf(url, sizeof(url), "%s%s", server->endpoints[index].url, resource);
+	struct curl_slist *headers = curl_headers(server);
+
+	curl_easy_setopt(server->curl, CURLOPT_URL, url);
+	curl_easy_setopt(server->curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(server->curl, CURLOPT_WRITEDATA, (void *) out);
+
+	CURLcode res = curl_easy_perform(server->curl);
+	curl_slist_free_all(headers);
+
+	double elapsed = 0;
+	curl_easy_getinfo(server->curl, CURLINFO_TOTAL_TIME, &elapsed);
+	if (res == CURLE_OK) {
+		curl_easy_getinfo(server->curl, CURLINFO_RESPONSE_CODE, http_code);
+	}
+	PROBE3(http__request, url, *http_code, (long) (elapsed * 1e6));
+
+	/* Client errors are the request's fault, not the endpoint's */
+	bool ok = res == CURLE_OK && *http_code < 500;
+	plexapi_report(server, index, ok, ok && timed ? elapsed : 0);
+
+	if (!ok) {
+		if (res != CURLE_OK) {
+			log_message(LOG_DEBUG, "Request to %s failed: %s", server->endpoints[index].url,
+						curl_easy_strerror(res));
+		} else {
+			log_message(LOG_DEBUG, "Request to %s failed with HTTP %ld", server->endpoints[index].url,
+						*http_code);
+		}
+	}
+
+	if (!ok || !response) {
+		free(out->data);
+		out->data = NULL;
+	}
+	return ok;
+}
+
+/* Send a request to the best endpoint, failing over to the others in turn */
+static bool plexapi_fetch(plex_server_t *server, const char *resource, curl_response_t *response,
+						  long *http_code) {
+	unsigned int tried = 0;
+
+	for (int attempt = 0; attempt < server->num_endpoints; attempt++) {
+		int index = plexapi_select(server, tried);
+		tried |= 1u << index;
+
+		if (plexapi_request(server, index, resource, false, response, http_code)) {
+			return true;
+		}
+		log_message(LOG_WARNING, "Plex server %s not answering at %s", server->config->name,
+					server->endpoints[index].url);
+	}
+
+	return false;
+}
+
+/* Probe every endpoint in the background so requests go to the fastest healthy one */
+static void *plexapi_prober(void *arg) {
+	(void) arg;
+
+	CURL *curl = curl_easy_init();
+	if (!curl) {
+		return NULL;
+	}
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long) PLEX_PROBE_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+	pthread_mutex_lock(&health_lock);
+	while (probing) {
+		pthread_mutex_unlock(&health_lock);
+
+		for (int i = 0; i < num_servers; i++) {
+			plex_server_t *server = &servers[i];
+			if (!server->online || server->num_endpoints < 2) continue;
+
+			for (int j = 0; j < server->num_endpoints; j++) {
+				char url[PATH_MAX_LEN + 16];
+				curl_response_t response = { malloc(1), 0 };
+				long http_code = 0;
+				double seconds = 0;
+
+				snprintf(url, sizeof(url), "%s/identity", server->endpoints[j].url);
+				curl_easy_setopt(curl, CURLOPT_URL, url);
+				curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &response);
+
+				bool ok = response.data && curl_easy_perform(curl) == CURLE_OK;
+				if (ok) {
+					curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+					curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &seconds);
+					ok = http_code >= 200 && http_code < 300;
+				}
+				free(response.data);
+				plexapi_report(server, j, ok, seconds);
+			}
+		}
+
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += PLEX_PROBE_INTERVAL;
+
+		pthread_mutex_lock(&health_lock);
+		if (probing) {
+			pthread_cond_timedwait(&probe_wake, &health_lock, &until);
+		}
+	}
+	pthread_mutex_unlock(&health_lock);
+
+	curl_easy_cleanup(curl);
+	return NULL;
+}
+
+/* Start probing if any server has more than one endpoint, only once worker processes are forked */
+void plexapi_probe(void) {
+	bool needed = false;
+	for (int i = 0; i < num_servers; i++) {
+		if (servers[i].online && servers[i].num_endpoints > 1) {
+			needed = true;
+		}
+	}
+	if (!needed || probing) {
+		return;
+	}
+
+	probing = true;
+	if (pthread_create(&prober, NULL, plexapi_prober, NULL) != 0) {
+		log_message(LOG_WARNING, "Failed to start endpoint prober, using endpoints in order");
+		probing = false;
+	}
+}
+
 /* Initialize Plex API client */
 bool plexapi_init(void) {
 	log_message(LOG_INFO, "Initializing Plex API client");
 
 	/* Initialize curl */
 	curl_global_init(CURL_GLOBAL_DEFAULT);
-	curl_handle = curl_easy_init();
 
-	if (!curl_handle) {
-		log_message(LOG_ERR, "Failed to initialize CURL");
-		return false;
+	num_servers = g_config.num_servers;
+	for (int i = 0; i < num_servers; i++) {
+		plex_server_t *server = &servers[i];
+		memset(server, 0, sizeof(plex_server_t));
+		server->config = &g_config.servers[i];
+		server->curl = curl_easy_init();
+
+		if (!server->curl) {
+			log_message(LOG_ERR, "Failed to initialize CURL");
+			return false;
+		}
+
+		/* Set common curl options */
+		curl_easy_setopt(server->curl, CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(server->curl, CURLOPT_WRITEFUNCTION, curl_write);
+		curl_easy_setopt(server->curl, CURLOPT_TIMEOUT, (long) PLEX_REQUEST_TIMEOUT);
+
+		/* Endpoints are read once, like the server list itself */
+		plexapi_endpoints(server);
+
+		/* Start with a full token bucket */
+		server->tokens = server->config->scan_burst;
+		clock_gettime(CLOCK_MONOTONIC, &server->refilled);
 	}
 
-	/* Set common curl options */
-	curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_write);
+	if (num_servers > 1) {
+		log_message(LOG_INFO, "Sending scans to %d Plex servers", num_servers);
+	}
 
 	return true;
 }
@@ -74,83 +371,85 @@ bool plexapi_init(void) {
 void plexapi_cleanup(void) {
 	log_message(LOG_INFO, "Cleaning up Plex API client");
 
-	if (curl_handle) {
-		curl_easy_cleanup(curl_handle);
-		curl_handle = NULL;
+	if (probing) {
+		pthread_mutex_lock(&health_lock);
+		probing = false;
+		pthread_cond_signal(&probe_wake);
+		pthread_mutex_unlock(&health_lock);
+		pthread_join(prober, NULL);
+	}
+
+	for (int i = 0; i < num_servers; i++) {
+		plex_server_t *server = &servers[i];
+
+		if (server->curl) {
+			curl_easy_cleanup(server->curl);
+			server->curl = NULL;
+		}
+
+		for (int j = 0; j < server->num_libraries; j++) {
+			free(server->libraries[j].path);
+		}
+		free(server->libraries);
+		server->libraries = NULL;
+		server->num_libraries = 0;
+
+		for (int j = 0; j < server->queue_count; j++) {
+			free(server->queue[j].path);
+		}
+		free(server->queue);
+		server->queue = NULL;
+		server->queue_count = 0;
 	}
+	num_servers = 0;
+
+	free(disks);
+	disks = NULL;
+	num_disks = 0;
+	disks_capacity = 0;
 
 	curl_global_cleanup();
 }
 
-/* Check connectivity and authentication to the Plex Media Server */
-bool plexapi_check(void) {
-	curl_response_t response;
-	char url[1024];
-	struct curl_slist *headers = NULL;
-	CURLcode res;
+/* Check connectivity and authentication to one Plex Media Server */
+static bool plexapi_connect(plex_server_t *server) {
 	long http_code = 0;
 	time_t start_time, current_time;
 
-	log_message(LOG_INFO, "Attempting to connect to %s", g_config.plex_url);
+	log_message(LOG_INFO, "Attempting to connect to %s", server->config->url);
 
-	if (!curl_handle) {
+	if (!server->curl) {
 		log_message(LOG_ERR, "CURL not initialized");
 		return false;
 	}
 
-	/* Construct request URL for server identity endpoint */
-	snprintf(url, sizeof(url), "%s/identity", g_config.plex_url);
-
-	/* Set up headers */
-	headers = curl_headers();
-
-	/* Set curl options */
-	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 5L);
+	/* Short timeout while waiting for the server to come up */
+	curl_easy_setopt(server->curl, CURLOPT_TIMEOUT, 5L);
 
 	start_time = time(NULL);
 
-	/* Check if Plex server is reachable (retry for delayed start) */
+	/* Check if Plex server is reachable at any endpoint (retry for delayed start) */
 	do {
-		/* Initialize response struct */
-		response.data = malloc(1);
-		if (!response.data) {
-			curl_slist_free_all(headers);
-			log_message(LOG_ERR, "Memory allocation failed");
-			return false;
-		}
-		response.size = 0;
-
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *) &response);
-
-		/* Perform the request */
-		res = curl_easy_perform(curl_handle);
-
-		if (res == CURLE_OK) {
-			/* Check HTTP status code */
-			curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
-
-			if (http_code >= 200 && http_code < 300) {
-				/* Server is reachable, break out to validate token */
-				free(response.data);
-				break;
+		bool reachable = false;
+		for (int i = 0; i < server->num_endpoints; i++) {
+			if (plexapi_request(server, i, "/identity", true, NULL, &http_code) &&
+				http_code >= 200 && http_code < 300) {
+				reachable = true;
 			} else {
-				log_message(LOG_DEBUG, "Plex server responded with HTTP %ld",
-							http_code);
+				if (http_code != 0) {
+					log_message(LOG_DEBUG, "Plex server responded with HTTP %ld", http_code);
+				}
+				plexapi_report(server, i, false, 0);
 			}
-		} else {
-			log_message(LOG_DEBUG, "Failed to connect to Plex: %s",
-						curl_easy_strerror(res));
 		}
-
-		/* Clean up response */
-		free(response.data);
+		if (reachable) {
+			break;
+		}
 
 		/* Check timeout */
 		current_time = time(NULL);
 		if (current_time - start_time >= g_config.startup_timeout) {
-			curl_slist_free_all(headers);
+			curl_easy_setopt(server->curl, CURLOPT_TIMEOUT, (long) PLEX_REQUEST_TIMEOUT);
 			log_message(LOG_ERR, "Connection timeout reached after %d seconds",
 						g_config.startup_timeout);
 			return false;
@@ -162,38 +461,17 @@ bool plexapi_check(void) {
 
 	} while (1);
 
-	/* Clean up identity check headers */
-	curl_slist_free_all(headers);
-
-	/* Validate access token with authenticated endpoint */
-	snprintf(url, sizeof(url), "%s/servers", g_config.plex_url);
-	headers = curl_headers();
+	curl_easy_setopt(server->curl, CURLOPT_TIMEOUT, (long) PLEX_REQUEST_TIMEOUT);
 
-	response.data = malloc(1);
-	if (!response.data) {
-		curl_slist_free_all(headers);
-		log_message(LOG_ERR, "Memory allocation failed");
-		return false;
+	/* Validate access token with authenticated endpoint, logging which one is used */
+	if (server->num_endpoints > 1) {
+		server->active = -1;
 	}
-	response.size = 0;
-
-	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *) &response);
-
-	res = curl_easy_perform(curl_handle);
-	curl_slist_free_all(headers);
-
-	if (res != CURLE_OK) {
-		log_message(LOG_ERR, "Failed to validate access token: %s",
-					curl_easy_strerror(res));
-		free(response.data);
+	if (!plexapi_fetch(server, "/servers", NULL, &http_code)) {
+		log_message(LOG_ERR, "Failed to validate access token");
 		return false;
 	}
 
-	curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
-	free(response.data);
-
 	if (http_code == 401) {
 		log_message(LOG_ERR, "Authentication failed: Invalid access token");
 		return false;
@@ -202,12 +480,67 @@ bool plexapi_check(void) {
 		return false;
 	}
 
-	log_message(LOG_INFO, "Successfully connected to Plex Media Server");
+	log_message(LOG_INFO, "Successfully connected to Plex Media Server %s",
+				server->config->name);
+	return true;
+}
+
+/* Check connectivity and authentication to all Plex Media Servers */
+bool plexapi_check(void) {
+	int online = 0;
+
+	for (int i = 0; i < num_servers; i++) {
+		servers[i].online = plexapi_connect(&servers[i]);
+		if (servers[i].online) {
+			online++;
+		} else if (num_servers > 1) {
+			log_message(LOG_WARNING, "Plex server %s is unavailable, not sending scans to it",
+						servers[i].config->name);
+		}
+	}
+
+	return online > 0;
+}
+
+/* Check if another server already reported a library root, it is then watched already */
+static bool plexapi_known(const char *path) {
+	for (int i = 0; i < num_servers; i++) {
+		for (int j = 0; j < servers[i].num_libraries; j++) {
+			if (strcmp(servers[i].libraries[j].path, path) == 0) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* Remember which section a library root belongs to on a server */
+static bool plexapi_map(plex_server_t *server, const char *path, int section_id) {
+	if (server->num_libraries >= server->libraries_capacity) {
+		int new_capacity = server->libraries_capacity > 0 ? server->libraries_capacity * 2 : 16;
+		library_t *new_libraries = realloc(server->libraries, new_capacity * sizeof(library_t));
+		if (!new_libraries) {
+			log_message(LOG_ERR, "Failed to allocate memory for library mapping");
+			return false;
+		}
+		server->libraries = new_libraries;
+		server->libraries_capacity = new_capacity;
+	}
+
+	char *copy = strdup(path);
+	if (!copy) {
+		log_message(LOG_ERR, "Failed to allocate memory for library path");
+		return false;
+	}
+
+	library_t *library = &server->libraries[server->num_libraries++];
+	library->path = copy;
+	library->section_id = section_id;
 	return true;
 }
 
 /* Process library section */
-static bool plexapi_process(json_object *section) {
+static bool plexapi_process(plex_server_t *server, int server_index, json_object *section) {
 	json_object *section_obj, *location_array, *location, *path_obj;
 	int section_id;
 	const char *section_path;
@@ -241,11 +574,25 @@ static bool plexapi_process(json_object *section) {
 
 		section_path = json_object_get_string(path_obj);
 
+		/* Libraries shared between servers are watched only once */
+		bool shared = plexapi_known(section_path);
+
+		if (!plexapi_map(server, section_path, section_id)) {
+			continue;
+		}
+
+		if (shared) {
+			log_message(LOG_INFO, "Library %s (section %d) on %s shares existing watches",
+						section_path, section_id, server->config->name);
+			success = true;
+			continue;
+		}
+
 		/* Add this directory to the watch list */
-		log_message(LOG_INFO, "Monitoring library: %s (section %d)",
-					section_path, section_id);
+		log_message(LOG_INFO, "Monitoring library: %s (section %d on %s)",
+					section_path, section_id, server->config->name);
 
-		if (monitor_tree(section_path, section_id)) {
+		if (monitor_library(section_path, server_index, section_id)) {
 			success = true;
 		} else {
 			log_message(LOG_WARNING, "Failed to add directory %s to watch list",
@@ -256,53 +603,24 @@ static bool plexapi_process(json_object *section) {
 	return success;
 }
 
-/* Get libraries from Plex server */
-bool plexapi_libraries(void) {
+/* Get libraries from one Plex server */
+static bool plexapi_sections(plex_server_t *server, int server_index) {
 	curl_response_t response;
-	char url[1024];
-	struct curl_slist *headers = NULL;
 	json_object *root, *container, *sections, *section;
-	CURLcode res;
+	long http_code = 0;
 	bool success = true;
 
-	log_message(LOG_INFO, "Retrieving library sections from Plex");
+	log_message(LOG_INFO, "Retrieving library sections from Plex server %s",
+				server->config->name);
 
-	if (!curl_handle) {
+	if (!server->curl) {
 		log_message(LOG_ERR, "CURL not initialized");
 		return false;
 	}
 
-	/* Check if kqueue is valid */
-	if (monitor_kqueue() == -1) {
-		log_message(LOG_ERR, "Invalid kqueue descriptor");
-		return false;
-	}
-
-	/* Initialize response struct */
-	response.data = malloc(1);
-	response.size = 0;
-
-	/* Construct request URL */
-	snprintf(url, sizeof(url), "%s/library/sections", g_config.plex_url);
-
-	/* Set up headers */
-	headers = curl_headers();
-
-	/* Set curl options */
-	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *) &response);
-
 	/* Perform the request */
-	res = curl_easy_perform(curl_handle);
-
-	/* Clean up headers */
-	curl_slist_free_all(headers);
-
-	if (res != CURLE_OK) {
-		log_message(LOG_ERR, "Failed to get library sections: %s",
-					curl_easy_strerror(res));
-		free(response.data);
+	if (!plexapi_fetch(server, "/library/sections", &response, &http_code)) {
+		log_message(LOG_ERR, "Failed to get library sections");
 		return false;
 	}
 
@@ -329,7 +647,7 @@ bool plexapi_libraries(void) {
 
 	for (int i = 0; i < num_sections; i++) {
 		section = json_object_array_get_idx(sections, i);
-		if (!plexapi_process(section)) {
+		if (!plexapi_process(server, server_index, section)) {
 			success = false;
 		}
 	}
@@ -341,61 +659,376 @@ bool plexapi_libraries(void) {
 	return success;
 }
 
-/* Trigger a partial scan for a specific path */
-bool plexapi_scan(const char *path, int section_id) {
-	curl_response_t response;
-	char url[1024];
-	struct curl_slist *headers = NULL;
-	CURLcode res;
-
-	log_message(LOG_DEBUG, "Triggering Plex scan for path: %s (section %d)",
-				path, section_id);
+/* Get libraries from all Plex servers */
+bool plexapi_libraries(void) {
+	bool success = true;
 
-	if (!curl_handle) {
-		log_message(LOG_ERR, "CURL not initialized");
+	/* Check if kqueue is valid */
+	if (monitor_kqueue() == -1) {
+		log_message(LOG_ERR, "Invalid kqueue descriptor");
 		return false;
 	}
 
-	/* Initialize response struct */
-	response.data = malloc(1);
-	response.size = 0;
+	for (int i = 0; i < num_servers; i++) {
+		if (servers[i].online && !plexapi_sections(&servers[i], i)) {
+			success = false;
+		}
+	}
+
+	return success;
+}
 
-	/* Construct request URL with path encoded */
-	char *escaped_path = curl_easy_escape(curl_handle, path, 0);
+/* Trigger a partial scan for a specific path on one server, false if no endpoint answered */
+static bool plexapi_scan(plex_server_t *server, const char *path, int section_id) {
+	char resource[PATH_MAX_LEN * 2];
+	long http_code = 0;
+
+	log_message(LOG_DEBUG, "Triggering Plex scan for path: %s (section %d on %s)",
+				path, section_id, server->config->name);
+
+	if (!server->curl) {
+		log_message(LOG_ERR, "CURL not initialized");
+		return true;
+	}
+
+	/* Construct request with path encoded */
+	char *escaped_path = curl_easy_escape(server->curl, path, 0);
 	if (escaped_path) {
-		snprintf(url, sizeof(url), "%s/library/sections/%d/refresh?path=%s",
-				 g_config.plex_url, section_id, escaped_path);
+		snprintf(resource, sizeof(resource), "/library/sections/%d/refresh?path=%s",
+				 section_id, escaped_path);
 		curl_free(escaped_path);
 	} else {
 		log_message(LOG_ERR, "Failed to URL encode path");
-		free(response.data);
+		return true;
+	}
+
+	/* Perform the request */
+	bool delivered = plexapi_fetch(server, resource, NULL, &http_code);
+	PROBE3(scan__complete, path, section_id, http_code);
+	if (!delivered) {
+		log_message(LOG_ERR, "Failed to trigger Plex scan for %s", path);
 		return false;
 	}
 
-	/* Set up headers */
-	headers = curl_headers();
+	if (http_code >= 400) {
+		log_message(LOG_ERR, "Plex rejected scan for %s with HTTP %ld", path, http_code);
+		return true;
+	}
 
-	/* Set curl options */
-	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *) &response);
+	log_message(LOG_DEBUG, "Successfully triggered scan for %s", path);
+	return true;
+}
 
-	/* Perform the request */
-	res = curl_easy_perform(curl_handle);
+/* Find the section on a server whose root holds a path, preferring the deepest root */
+static const library_t *plexapi_section(const plex_server_t *server, const char *path) {
+	const library_t *best = NULL;
+	size_t best_len = 0;
 
-	/* Clean up headers */
-	curl_slist_free_all(headers);
+	for (int i = 0; i < server->num_libraries; i++) {
+		const library_t *library = &server->libraries[i];
+		size_t len = strlen(library->path);
 
-	if (res != CURLE_OK) {
-		log_message(LOG_ERR, "Failed to trigger Plex scan: %s",
-					curl_easy_strerror(res));
-		free(response.data);
-		return false;
+		if ((strcmp(library->path, path) == 0 || path_contains(library->path, path)) &&
+			(!best || len > best_len)) {
+			best = library;
+			best_len = len;
+		}
 	}
 
-	/* Clean up */
-	free(response.data);
+	return best;
+}
 
-	log_message(LOG_DEBUG, "Successfully triggered scan for %s", path);
+/* Check if a queued scan must be sent before another */
+static bool dispatch_before(const dispatch_t *a, const dispatch_t *b) {
+	if (a->deadline != b->deadline) {
+		return a->deadline < b->deadline;
+	}
+	return a->seq < b->seq;
+}
+
+/* Put an entry into a server's dispatch heap, keeping its sequence number */
+static bool plexapi_push(plex_server_t *server, dispatch_t entry) {
+	if (server->queue_count >= server->queue_capacity) {
+		int new_capacity = server->queue_capacity > 0 ? server->queue_capacity * 2 : 64;
+		dispatch_t *new_queue = realloc(server->queue, new_capacity * sizeof(dispatch_t));
+		if (!new_queue) {
+			log_message(LOG_ERR, "Failed to allocate memory for dispatch queue");
+			return false;
+		}
+		server->queue = new_queue;
+		server->queue_capacity = new_capacity;
+	}
+
+	/* Sift up */
+	int i = server->queue_count++;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!dispatch_before(&entry, &server->queue[parent])) {
+			break;
+		}
+		server->queue[i] = server->queue[parent];
+		i = parent;
+	}
+	server->queue[i] = entry;
 	return true;
 }
+
+/* Add a scan to a server's dispatch heap */
+static bool plexapi_enqueue(plex_server_t *server, const char *path, int section_id, time_t deadline,
+							dev_t device) {
+	char *copy = strdup(path);
+	if (!copy) {
+		log_message(LOG_ERR, "Failed to allocate memory for dispatch path");
+		return false;
+	}
+
+	dispatch_t entry = { copy, section_id, deadline, server->queue_seq++, device };
+	if (!plexapi_push(server, entry)) {
+		free(copy);
+		return false;
+	}
+	return true;
+}
+
+/* Remove the scan with the earliest deadline from a server's dispatch heap */
+static dispatch_t plexapi_dequeue(plex_server_t *server) {
+	dispatch_t top = server->queue[0];
+	dispatch_t last = server->queue[--server->queue_count];
+
+	/* Sift the last entry down from the root */
+	int i = 0;
+	int n = server->queue_count;
+	while (true) {
+		int child = 2 * i + 1;
+		if (child >= n) {
+			break;
+		}
+		if (child + 1 < n && dispatch_before(&server->queue[child + 1], &server->queue[child])) {
+			child++;
+		}
+		if (!dispatch_before(&server->queue[child], &last)) {
+			break;
+		}
+		server->queue[i] = server->queue[child];
+		i = child;
+	}
+	if (n > 0) {
+		server->queue[i] = last;
+	}
+
+	return top;
+}
+
+/* Queue a scan for every server that has a library holding the path */
+void plexapi_submit(const char *path, time_t deadline) {
+	dev_t device = g_config.disk_scans > 0 ? monitor_device(path) : 0;
+
+	for (int i = 0; i < num_servers; i++) {
+		plex_server_t *server = &servers[i];
+		if (!server->online) {
+			continue;
+		}
+
+		const library_t *library = plexapi_section(server, path);
+		if (!library) {
+			continue;
+		}
+
+		if (plexapi_enqueue(server, path, library->section_id, deadline, device)) {
+			server->submitted = true;
+		}
+	}
+}
+
+/* Find a disk by device, added on first use */
+static disk_t *plexapi_disk(dev_t device) {
+	for (int i = 0; i < num_disks; i++) {
+		if (disks[i].device == device) {
+			return &disks[i];
+		}
+	}
+
+	if (num_disks >= disks_capacity) {
+		int new_capacity = disks_capacity > 0 ? disks_capacity * 2 : DISK_INITIAL_CAPACITY;
+		disk_t *new_disks = realloc(disks, new_capacity * sizeof(disk_t));
+		if (!new_disks) {
+			log_message(LOG_ERR, "Failed to allocate memory for disk tracking");
+			return NULL;
+		}
+		disks = new_disks;
+		disks_capacity = new_capacity;
+	}
+
+	disk_t *disk = &disks[num_disks++];
+	memset(disk, 0, sizeof(disk_t));
+	disk->device = device;
+	return disk;
+}
+
+/* Find a free in-flight slot on a disk, or -1 with the time the first one frees up */
+static int plexapi_slot(const disk_t *disk, time_t now, time_t *frees) {
+	*frees = 0;
+	for (int i = 0; i < g_config.disk_scans; i++) {
+		if (disk->busy[i] <= now) {
+			return i;
+		}
+		if (*frees == 0 || disk->busy[i] < *frees) {
+			*frees = disk->busy[i];
+		}
+	}
+	return -1;
+}
+
+/* Add tokens for the time elapsed since the last refill */
+static void plexapi_refill(plex_server_t *server) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	double elapsed = (now.tv_sec - server->refilled.tv_sec) +
+					 (now.tv_nsec - server->refilled.tv_nsec) / 1e9;
+	server->refilled = now;
+
+	server->tokens += elapsed * server->config->scan_rate / 60.0;
+	if (server->tokens > server->config->scan_burst) {
+		server->tokens = server->config->scan_burst;
+	}
+}
+
+/* Send queued scans to each server as its rate limit and the disks they read allow */
+void plexapi_flush(void) {
+	time_t now = time(NULL);
+
+	for (int i = 0; i < num_servers; i++) {
+		plex_server_t *server = &servers[i];
+		bool limited = server->config->scan_rate > 0;
+		dispatch_t *held = NULL;
+		int num_held = 0;
+		int held_capacity = 0;
+
+		/* Wait out the retry delay unless a probe found an endpoint again */
+		if (server->retry > now && !plexapi_reachable(server)) {
+			continue;
+		}
+		server->retry = 0;
+
+		/* Everything queued waits for a busy disk, unless new scans came in */
+		if (server->blocked > now && !server->submitted) {
+			continue;
+		}
+		server->blocked = 0;
+		server->submitted = false;
+
+		if (limited) {
+			plexapi_refill(server);
+		}
+
+		while (server->queue_count > 0 && (!limited || server->tokens >= 1.0)) {
+			dispatch_t entry = plexapi_dequeue(server);
+
+			/* Scans for a disk with all slots taken wait, scans for other disks go ahead */
+			disk_t *disk = g_config.disk_scans > 0 ? plexapi_disk(entry.device) : NULL;
+			int slot = -1;
+			if (disk) {
+				time_t frees;
+				slot = plexapi_slot(disk, now, &frees);
+				if (slot < 0) {
+					if (server->blocked == 0 || frees < server->blocked) {
+						server->blocked = frees;
+					}
+					if (num_held >= held_capacity) {
+						int new_capacity = held_capacity > 0 ? held_capacity * 2 : 16;
+						dispatch_t *new_held = realloc(held, new_capacity * sizeof(dispatch_t));
+						if (!new_held) {
+							plexapi_push(server, entry);
+							break;
+						}
+						held = new_held;
+						held_capacity = new_capacity;
+					}
+					held[num_held++] = entry;
+					continue;
+				}
+			}
+
+			/* Every endpoint failed, keep the scan for the next attempt */
+			if (!plexapi_scan(server, entry.path, entry.section_id)) {
+				plexapi_push(server, entry);
+				server->retry = now + PLEX_RETRY_DELAY;
+				log_message(LOG_WARNING, "Plex server %s unreachable, retrying %d queued scans in %ds",
+							server->config->name, server->queue_count + num_held, PLEX_RETRY_DELAY);
+				break;
+			}
+
+			/* Plex writing back into the path from here on is its own doing */
+			events_sent(entry.path);
+			free(entry.path);
+
+			if (disk) {
+				disk->busy[slot] = now + g_config.disk_busy;
+			}
+			if (limited) {
+				server->tokens -= 1.0;
+			}
+		}
+
+		/* Stopped by the rate limit or a failure rather than by the disks */
+		if (server->queue_count > 0) {
+			server->blocked = 0;
+		}
+
+		/* Held scans keep their place in the deadline order */
+		for (int j = 0; j < num_held; j++) {
+			if (!plexapi_push(server, held[j])) {
+				free(held[j].path);
+			}
+		}
+		free(held);
+
+		if (num_held > 0) {
+			log_message(LOG_DEBUG, "%d scans for %s wait for busy disks", num_held, server->config->name);
+		}
+		if (server->queue_count > num_held && server->retry == 0) {
+			log_message(LOG_DEBUG, "%d scans queued for %s by rate limit",
+						server->queue_count - num_held, server->config->name);
+		}
+	}
+}
+
+/* Get the time when the next held back scan can be sent */
+time_t plexapi_schedule(void) {
+	time_t next_time = 0;
+	time_t now = time(NULL);
+
+	for (int i = 0; i < num_servers; i++) {
+		const plex_server_t *server = &servers[i];
+		if (server->queue_count == 0) {
+			continue;
+		}
+
+		/* Unreachable servers are retried after a delay */
+		if (server->retry > now) {
+			if (next_time == 0 || server->retry < next_time) {
+				next_time = server->retry;
+			}
+			continue;
+		}
+
+		/* A busy disk frees up */
+		if (server->blocked > now && (next_time == 0 || server->blocked < next_time)) {
+			next_time = server->blocked;
+		}
+
+		if (server->config->scan_rate <= 0 || server->tokens >= 1.0) {
+			continue;
+		}
+
+		/* Round up so the loop never wakes before a token is available */
+		double missing = 1.0 - server->tokens;
+		time_t wait = (time_t) (missing * 60.0 / server->config->scan_rate) + 1;
+		if (next_time == 0 || now + wait < next_time) {
+			next_time = now + wait;
+		}
+	}
+
+	return next_time;
+}
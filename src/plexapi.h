@@ -3,6 +3,19 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "config.h"
+
+/* Plex API configuration */
+#define PLEX_MAX_ENDPOINTS 4           /* Addresses one server may be reached at */
+#define PLEX_PROBE_INTERVAL 30         /* Seconds between background endpoint probes */
+#define PLEX_PROBE_TIMEOUT 5           /* Seconds before a probe counts as failed */
+#define PLEX_REQUEST_TIMEOUT 10        /* Seconds before a request fails over to the next endpoint */
+#define PLEX_RETRY_DELAY 30            /* Seconds before queued scans are retried when no endpoint answers */
+#define PLEX_LATENCY_WEIGHT 0.3        /* Weight of the newest probe in the smoothed latency */
+#define DISK_INITIAL_CAPACITY 8        /* Initial size of the disk array */
 
 /* Structure for HTTP response data from curl */
 typedef struct {
@@ -10,6 +23,34 @@ typedef struct {
 	size_t size;                       /* Size of response data in bytes */
 } curl_response_t;
 
+/* One address a Plex server is reachable at */
+typedef struct endpoint {
+	char url[PATH_MAX_LEN];            /* Base URL without trailing slash */
+	bool healthy;                      /* Whether the last request or probe succeeded */
+	double latency;                    /* Smoothed probe response time in seconds */
+} endpoint_t;
+
+/* Structure to map a library root to a section on one server */
+typedef struct library {
+	char *path;                        /* Library root path */
+	int section_id;                    /* Section ID on this server */
+} library_t;
+
+/* Structure for a scan waiting to be sent to a server */
+typedef struct dispatch {
+	char *path;                        /* Path to scan */
+	int section_id;                    /* Section ID on the target server */
+	time_t deadline;                   /* Latency target, earliest is sent first */
+	unsigned long seq;                 /* Submission order to break deadline ties */
+	dev_t device;                      /* Disk the path lives on */
+} dispatch_t;
+
+/* Disk holding library paths, with the scans Plex is probably still reading it for */
+typedef struct disk {
+	dev_t device;                      /* Device ID from stat */
+	time_t busy[MAX_DISK_SCANS];       /* Time each in-flight scan is assumed done */
+} disk_t;
+
 /* Plex API lifecycle management */
 bool plexapi_init(void);
 void plexapi_cleanup(void);
@@ -17,8 +58,11 @@ void plexapi_cleanup(void);
 /* Plex server communication */
 bool plexapi_check(void);
 bool plexapi_libraries(void);
+void plexapi_probe(void);
 
 /* Library scanning operations */
-bool plexapi_scan(const char *path, int section_id);
+void plexapi_submit(const char *path, time_t deadline);
+void plexapi_flush(void);
+time_t plexapi_schedule(void);
 
 #endif /* PLEXAPI_H */
@@ -0,0 +1,141 @@
+#include "prefetch.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "dircache.h"
+#include "logger.h"
+
+static pthread_t workers[PREFETCH_MAX_THREADS];       /* Worker threads */
+static int num_workers = 0;                           /* Number of running workers */
+static char *queue[PREFETCH_QUEUE_SIZE];              /* Ring buffer of paths to prefetch */
+static int queue_head = 0;                            /* Index of the next path to take */
+static int queue_count = 0;                           /* Number of paths in the ring */
+static bool running = false;                          /* Whether workers should keep going */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+/* Read a directory so its metadata is in the kernel caches when the crawl reaches it */
+static void prefetch_read(const char *path) {
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return;
+	}
+
+	/* The crawl will not read a directory the cache already holds at this mtime */
+	if (dircache_enter()) {
+		bool current = dircache_current(path, st.st_mtime);
+		dircache_exit();
+		if (current) {
+			return;
+		}
+	}
+
+	DIR *dirp = opendir(path);
+	if (!dirp) {
+		return;
+	}
+	while (readdir(dirp)) {
+		/* Only the I/O matters */
+	}
+	closedir(dirp);
+}
+
+/* Worker thread main loop */
+static void *prefetch_worker(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&lock);
+	while (running) {
+		if (queue_count == 0) {
+			pthread_cond_wait(&ready, &lock);
+			continue;
+		}
+
+		char *path = queue[queue_head];
+		queue_head = (queue_head + 1) % PREFETCH_QUEUE_SIZE;
+		queue_count--;
+		pthread_mutex_unlock(&lock);
+
+		prefetch_read(path);
+		free(path);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	dircache_detach();
+	return NULL;
+}
+
+/* Start prefetch worker threads */
+bool prefetch_start(int threads) {
+	if (threads > PREFETCH_MAX_THREADS) threads = PREFETCH_MAX_THREADS;
+	if (threads <= 0 || num_workers > 0) {
+		return false;
+	}
+
+	running = true;
+	queue_head = 0;
+	queue_count = 0;
+
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, prefetch_worker, NULL) != 0) {
+			log_message(LOG_WARNING, "Failed to start prefetch thread, using %d", num_workers);
+			break;
+		}
+		num_workers++;
+	}
+
+	if (num_workers == 0) {
+		running = false;
+		return false;
+	}
+
+	log_message(LOG_DEBUG, "Started %d directory prefetch threads", num_workers);
+	return true;
+}
+
+/* Stop prefetch worker threads and drop queued paths */
+void prefetch_stop(void) {
+	if (num_workers == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	running = false;
+	pthread_cond_broadcast(&ready);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < num_workers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	num_workers = 0;
+
+	while (queue_count > 0) {
+		free(queue[queue_head]);
+		queue_head = (queue_head + 1) % PREFETCH_QUEUE_SIZE;
+		queue_count--;
+	}
+}
+
+/* Queue a directory for prefetching, dropped silently when the ring is full */
+void prefetch_submit(const char *path) {
+	if (num_workers == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	if (queue_count < PREFETCH_QUEUE_SIZE) {
+		char *copy = strdup(path);
+		if (copy) {
+			queue[(queue_head + queue_count) % PREFETCH_QUEUE_SIZE] = copy;
+			queue_count++;
+			pthread_cond_signal(&ready);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
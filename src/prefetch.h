@@ -0,0 +1,17 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+
+/* Prefetch configuration */
+#define PREFETCH_QUEUE_SIZE 1024       /* Maximum directories waiting to be prefetched */
+#define PREFETCH_MAX_THREADS 32        /* Upper bound for prefetch worker threads */
+
+/* Prefetch lifecycle */
+bool prefetch_start(int threads);
+void prefetch_stop(void);
+
+/* Prefetch operations */
+void prefetch_submit(const char *path);
+
+#endif /* PREFETCH_H */
@@ -0,0 +1,21 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* Static tracepoints for DTrace, built in with "make USDT=1".
+ * Provider "plexmon", probes are listed in probes.d. Disabled probes expand
+ * to nothing and their arguments are not evaluated. */
+#if defined(PLEXMON_USDT) && PLEXMON_USDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(plexmon, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(plexmon, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(plexmon, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(plexmon, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,378 @@
+#include "reactor.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/event.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+/* Kinds of sources the reactor dispatches */
+typedef enum {
+	SOURCE_TIMER,                      /* One-shot or periodic timer */
+	SOURCE_FD,                         /* Descriptor readiness */
+	SOURCE_SIGNAL,                     /* Signal delivery */
+	SOURCE_WAKE                        /* Cross-thread wakeup */
+} source_kind_t;
+
+/* Structure to hold a registered source */
+typedef struct source {
+	source_kind_t kind;                /* Kind of source */
+	uintptr_t ident;                   /* Timer ID, descriptor or signal number */
+	uint32_t events;                   /* Readiness interest for descriptors */
+	bool periodic;                     /* Whether a timer re-arms itself */
+	bool dead;                         /* Unregistered, freed once the current batch is done */
+	reactor_fn fn;                     /* Callback */
+	void *arg;                         /* Callback argument */
+} source_t;
+
+static int backend_fd = -1;            /* Kqueue descriptor */
+static source_t **sources = NULL;      /* Array of registered sources */
+static int num_sources = 0;            /* Current number of sources */
+static int sources_capacity = 0;       /* Allocated capacity of sources array */
+static bool reap = false;              /* Whether dead sources are waiting to be freed */
+static atomic_uint wake_bits;          /* Wake bits posted since the last dispatch */
+static source_t *wake_source = NULL;   /* Registered wakeup callback */
+static reactor_vnode_fn vnode_fn = NULL; /* Handler for directory watch events */
+static void *vnode_arg = NULL;         /* Argument for the vnode handler */
+
+/* Find a live source by kind and identifier */
+static source_t *source_find(source_kind_t kind, uintptr_t ident) {
+	for (int i = 0; i < num_sources; i++) {
+		if (!sources[i]->dead && sources[i]->kind == kind && sources[i]->ident == ident) {
+			return sources[i];
+		}
+	}
+	return NULL;
+}
+
+/* Allocate and append a new source */
+static source_t *source_add(source_kind_t kind, uintptr_t ident, reactor_fn fn, void *arg) {
+	if (num_sources >= sources_capacity) {
+		int new_capacity = sources_capacity > 0 ? sources_capacity * 2 : 16;
+		source_t **new_sources = realloc(sources, new_capacity * sizeof(source_t *));
+		if (!new_sources) {
+			log_message(LOG_ERR, "Failed to allocate memory for reactor sources");
+			return NULL;
+		}
+		sources = new_sources;
+		sources_capacity = new_capacity;
+	}
+
+	source_t *source = calloc(1, sizeof(source_t));
+	if (!source) {
+		log_message(LOG_ERR, "Failed to allocate memory for reactor source");
+		return NULL;
+	}
+
+	source->kind = kind;
+	source->ident = ident;
+	source->fn = fn;
+	source->arg = arg;
+	sources[num_sources++] = source;
+	return source;
+}
+
+/* Mark a source as unregistered, events already collected for it are skipped */
+static void source_kill(source_t *source) {
+	source->dead = true;
+	reap = true;
+}
+
+/* Free sources that were unregistered during the last batch */
+static void source_reap(void) {
+	int kept = 0;
+
+	for (int i = 0; i < num_sources; i++) {
+		if (sources[i]->dead) {
+			free(sources[i]);
+		} else {
+			sources[kept++] = sources[i];
+		}
+	}
+	num_sources = kept;
+	reap = false;
+}
+
+/* Run a callback, dropping one-shot timers before so they can re-arm themselves */
+static void source_dispatch(source_t *source, uint32_t data) {
+	if (source->dead) {
+		return;
+	}
+
+	reactor_fn fn = source->fn;
+	void *arg = source->arg;
+	uintptr_t ident = source->ident;
+
+	if (source->kind == SOURCE_TIMER && !source->periodic) {
+		source_kill(source);
+	}
+
+	fn(ident, data, arg);
+}
+
+/* Hand accumulated wake bits to the wakeup callback */
+static void wake_dispatch(void) {
+	uint32_t bits = atomic_exchange(&wake_bits, 0);
+	if (bits && wake_source) {
+		source_dispatch(wake_source, bits);
+	}
+}
+
+/* Initialize the kqueue backend */
+bool reactor_init(void) {
+	backend_fd = kqueue();
+	if (backend_fd == -1) {
+		log_message(LOG_ERR, "Failed to create kqueue: %s", strerror(errno));
+		return false;
+	}
+
+	atomic_store(&wake_bits, 0);
+	return true;
+}
+
+/* Clean up the kqueue backend */
+void reactor_cleanup(void) {
+	for (int i = 0; i < num_sources; i++) {
+		free(sources[i]);
+	}
+	free(sources);
+	sources = NULL;
+	num_sources = 0;
+	sources_capacity = 0;
+	wake_source = NULL;
+	vnode_fn = NULL;
+
+	if (backend_fd != -1) {
+		close(backend_fd);
+		backend_fd = -1;
+	}
+}
+
+/* Wait for events and run their callbacks */
+int reactor_wait(int timeout_ms) {
+	struct kevent events[REACTOR_MAX_EVENTS];
+	struct timespec timeout;
+
+	if (timeout_ms >= 0) {
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	}
+
+	int nev = kevent(backend_fd, NULL, 0, events, REACTOR_MAX_EVENTS,
+					 timeout_ms >= 0 ? &timeout : NULL);
+	if (nev == -1) {
+		if (errno != EINTR) {
+			log_message(LOG_ERR, "Error in kevent: %s", strerror(errno));
+		}
+		return -1;
+	}
+
+	for (int i = 0; i < nev; i++) {
+		struct kevent *kev = &events[i];
+
+		switch (kev->filter) {
+			case EVFILT_VNODE:
+				if (vnode_fn) {
+					vnode_fn(kev, vnode_arg);
+				}
+				break;
+			case EVFILT_USER:
+				wake_dispatch();
+				break;
+			case EVFILT_TIMER:
+				source_dispatch(kev->udata, (uint32_t) kev->data);
+				break;
+			case EVFILT_SIGNAL:
+				source_dispatch(kev->udata, (uint32_t) kev->data);
+				break;
+			case EVFILT_READ:
+				source_dispatch(kev->udata,
+								REACTOR_READ | ((kev->flags & EV_EOF) ? REACTOR_HUP : 0));
+				break;
+			case EVFILT_WRITE:
+				source_dispatch(kev->udata,
+								REACTOR_WRITE | ((kev->flags & EV_EOF) ? REACTOR_HUP : 0));
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (reap) {
+		source_reap();
+	}
+	return nev;
+}
+
+/* Arm a one-shot or periodic timer, replacing any timer with the same ID */
+bool reactor_timer(uintptr_t id, long ms, bool periodic, reactor_fn fn, void *arg) {
+	struct kevent kev;
+	source_t *source = source_find(SOURCE_TIMER, id);
+
+	if (!source) {
+		source = source_add(SOURCE_TIMER, id, fn, arg);
+		if (!source) {
+			return false;
+		}
+	}
+
+	source->fn = fn;
+	source->arg = arg;
+	source->periodic = periodic;
+
+	/* EV_ADD on an existing timer resets its period and udata */
+	EV_SET(&kev, id, EVFILT_TIMER, EV_ADD | EV_ENABLE | (periodic ? 0 : EV_ONESHOT), 0,
+		   ms > 0 ? ms : 1, source);
+	if (kevent(backend_fd, &kev, 1, NULL, 0, NULL) == -1) {
+		log_message(LOG_ERR, "Failed to arm timer %lu: %s", (unsigned long) id, strerror(errno));
+		source_kill(source);
+		return false;
+	}
+
+	return true;
+}
+
+/* Disarm a timer, a timer that already fired is ignored */
+void reactor_cancel(uintptr_t id) {
+	struct kevent kev;
+	source_t *source = source_find(SOURCE_TIMER, id);
+	if (!source) {
+		return;
+	}
+
+	EV_SET(&kev, id, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	kevent(backend_fd, &kev, 1, NULL, 0, NULL); /* Already expired is fine */
+	source_kill(source);
+}
+
+/* Watch a descriptor for readiness */
+bool reactor_fd(int fd, uint32_t events, reactor_fn fn, void *arg) {
+	struct kevent changes[2];
+	source_t *source = source_find(SOURCE_FD, (uintptr_t) fd);
+
+	if (!source) {
+		source = source_add(SOURCE_FD, (uintptr_t) fd, fn, arg);
+		if (!source) {
+			return false;
+		}
+	}
+
+	source->fn = fn;
+	source->arg = arg;
+	source->events = events;
+
+	EV_SET(&changes[0], fd, EVFILT_READ, (events & REACTOR_READ) ? EV_ADD : EV_DELETE, 0, 0, source);
+	EV_SET(&changes[1], fd, EVFILT_WRITE, (events & REACTOR_WRITE) ? EV_ADD : EV_DELETE, 0, 0, source);
+	for (int i = 0; i < 2; i++) {
+		if (kevent(backend_fd, &changes[i], 1, NULL, 0, NULL) == -1 &&
+			(changes[i].flags & EV_ADD)) {
+			log_message(LOG_ERR, "Failed to watch descriptor %d: %s", fd, strerror(errno));
+			reactor_unwatch(fd);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Stop watching a descriptor, must be called before it is closed */
+void reactor_unwatch(int fd) {
+	struct kevent changes[2];
+	source_t *source = source_find(SOURCE_FD, (uintptr_t) fd);
+	if (!source) {
+		return;
+	}
+
+	EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	for (int i = 0; i < 2; i++) {
+		kevent(backend_fd, &changes[i], 1, NULL, 0, NULL); /* Not registered is fine */
+	}
+	source_kill(source);
+}
+
+/* Route a signal through EVFILT_SIGNAL */
+bool reactor_signal(int signo, reactor_fn fn, void *arg) {
+	struct kevent kev;
+	source_t *source = source_find(SOURCE_SIGNAL, (uintptr_t) signo);
+
+	if (source) {
+		source->fn = fn;
+		source->arg = arg;
+		return true;
+	}
+
+	source = source_add(SOURCE_SIGNAL, (uintptr_t) signo, fn, arg);
+	if (!source) {
+		return false;
+	}
+
+	EV_SET(&kev, signo, EVFILT_SIGNAL, EV_ADD | EV_ENABLE, 0, 0, source);
+	if (kevent(backend_fd, &kev, 1, NULL, 0, NULL) == -1) {
+		log_message(LOG_ERR, "Failed to register signal %d: %s", signo, strerror(errno));
+		source_kill(source);
+		return false;
+	}
+
+	/* Kqueue only records the signal, keep its default action from running.
+	 * SIGCHLD stays as is so children can still be reaped with waitpid(). */
+	if (signo != SIGCHLD) {
+		signal(signo, SIG_IGN);
+	}
+
+	return true;
+}
+
+/* Register the callback for cross-thread wakeups */
+bool reactor_wakeup(reactor_fn fn, void *arg) {
+	struct kevent kev;
+
+	if (wake_source) {
+		wake_source->fn = fn;
+		wake_source->arg = arg;
+		return true;
+	}
+
+	wake_source = source_add(SOURCE_WAKE, REACTOR_WAKE_IDENT, fn, arg);
+	if (!wake_source) {
+		return false;
+	}
+
+	EV_SET(&kev, REACTOR_WAKE_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(backend_fd, &kev, 1, NULL, 0, NULL) == -1) {
+		log_message(LOG_ERR, "Failed to register wakeup event: %s", strerror(errno));
+		source_kill(wake_source);
+		wake_source = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/* Post wake bits and interrupt the wait, safe from any thread or signal handler */
+void reactor_wake(uint32_t bits) {
+	struct kevent kev;
+
+	atomic_fetch_or(&wake_bits, bits);
+	if (backend_fd == -1) return;
+
+	EV_SET(&kev, REACTOR_WAKE_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	if (kevent(backend_fd, &kev, 1, NULL, 0, NULL) == -1) {
+		log_message(LOG_ERR, "Failed to post wakeup: %s", strerror(errno));
+	}
+}
+
+/* Get the kqueue descriptor for directory watches */
+int reactor_kqueue(void) {
+	return backend_fd;
+}
+
+/* Set the handler for directory watch events */
+void reactor_vnodes(reactor_vnode_fn fn, void *arg) {
+	vnode_fn = fn;
+	vnode_arg = arg;
+}
@@ -0,0 +1,50 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/event.h>
+
+/* Reactor configuration */
+#define REACTOR_MAX_EVENTS 256         /* Events collected per wait */
+#define REACTOR_WAKE_IDENT 1           /* EVFILT_USER identifier for cross-thread wakeups */
+
+/* Readiness bits reported to fd callbacks */
+#define REACTOR_READ 0x1               /* Descriptor is readable */
+#define REACTOR_WRITE 0x2              /* Descriptor is writable */
+#define REACTOR_HUP 0x4                /* Peer closed or descriptor failed */
+
+/* Callback for a reactor source. `ident` is the timer ID, descriptor or signal number,
+ * `data` is the timer expiration count, readiness bits, signal count or wake bits */
+typedef void (*reactor_fn)(uintptr_t ident, uint32_t data, void *arg);
+
+/* Callback for vnode events */
+typedef void (*reactor_vnode_fn)(const struct kevent *kev, void *arg);
+
+/* Reactor lifecycle */
+bool reactor_init(void);
+void reactor_cleanup(void);
+
+/* Wait for events and run their callbacks, `timeout_ms` < 0 waits indefinitely */
+int reactor_wait(int timeout_ms);
+
+/* Timers, identified by caller-chosen IDs */
+bool reactor_timer(uintptr_t id, long ms, bool periodic, reactor_fn fn, void *arg);
+void reactor_cancel(uintptr_t id);
+
+/* Descriptor readiness */
+bool reactor_fd(int fd, uint32_t events, reactor_fn fn, void *arg);
+void reactor_unwatch(int fd);
+
+/* Signal delivery, the callback runs in the loop instead of signal context */
+bool reactor_signal(int signo, reactor_fn fn, void *arg);
+
+/* Cross-thread wakeups, bits accumulate until the callback runs */
+bool reactor_wakeup(reactor_fn fn, void *arg);
+void reactor_wake(uint32_t bits);
+
+/* Native kqueue access for directory watches */
+int reactor_kqueue(void);
+void reactor_vnodes(reactor_vnode_fn fn, void *arg);
+
+#endif /* REACTOR_H */
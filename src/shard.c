@@ -0,0 +1,553 @@
+#include "shard.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "events.h"
+#include "logger.h"
+#include "monitor.h"
+#include "mounts.h"
+#include "persist.h"
+#include "plexapi.h"
+#include "utilities.h"
+
+/* Static variables for shard implementation */
+static shard_role_t role = SHARD_SINGLE;		/* Role of this process */
+static reactor_fn signal_fn = NULL;				/* Handler for termination, reload and dump signals */
+static shard_root_t *roots = NULL;				/* Library roots handed out to workers */
+static int num_roots = 0;						/* Number of library roots */
+static int roots_capacity = 0;					/* Allocated root slots */
+static shard_worker_t workers[MAX_WORKERS];		/* Worker processes of the supervisor */
+static int num_workers = 0;						/* Number of worker processes */
+static int worker_index = -1;					/* Index of this worker */
+static int upstream = -1;						/* Worker end of the supervisor socket */
+static time_t last_rebalance = 0;				/* Time of the last rebalancing round */
+
+/* Forward declarations */
+static bool shard_spawn(int index);
+static void shard_reap(uintptr_t ident, uint32_t data, void *arg);
+
+/* Prepare to split libraries across worker processes if configured */
+bool shard_init(reactor_fn signals) {
+	if (g_config.workers <= 1) {
+		return true;
+	}
+
+	role = SHARD_SUPERVISOR;
+	signal_fn = signals;
+	for (int i = 0; i < MAX_WORKERS; i++) {
+		workers[i].pid = 0;
+		workers[i].fd = -1;
+	}
+
+	/* Daemon mode ignores SIGCHLD, which would reap workers behind our back */
+	signal(SIGCHLD, SIG_DFL);
+	if (!reactor_signal(SIGCHLD, shard_reap, NULL)) {
+		log_message(LOG_ERR, "Failed to watch for exiting worker processes");
+		role = SHARD_SINGLE;
+		return false;
+	}
+
+	last_rebalance = time(NULL);
+	log_message(LOG_INFO, "Supervising up to %d worker processes", g_config.workers);
+	return true;
+}
+
+/* Whether this process hands libraries out instead of watching them */
+bool shard_supervisor(void) {
+	return role == SHARD_SUPERVISOR;
+}
+
+/* Index of this worker, -1 in the supervisor or a single process */
+int shard_index(void) {
+	return worker_index;
+}
+
+/* Record a library root for a worker to watch */
+bool shard_assign(const char *path, int server, int section_id) {
+	if (num_roots >= roots_capacity) {
+		int new_capacity = roots_capacity > 0 ? roots_capacity * 2 : 8;
+		shard_root_t *new_roots = realloc(roots, new_capacity * sizeof(shard_root_t));
+		if (!new_roots) {
+			log_message(LOG_ERR, "Failed to allocate memory for library roots");
+			return false;
+		}
+		roots = new_roots;
+		roots_capacity = new_capacity;
+	}
+
+	char *copy = strdup(path);
+	if (!copy) {
+		log_message(LOG_ERR, "Failed to allocate memory for library root");
+		return false;
+	}
+
+	roots[num_roots].path = copy;
+	roots[num_roots].server = server;
+	roots[num_roots].section_id = section_id;
+	roots[num_roots].worker = -1;
+	roots[num_roots].weight = 1;
+	num_roots++;
+	return true;
+}
+
+/* Count the roots owned by a worker */
+static int shard_roots(int index) {
+	int count = 0;
+	for (int i = 0; i < num_roots; i++) {
+		if (roots[i].worker == index) count++;
+	}
+	return count;
+}
+
+/* Start the worker processes, round-robin until their loads are known */
+bool shard_start(void) {
+	if (role != SHARD_SUPERVISOR) {
+		return true;
+	}
+
+	num_workers = g_config.workers < num_roots ? g_config.workers : num_roots;
+	if (num_workers == 0) {
+		log_message(LOG_WARNING, "No libraries to hand out to worker processes");
+		return true;
+	}
+
+	for (int i = 0; i < num_roots; i++) {
+		roots[i].worker = i % num_workers;
+	}
+
+	int started = 0;
+	for (int i = 0; i < num_workers; i++) {
+		if (shard_spawn(i)) {
+			started++;
+		}
+	}
+
+	log_message(LOG_INFO, "Started %d of %d worker processes for %d libraries",
+				started, num_workers, num_roots);
+	return started > 0;
+}
+
+/* Report the number of directories watched under each root of this worker */
+static void shard_report(uintptr_t ident, uint32_t data, void *arg) {
+	(void) ident;
+	(void) data;
+	(void) arg;
+
+	shard_record_t record;
+	memset(&record, 0, offsetof(shard_record_t, path));
+	record.type = SHARD_WEIGHT;
+
+	for (int i = 0; i < num_roots; i++) {
+		if (roots[i].worker != worker_index) continue;
+
+		record.root = i;
+		record.value = monitor_weight(roots[i].path);
+		if (send(upstream, &record, offsetof(shard_record_t, path), MSG_NOSIGNAL) == -1) {
+			log_message(LOG_WARNING, "Failed to report load to supervisor: %s", strerror(errno));
+			return;
+		}
+	}
+}
+
+/* Send a scan to the supervisor, returns false if it could not take it */
+static bool shard_send(const char *path, time_t deadline) {
+	shard_record_t record;
+	size_t length = strlen(path);
+	if (length >= sizeof(record.path)) {
+		log_message(LOG_WARNING, "Path too long to forward: %s", path);
+		return true;
+	}
+
+	record.type = SHARD_SCAN;
+	record.root = -1;
+	record.value = (int64_t) deadline;
+	memcpy(record.path, path, length + 1);
+
+	if (send(upstream, &record, offsetof(shard_record_t, path) + length + 1, MSG_NOSIGNAL) == -1) {
+		log_message(LOG_ERR, "Failed to forward scan of %s to supervisor: %s", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Hand a due scan to the supervisor, returns false when this is not a worker */
+bool shard_forward(const char *path, time_t deadline) {
+	if (role != SHARD_WORKER) {
+		return false;
+	}
+
+	shard_send(path, deadline);
+	return true;
+}
+
+/* Hand a pending scan to the supervisor before this worker exits, returns false
+ * when this is not a worker or the supervisor could not take it */
+bool shard_handoff(const char *path, time_t deadline) {
+	return role == SHARD_WORKER && shard_send(path, deadline);
+}
+
+/* Tell the worker watching a path that Plex was asked to scan it, returns false when this is
+ * not the supervisor */
+bool shard_sent(const char *path) {
+	if (role != SHARD_SUPERVISOR) {
+		return false;
+	}
+
+	/* The deepest root holding the path belongs to the worker watching it */
+	int owner = -1;
+	size_t owner_len = 0;
+	for (int i = 0; i < num_roots; i++) {
+		size_t len = strlen(roots[i].path);
+		if (len > owner_len && (strcmp(roots[i].path, path) == 0 || path_contains(roots[i].path, path))) {
+			owner = roots[i].worker;
+			owner_len = len;
+		}
+	}
+
+	shard_record_t record;
+	size_t length = strlen(path);
+	if (owner < 0 || workers[owner].fd < 0 || length >= sizeof(record.path)) {
+		return true;
+	}
+
+	record.type = SHARD_SENT;
+	record.root = -1;
+	record.value = 0;
+	memcpy(record.path, path, length + 1);
+
+	/* Losing one only costs a scan Plex would have caused anyway */
+	if (send(workers[owner].fd, &record, offsetof(shard_record_t, path) + length + 1,
+			 MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+		log_message(LOG_DEBUG, "Failed to tell worker %d about the scan of %s: %s", owner, path,
+					strerror(errno));
+	}
+	return true;
+}
+
+/* Read scans sent on behalf of this worker, and stop it once the supervisor is gone since
+ * nothing would dispatch its scans */
+static void shard_upstream(uintptr_t ident, uint32_t data, void *arg) {
+	(void) arg;
+	shard_record_t record;
+	ssize_t length;
+
+	while ((length = recv((int) ident, &record, sizeof(record), MSG_DONTWAIT)) > 0) {
+		if (length > (ssize_t) offsetof(shard_record_t, path) && record.type == SHARD_SENT) {
+			record.path[sizeof(record.path) - 1] = '\0';
+			events_sent(record.path);
+		}
+	}
+
+	if (length == 0 || (data & REACTOR_HUP)) {
+		log_message(LOG_WARNING, "Supervisor went away, stopping worker %d", worker_index);
+		reactor_unwatch((int) ident);
+		monitor_exit();
+	}
+}
+
+/* Run as a worker watching the roots assigned to it, never returns */
+static void shard_run(int index, int fd) {
+	/* Drop the supervisor's state, the kqueue does not survive fork() anyway */
+	for (int i = 0; i < num_workers; i++) {
+		if (workers[i].fd >= 0) {
+			close(workers[i].fd);
+			workers[i].fd = -1;
+		}
+	}
+	reactor_cleanup();
+	monitor_cleanup();
+
+	role = SHARD_WORKER;
+	worker_index = index;
+	upstream = fd;
+
+	int status = EXIT_FAILURE;
+	if (reactor_init() && monitor_init()) {
+		reactor_signal(SIGINT, signal_fn, NULL);
+		reactor_signal(SIGHUP, signal_fn, NULL);
+		reactor_signal(SIGTERM, signal_fn, NULL);
+		reactor_signal(SIGUSR1, signal_fn, NULL);
+		reactor_timer(TIMER_SHARD_REPORT, SHARD_REPORT_INTERVAL * 1000L, true, shard_report, NULL);
+		if (!reactor_fd(upstream, REACTOR_READ, shard_upstream, NULL)) {
+			log_message(LOG_WARNING, "Failed to watch supervisor socket");
+		}
+		for (int i = 0; i < num_roots; i++) {
+			if (roots[i].worker != index) continue;
+
+			log_message(LOG_INFO, "Worker %d monitoring library: %s (section %d)",
+						index, roots[i].path, roots[i].section_id);
+			if (!monitor_library(roots[i].path, roots[i].server, roots[i].section_id)) {
+				log_message(LOG_WARNING, "Failed to add directory %s to watch list", roots[i].path);
+			}
+		}
+		persist_start();
+
+		if (monitor_loop()) {
+			status = EXIT_SUCCESS;
+		}
+
+		/* Whoever watches these roots next does not know the changes queued here */
+		events_handoff();
+	}
+
+	persist_cleanup();
+	monitor_cleanup();
+	mounts_cleanup();
+	events_cleanup();
+	dircache_cleanup();
+	reactor_cleanup();
+	close(upstream);
+	_exit(status);
+}
+
+/* Move roots between workers when the current split is clearly worse than a fresh plan */
+static void shard_rebalance(void) {
+	if (num_workers < 2 || time(NULL) - last_rebalance < SHARD_REBALANCE_INTERVAL) {
+		return;
+	}
+
+	/* Every worker must have reported its load before it can be compared */
+	for (int i = 0; i < num_workers; i++) {
+		if (workers[i].pid == 0 || !workers[i].reported) return;
+	}
+
+	long current[MAX_WORKERS] = { 0 };
+	long planned[MAX_WORKERS] = { 0 };
+	int *plan = malloc(num_roots * sizeof(int));
+	int *order = malloc(num_roots * sizeof(int));
+	if (!plan || !order) {
+		free(plan);
+		free(order);
+		return;
+	}
+
+	/* Heaviest roots first, each to the least loaded worker, preferring its current one */
+	for (int i = 0; i < num_roots; i++) {
+		current[roots[i].worker] += roots[i].weight;
+		order[i] = i;
+	}
+	for (int i = 1; i < num_roots; i++) {
+		int key = order[i], j = i - 1;
+		while (j >= 0 && roots[order[j]].weight < roots[key].weight) {
+			order[j + 1] = order[j];
+			j--;
+		}
+		order[j + 1] = key;
+	}
+	for (int i = 0; i < num_roots; i++) {
+		int r = order[i];
+		int best = roots[r].worker;
+		for (int w = 0; w < num_workers; w++) {
+			if (planned[w] < planned[best]) best = w;
+		}
+		plan[r] = best;
+		planned[best] += roots[r].weight;
+	}
+
+	long current_max = 0, planned_max = 0;
+	for (int w = 0; w < num_workers; w++) {
+		if (current[w] > current_max) current_max = current[w];
+		if (planned[w] > planned_max) planned_max = planned[w];
+	}
+	last_rebalance = time(NULL);
+
+	if (current_max * 100 <= planned_max * (100 + SHARD_IMBALANCE)) {
+		free(plan);
+		free(order);
+		return;
+	}
+
+	log_message(LOG_INFO, "Rebalancing libraries, busiest worker watches %ld directories, %ld after",
+				current_max, planned_max);
+
+	/* Restart both ends of every move, the new owner crawls the root again */
+	for (int i = 0; i < num_roots; i++) {
+		if (plan[i] == roots[i].worker) continue;
+
+		log_message(LOG_INFO, "Moving library %s from worker %d to worker %d",
+					roots[i].path, roots[i].worker, plan[i]);
+		workers[roots[i].worker].restart = true;
+		workers[plan[i]].restart = true;
+		roots[i].worker = plan[i];
+	}
+	for (int w = 0; w < num_workers; w++) {
+		if (workers[w].restart && workers[w].pid > 0) {
+			kill(workers[w].pid, SIGTERM);
+		}
+	}
+
+	free(plan);
+	free(order);
+}
+
+/* Read records from a worker */
+static void shard_receive(uintptr_t ident, uint32_t data, void *arg) {
+	shard_worker_t *worker = arg;
+	shard_record_t record;
+	ssize_t length;
+
+	while ((length = recv((int) ident, &record, sizeof(record), MSG_DONTWAIT)) > 0) {
+		if (length < (ssize_t) offsetof(shard_record_t, path)) {
+			continue;
+		}
+
+		if (record.type == SHARD_SCAN) {
+			record.path[sizeof(record.path) - 1] = '\0';
+			plexapi_submit(record.path, (time_t) record.value);
+		} else if (record.type == SHARD_WEIGHT && record.root >= 0 && record.root < num_roots) {
+			roots[record.root].weight = record.value > 0 ? (int) record.value : 1;
+			worker->reported = true;
+		}
+	}
+
+	/* The worker is gone, SIGCHLD takes care of restarting it */
+	if (length == 0 || (data & REACTOR_HUP)) {
+		reactor_unwatch(worker->fd);
+		close(worker->fd);
+		worker->fd = -1;
+		return;
+	}
+
+	shard_rebalance();
+}
+
+/* Start a worker process */
+static bool shard_spawn(int index) {
+	int pair[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1) {
+		log_message(LOG_ERR, "Failed to create worker socket: %s", strerror(errno));
+		return false;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_message(LOG_ERR, "Failed to fork worker process: %s", strerror(errno));
+		close(pair[0]);
+		close(pair[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		close(pair[0]);
+		shard_run(index, pair[1]);
+	}
+
+	close(pair[1]);
+	workers[index].pid = pid;
+	workers[index].fd = pair[0];
+	workers[index].restart = false;
+	workers[index].reported = false;
+
+	if (!reactor_fd(pair[0], REACTOR_READ, shard_receive, &workers[index])) {
+		log_message(LOG_ERR, "Failed to watch worker %d socket", index);
+	}
+
+	log_message(LOG_INFO, "Started worker %d (pid %d) for %d libraries",
+				index, (int) pid, shard_roots(index));
+	return true;
+}
+
+/* Restart a worker after its backoff */
+static void shard_respawn(uintptr_t ident, uint32_t data, void *arg) {
+	(void) data;
+	(void) arg;
+
+	int index = (int) (ident - TIMER_SHARD_BASE);
+	if (g_running && workers[index].pid == 0) {
+		shard_spawn(index);
+	}
+}
+
+/* Collect exited workers and bring them back */
+static void shard_reap(uintptr_t ident, uint32_t data, void *arg) {
+	(void) ident;
+	(void) data;
+	(void) arg;
+
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (int i = 0; i < num_workers; i++) {
+			if (workers[i].pid != pid) continue;
+
+			workers[i].pid = 0;
+			if (workers[i].fd >= 0) {
+				/* Take the scans it handed over before exiting */
+				shard_receive((uintptr_t) workers[i].fd, 0, &workers[i]);
+			}
+			if (workers[i].fd >= 0) {
+				reactor_unwatch(workers[i].fd);
+				close(workers[i].fd);
+				workers[i].fd = -1;
+			}
+
+			if (!g_running) {
+				break;
+			}
+
+			/* Rebalanced workers come back at once, crashed ones after a pause */
+			if (workers[i].restart) {
+				shard_spawn(i);
+			} else {
+				log_message(LOG_WARNING, "Worker %d (pid %d) exited with status %d, restarting in %ds",
+							i, (int) pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+							SHARD_RESPAWN_DELAY);
+				reactor_timer(TIMER_SHARD_BASE + i, SHARD_RESPAWN_DELAY * 1000L, false,
+							  shard_respawn, NULL);
+			}
+			break;
+		}
+	}
+}
+
+/* Pass reload and dump requests on to the workers */
+void shard_signal(int signo) {
+	if (role != SHARD_SUPERVISOR) {
+		return;
+	}
+
+	for (int i = 0; i < num_workers; i++) {
+		if (workers[i].pid > 0) {
+			kill(workers[i].pid, signo);
+		}
+	}
+}
+
+/* Stop the workers and free the shard table */
+void shard_cleanup(void) {
+	if (role == SHARD_SUPERVISOR) {
+		for (int i = 0; i < num_workers; i++) {
+			reactor_cancel(TIMER_SHARD_BASE + i);
+			if (workers[i].fd >= 0) {
+				reactor_unwatch(workers[i].fd);
+				close(workers[i].fd);
+				workers[i].fd = -1;
+			}
+			if (workers[i].pid > 0) {
+				kill(workers[i].pid, SIGTERM);
+				waitpid(workers[i].pid, NULL, 0);
+				workers[i].pid = 0;
+			}
+		}
+		num_workers = 0;
+	}
+
+	for (int i = 0; i < num_roots; i++) {
+		free(roots[i].path);
+	}
+	free(roots);
+	roots = NULL;
+	num_roots = 0;
+	roots_capacity = 0;
+	role = SHARD_SINGLE;
+}
@@ -0,0 +1,71 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "config.h"
+#include "reactor.h"
+
+/* Shard configuration */
+#define SHARD_REPORT_INTERVAL 300      /* Seconds between worker load reports */
+#define SHARD_REBALANCE_INTERVAL 3600  /* Minimum seconds between rebalancing rounds */
+#define SHARD_IMBALANCE 25             /* Percent the busiest worker may exceed the best plan by */
+#define SHARD_RESPAWN_DELAY 5          /* Seconds before a crashed worker is restarted */
+#define TIMER_SHARD_REPORT 100         /* Timer identifier for worker load reports */
+#define TIMER_SHARD_BASE 101           /* Timer identifier base for worker restarts */
+
+/* Role of this process */
+typedef enum {
+	SHARD_SINGLE,                      /* Watches every library itself */
+	SHARD_SUPERVISOR,                  /* Hands libraries to workers and dispatches their scans */
+	SHARD_WORKER                       /* Watches its shard and forwards due scans */
+} shard_role_t;
+
+/* Record types sent from workers to the supervisor, and back for SHARD_SENT */
+#define SHARD_SCAN 1                   /* A due scan for the supervisor to dispatch */
+#define SHARD_WEIGHT 2                 /* Number of directories watched under a root */
+#define SHARD_SENT 3                   /* A scan sent to Plex, for the worker watching its path */
+
+/* Record sent over a worker socket, only the used part of the path is sent */
+typedef struct shard_record {
+	int32_t type;                      /* SHARD_SCAN, SHARD_WEIGHT or SHARD_SENT */
+	int32_t root;                      /* Root index for weight records */
+	int64_t value;                     /* Scan deadline or root weight */
+	char path[PATH_MAX_LEN];           /* Directory to scan or scanned */
+} shard_record_t;
+
+/* Library root handed out to a worker */
+typedef struct shard_root {
+	char *path;                        /* Library root path */
+	int server;                        /* Index of the Plex server reporting the library */
+	int section_id;                    /* Associated Plex library section ID on that server */
+	int worker;                        /* Worker owning the root */
+	int weight;                        /* Directories watched under the root, 1 until reported */
+} shard_root_t;
+
+/* Worker process watching a shard of the library roots */
+typedef struct shard_worker {
+	pid_t pid;                         /* Process ID, 0 if not running */
+	int fd;                            /* Supervisor end of the worker socket, -1 if closed */
+	bool restart;                      /* Restart at once when it exits, for rebalancing */
+	bool reported;                     /* Whether the worker reported its load since starting */
+} shard_worker_t;
+
+/* Shard lifecycle management */
+bool shard_init(reactor_fn signals);
+bool shard_start(void);
+void shard_cleanup(void);
+
+/* Shard operations */
+bool shard_supervisor(void);
+int shard_index(void);
+bool shard_assign(const char *path, int server, int section_id);
+bool shard_forward(const char *path, time_t deadline);
+bool shard_handoff(const char *path, time_t deadline);
+bool shard_sent(const char *path);
+void shard_signal(int signo);
+
+#endif /* SHARD_H */
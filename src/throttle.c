@@ -0,0 +1,80 @@
+#include "throttle.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "logger.h"
+
+static double pressure = 0.0;          /* Last sampled pressure in percent */
+static time_t sampled = 0;             /* Monotonic time of the last sample */
+static bool paused = false;            /* Whether crawls are currently paused */
+
+/* Sample system pressure from the load average */
+static double throttle_sample(void) {
+	/* A load of two runnable tasks per CPU counts as full pressure */
+	double load;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (getloadavg(&load, 1) != 1) {
+		return 0.0;
+	}
+	if (cpus < 1) cpus = 1;
+
+	double value = 100.0 * load / (2.0 * cpus);
+	return value > 100.0 ? 100.0 : value;
+}
+
+/* Get the current system pressure in percent, resampled at most once per interval */
+double throttle_pressure(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (sampled == 0 || now.tv_sec - sampled >= THROTTLE_SAMPLE_INTERVAL) {
+		pressure = throttle_sample();
+		sampled = now.tv_sec;
+	}
+
+	return pressure;
+}
+
+/* Get how many directories the next crawl batch may read and the pause before it in ms */
+long throttle_pace(int *batch) {
+	int low = g_config.throttle_low;
+	int high = g_config.throttle_high;
+
+	/* Throttling disabled */
+	if (high <= 0) {
+		*batch = CRAWL_BATCH_MAX;
+		return 0;
+	}
+
+	double value = throttle_pressure();
+
+	/* Under heavy pressure, only check back later */
+	if (value >= high) {
+		if (!paused) {
+			log_message(LOG_INFO, "System pressure at %.1f%%, pausing directory crawls", value);
+			paused = true;
+		}
+		*batch = 0;
+		return THROTTLE_MAX_DELAY;
+	}
+
+	if (paused) {
+		log_message(LOG_INFO, "System pressure down to %.1f%%, resuming directory crawls", value);
+		paused = false;
+	}
+
+	/* Idle, full speed */
+	if (value <= low) {
+		*batch = CRAWL_BATCH_MAX;
+		return 0;
+	}
+
+	/* In between, shrink the batches and stretch the pauses with the pressure */
+	double fraction = (value - low) / (high - low);
+	*batch = CRAWL_BATCH_MAX - (int) (fraction * (CRAWL_BATCH_MAX - CRAWL_BATCH_MIN));
+	return (long) (fraction * THROTTLE_MAX_DELAY);
+}
@@ -0,0 +1,14 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+/* Crawl throttle configuration */
+#define THROTTLE_SAMPLE_INTERVAL 1     /* Seconds between pressure samples */
+#define THROTTLE_MAX_DELAY 5000        /* Pause between crawl batches at full pressure in ms */
+#define CRAWL_BATCH_MIN 8              /* Directories read per batch just below the pause threshold */
+#define CRAWL_BATCH_MAX 256            /* Directories read per batch on an idle system */
+
+/* Crawl pacing */
+double throttle_pressure(void);
+long throttle_pace(int *batch);
+
+#endif /* THROTTLE_H */
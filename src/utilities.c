@@ -1,12 +1,15 @@
 #include "utilities.h"
 
 #include <errno.h>
+#include <fnmatch.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/dirent.h>
 #include <sys/stat.h>
 
+#include "config.h"
 #include "logger.h"
 
 /* Check if a path is a directory, using d_type for optimization */
@@ -34,3 +37,52 @@ bool is_directory(const char *path, int d_type) {
 
 	return S_ISDIR(st.st_mode);
 }
+
+/* Check if a path lies strictly below a parent directory */
+bool path_contains(const char *parent, const char *path) {
+	size_t parent_len = strlen(parent);
+
+	return strncmp(parent, path, parent_len) == 0 && path[parent_len] == '/';
+}
+
+/* Check if a file name has the extension of a video or audio file Plex would import */
+bool is_media_file(const char *name) {
+	static const char *extensions[] = {
+		"mkv", "mp4", "m4v", "avi", "mov", "wmv", "mpg", "mpeg", "ts", "m2ts", "webm", "flv",
+		"iso", "mp3", "flac", "m4a", "aac", "ogg", "opus", "wav", "alac", "aiff", "wma", NULL
+	};
+
+	const char *dot = strrchr(name, '.');
+	if (!dot || dot == name) {
+		return false;
+	}
+
+	for (int i = 0; extensions[i]; i++) {
+		if (strcasecmp(dot + 1, extensions[i]) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Check if a file name matches one of the configured patterns of files Plex writes itself */
+bool is_plex_file(const char *name) {
+	const char *p = g_config.echo_patterns;
+	char pattern[256];
+
+	while (*p) {
+		p += strspn(p, ", \t");
+		size_t len = strcspn(p, ",");
+		while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) len--;
+
+		if (len > 0 && len < sizeof(pattern)) {
+			memcpy(pattern, p, len);
+			pattern[len] = '\0';
+			if (fnmatch(pattern, name, FNM_CASEFOLD) == 0) {
+				return true;
+			}
+		}
+		p += strcspn(p, ",");
+	}
+	return false;
+}
@@ -7,5 +7,8 @@
 
 /* Filesystem utility functions */
 bool is_directory(const char *path, int d_type);
+bool path_contains(const char *parent, const char *path);
+bool is_media_file(const char *name);
+bool is_plex_file(const char *name);
 
 #endif /* UTILITIES_H */